@@ -19,6 +19,22 @@ else
     echo "Working out version number to use... $(tput setaf 3)GIT-TAG based$(tput sgr0)."
 fi
 
+if [ "$1" == "bench" ]
+then
+    # benchmark build: runs the control cycle against a fake w1/GPIO tree under bench_root
+    bench_root=${2:-/run/shm/$daemon_name-bench}
+    gcc -D_FORTIFY_SOURCE=2 -DPGMVER=\"$daemon_ver\" -DBENCHMARK -DSOLARD_ROOT=\"$bench_root\" -Wall -Wno-unused-result -O3 -pthread \
+        -o $daemon_name-bench $daemon_name.c -lz
+    if (( $? > 0 ))
+    then
+        echo "$(tput setaf 7)$(tput setab 1)ERROR: Benchmark compilation failed!$(tput sgr0)"
+        exit 1
+    fi
+    echo "$(tput setaf 2)$(tput smso)Benchmark compilation SUCCESS!$(tput rmso)$(tput sgr0) Run" \
+         "$(tput setaf 6)./$daemon_name-bench [--cycles=N] [--ops=N] [--w1-latency-us=N] [--gpio-latency-us=N] [--count-syscalls] [--no-uring] [--check-rules=N]$(tput sgr0)"
+    exit 0
+fi
+
 if [ -e $daemon_name ]
 then
 #    echo "$(tput setaf 3)Previous compile result: still present.$(tput sgr0)"
@@ -26,7 +42,7 @@ then
 #    echo "$(tput setaf 3)Previous compile result: renamed for now.$(tput sgr0)"
 fi
 
-gcc -D_FORTIFY_SOURCE=2 -DPGMVER=\"$daemon_ver\" -Wall -Wno-unused-result -O3 -o $daemon_name $daemon_name.c
+gcc -D_FORTIFY_SOURCE=2 -DPGMVER=\"$daemon_ver\" -Wall -Wno-unused-result -O3 -pthread -o $daemon_name $daemon_name.c -lz
 if (( $? > 0 ))
 then
     mv $daemon_name.prev $daemon_name
@@ -37,4 +53,20 @@ else
     echo "$(tput setaf 3)Previous compile result: removed.$(tput sgr0)"
     echo "$(tput setaf 2)$(tput smso)Compilation SUCCESS!$(tput rmso)$(tput sgr0)"
 fi
+
+gcc -D_FORTIFY_SOURCE=2 -Wall -Wno-unused-result -O3 -o $daemon_name-events $daemon_name-events.c
+if (( $? > 0 ))
+then
+    echo "$(tput setaf 7)$(tput setab 1)ERROR: $daemon_name-events compilation failed!$(tput sgr0)"
+else
+    echo "$(tput setaf 2)$daemon_name-events compilation SUCCESS!$(tput sgr0)"
+fi
+
+gcc -D_FORTIFY_SOURCE=2 -Wall -Wno-unused-result -O3 -pthread -o $daemon_name-tune $daemon_name-tune.c -lz
+if (( $? > 0 ))
+then
+    echo "$(tput setaf 7)$(tput setab 1)ERROR: $daemon_name-tune compilation failed!$(tput sgr0)"
+else
+    echo "$(tput setaf 2)$daemon_name-tune compilation SUCCESS!$(tput sgr0)"
+fi
 #EOF
\ No newline at end of file
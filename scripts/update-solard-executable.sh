@@ -1,11 +1,25 @@
 #!/bin/bash
 service_name=solard
 src_dir=/home/pi/$service_name
+pid_file=/run/$service_name.pid
 
-service $service_name stop
-cp $src_dir/$service_name /usr/bin
-chown root:root /usr/bin/$service_name
-chmod a+x /usr/bin/$service_name
-sleep 6
-service $service_name start
+# put the new executable next to the old one, then rename it over - the running
+# daemon keeps its (now unlinked) executable, so there is no "text file busy"
+cp $src_dir/$service_name /usr/bin/$service_name.new
+chown root:root /usr/bin/$service_name.new
+chmod a+x /usr/bin/$service_name.new
+mv -f /usr/bin/$service_name.new /usr/bin/$service_name
+if [ -e $src_dir/$service_name-events ]
+then
+    cp $src_dir/$service_name-events /usr/bin/$service_name-events
+    chmod a+x /usr/bin/$service_name-events
+fi
 
+if [ -e $pid_file ] && kill -0 `cat $pid_file` 2>/dev/null
+then
+    # hand over to the new executable without stopping - relays stay as they are
+    kill -USR2 `cat $pid_file`
+    echo "Asked running $service_name to hand over to the new executable - check its log."
+else
+    service $service_name start
+fi
@@ -0,0 +1,250 @@
+/*
+* solard-events.c
+*
+* Query tool for the solard event log.
+* Plamen Petrov
+*
+* Prints the events solard recorded in /var/log/solard_events that match the given
+* time range, minimal severity, event name and sensor. Only the index and the records
+* of the days in the range are read, so a query stays quick however long the log is.
+*
+* Examples:
+*   solard-events --severity=alarm --in=2026-03        all ALARMs in March 2026
+*   solard-events --event=battery --from=7d            battery switches in the last 7 days
+*   solard-events --in=today                           everything today
+*/
+
+#ifndef SOLARD_ROOT
+#define SOLARD_ROOT     ""
+#endif
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "solard_events.h"
+
+#define RECORDS_PER_READ    256
+
+const char *events_file = EVENTS_FILE;
+const char *index_file = EVENTS_INDEX;
+
+void
+usage() {
+    fprintf( stderr, "Usage: solard-events [options]\n"\
+    "  --from=WHEN         events from WHEN on\n"\
+    "  --to=WHEN           events before WHEN\n"\
+    "  --in=PERIOD         events in a month (YYYY-MM), a day (YYYY-MM-DD) or \"today\"\n"\
+    "  --severity=LEVEL    info, warning or alarm - this level and above\n"\
+    "  --event=NAME        only this event (see --list)\n"\
+    "  --sensor=N          only events about sensor N\n"\
+    "  --count             only print the number of matching events\n"\
+    "  --file=PATH         event log to read, its index is PATH.idx\n"\
+    "  --list              list event names\n"\
+    "WHEN is YYYY-MM[-DD[ HH:MM[:SS]]] local time, \"today\", or Nd/Nh/Nm ago\n" );
+    exit( 1 );
+}
+
+/* Parse when into a time; with period non-NULL also sets *period_end to the end of the
+month or day when names. Returns 0 if when does not make sense. */
+short
+parse_when( const char *when, time_t *t, time_t *period_end ) {
+    struct tm tm;
+    char *end;
+    long n;
+    int fields;
+
+    if ( strcmp( when, "today" ) == 0 ) {
+        *t = time(NULL);
+        localtime_r( t, &tm );
+        tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+        tm.tm_isdst = -1;
+        *t = mktime( &tm );
+        if ( period_end ) { tm.tm_mday++; tm.tm_isdst = -1; *period_end = mktime( &tm ); }
+        return 1;
+    }
+    n = strtol( when, &end, 10 );
+    if ( (end != when) && (end[1] == 0) && (n >= 0) ) {
+        switch ( *end ) {
+            case 'd': *t = time(NULL) - n*86400; break;
+            case 'h': *t = time(NULL) - n*3600; break;
+            case 'm': *t = time(NULL) - n*60; break;
+            default: return 0;
+        }
+        if ( period_end ) *period_end = time(NULL) + 1;
+        return 1;
+    }
+    memset( &tm, 0, sizeof tm );
+    tm.tm_mday = 1;
+    fields = sscanf( when, "%d-%d-%d %d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour,
+    &tm.tm_min, &tm.tm_sec );
+    if ( (fields < 2) || (fields == 4) ) return 0;
+    tm.tm_year -= 1900;
+    tm.tm_mon--;
+    tm.tm_isdst = -1;
+    *t = mktime( &tm );
+    if ( *t == -1 ) return 0;
+    if ( period_end ) {
+        if ( fields == 2 ) tm.tm_mon++;
+        else if ( fields == 3 ) tm.tm_mday++;
+        else tm.tm_min++;
+        tm.tm_isdst = -1;
+        *period_end = mktime( &tm );
+    }
+    return 1;
+}
+
+/* what the id and values of r mean, see solard_events.h */
+void
+describe( const struct event_record *r, char *buf, size_t len ) {
+    static const char *starts[] = { "afresh", "state resumed", "taken over" };
+    static const char *responses[] = { "solar_pump_collector", "solar_pump_boiler_low", "furnace_pump", "valve" };
+
+    switch ( r->code ) {
+        case EV_START:
+        snprintf( buf, len, "%s", starts[(r->id >= 0 && r->id <= 2) ? r->id : 0] );
+        break;
+        case EV_CONFIG:
+        snprintf( buf, len, "mode=%.0f wanted=%.0f", r->values[0], r->values[1] );
+        break;
+        case EV_EMERGENCY:
+        case EV_EMERGENCY_OVER:
+        snprintf( buf, len, "furnace=%.1f collector=%.1f boiler_high=%.1f", r->values[0], r->values[1], r->values[2] );
+        break;
+        case EV_SENSOR_FAULT:
+        snprintf( buf, len, "sensor=%d status=%.0f errors=%.0f", r->id, r->values[0], r->values[1] );
+        break;
+        case EV_SENSOR_OK:
+        snprintf( buf, len, "sensor=%d temp=%.3f", r->id, r->values[0] );
+        break;
+        case EV_SENSOR_STOP:
+        snprintf( buf, len, "sensor=%d errors=%.0f", r->id, r->values[0] );
+        break;
+        case EV_ANOMALY:
+        snprintf( buf, len, "%s changed=%.2f usual=%.2f score=%.1f", (r->id >= 0 && r->id <= 3) ? responses[r->id] : "?",
+        r->values[0], r->values[1], r->values[2] );
+        break;
+        case EV_COUNTERS_RESET:
+        snprintf( buf, len, "nightly=%.1f Wh total=%.1f Wh", r->values[0], r->values[1] );
+        break;
+        default:
+        buf[0] = 0;
+    }
+}
+
+short
+sensor_event( short code ) {
+    return ( (code == EV_SENSOR_FAULT) || (code == EV_SENSOR_OK) || (code == EV_SENSOR_STOP) );
+}
+
+int
+main(int argc, char *argv[])
+{
+    static struct event_record r[RECORDS_PER_READ];
+    struct event_day *days = NULL;
+    struct stat st;
+    struct tm tm;
+    time_t from = 0, to = 0, t;
+    char stamp[30], detail[100], index_path[300];
+    short severity = EV_INFO, code = -1, sensor = -1, count_only = 0, s;
+    long ndays, d, i, n, got, matched = 0, read_records = 0, total;
+    long by_severity[EV_SEVERITIES] = { 0, 0, 0 };
+    int fd, ifd;
+
+    for (i=1;i<argc;i++) {
+        if ( strncmp( argv[i], "--from=", 7 ) == 0 ) {
+            if ( !parse_when( argv[i]+7, &from, NULL ) ) usage();
+        }
+        else if ( strncmp( argv[i], "--to=", 5 ) == 0 ) {
+            if ( !parse_when( argv[i]+5, &to, NULL ) ) usage();
+        }
+        else if ( strncmp( argv[i], "--in=", 5 ) == 0 ) {
+            if ( !parse_when( argv[i]+5, &from, &to ) ) usage();
+        }
+        else if ( strncmp( argv[i], "--severity=", 11 ) == 0 ) {
+            for (severity=0; severity<EV_SEVERITIES; severity++)
+                if ( strcasecmp( argv[i]+11, event_severity_names[severity] ) == 0 ) break;
+            if ( severity == EV_SEVERITIES ) usage();
+        }
+        else if ( strncmp( argv[i], "--event=", 8 ) == 0 ) {
+            for (code=1; code<EV_CODES; code++) if ( strcmp( argv[i]+8, event_names[code] ) == 0 ) break;
+            if ( code == EV_CODES ) usage();
+        }
+        else if ( strncmp( argv[i], "--sensor=", 9 ) == 0 ) sensor = atoi( argv[i]+9 );
+        else if ( strcmp( argv[i], "--count" ) == 0 ) count_only = 1;
+        else if ( strncmp( argv[i], "--file=", 7 ) == 0 ) {
+            events_file = argv[i]+7;
+            snprintf( index_path, sizeof index_path, "%s.idx", events_file );
+            index_file = index_path;
+        }
+        else if ( strcmp( argv[i], "--list" ) == 0 ) {
+            for (code=1; code<EV_CODES; code++) printf( "%s\n", event_names[code] );
+            exit( 0 );
+        }
+        else usage();
+    }
+    if ( !to ) to = time(NULL) + 1;
+
+    fd = open( events_file, O_RDONLY );
+    ifd = open( index_file, O_RDONLY );
+    if ( (fd == -1) || (ifd == -1) ) {
+        fprintf( stderr, "Cannot open %s or %s!\n", events_file, index_file );
+        exit( 2 );
+    }
+    if ( fstat( fd, &st ) ) exit( 2 );
+    total = st.st_size / sizeof r[0];
+    if ( fstat( ifd, &st ) ) exit( 2 );
+    ndays = st.st_size / sizeof *days;
+    if ( ndays ) {
+        days = malloc( ndays * sizeof *days );
+        if ( !days || (read( ifd, days, ndays * sizeof *days ) != (ssize_t)(ndays * sizeof *days)) ) {
+            fprintf( stderr, "Cannot read %s!\n", index_file );
+            exit( 2 );
+        }
+    }
+    close( ifd );
+
+    for (d=0; d<ndays; d++) {
+        /* a UTC day overlaps the range in any time zone if within a day of it */
+        if ( (days[d].day + 2) * 86400 <= from ) continue;
+        if ( (days[d].day - 1) * 86400 >= to ) break;
+        /* the last day goes on to the end of the file - solard does not index the event it
+        records when it is stopped, that is left to its next start */
+        for (s=severity, n=0; s<EV_SEVERITIES; s++) n += days[d].count[s];
+        if ( !n && (d < ndays-1) ) continue;
+        for (s=0, n=0; s<EV_SEVERITIES; s++) n += days[d].count[s];
+        if ( (days[d].first + n > total) || (d == ndays-1) ) n = total - days[d].first;
+        for (i=0; i<n; i+=got) {
+            got = (n-i < RECORDS_PER_READ) ? n-i : RECORDS_PER_READ;
+            got = pread( fd, r, got * sizeof r[0], (days[d].first + i) * sizeof r[0] ) / (long)sizeof r[0];
+            if ( got <= 0 ) break;
+            read_records += got;
+            for (s=0; s<got; s++) {
+                if ( (r[s].time < from) || (r[s].time >= to) || (r[s].severity < severity) ||
+                     (r[s].severity >= EV_SEVERITIES) ) continue;
+                if ( (code != -1) && (r[s].code != code) ) continue;
+                if ( (sensor != -1) && (!sensor_event( r[s].code ) || (r[s].id != sensor)) ) continue;
+                matched++;
+                by_severity[r[s].severity]++;
+                if ( count_only ) continue;
+                t = r[s].time;
+                localtime_r( &t, &tm );
+                strftime( stamp, sizeof stamp, "%F %T", &tm );
+                describe( &r[s], detail, sizeof detail );
+                printf( "%s %-7s %-15s %s\n", stamp, event_severity_names[r[s].severity],
+                (r[s].code < EV_CODES) ? event_names[r[s].code] : "unknown", detail );
+            }
+        }
+    }
+    printf( "%ld events (%ld alarms, %ld warnings, %ld info); read %ld of %ld records\n", matched,
+    by_severity[EV_ALARM], by_severity[EV_WARNING], by_severity[EV_INFO], read_records, total );
+    close( fd );
+    free( days );
+    return 0;
+}
@@ -0,0 +1,838 @@
+/*
+* solard-tune.c
+*
+* Offline tuner for the solard settings.
+* Plamen Petrov
+*
+* Reads the data history solard wrote (the gzipped archive and the current data files),
+* fits a simple thermal model of the boiler to it, and replays the history through the
+* heating rules for every combination of wanted_T, abs_max, night_boost and electric
+* heater day and night use in the given ranges. The combination with the lowest
+* electricity cost which keeps the boiler top as often warm enough as now (or as asked)
+* is printed as a solard.cfg, and the expected savings - on standard error.
+*
+* The replays are independent, so they are spread over all CPU cores: each worker thread
+* has its own queue of settings to replay, and one which runs out takes work from the
+* others, so all finish together however long the replays take.
+*
+* The thermal model: with nothing heating it, the boiler's mean temperature changes as it
+* did on average in the same hour of day (heat losses and hot water use), plus a part
+* proportional to how far it is from the average temperature; each heat source adds its
+* own change - the heater a fixed one, the solar collector and the furnace one
+* proportional to how much hotter than the boiler bottom they are. The furnace and
+* collector temperatures are replayed as recorded.
+*
+* Examples:
+*   solard-tune > solard.cfg.new                    tune on the history on this machine
+*   solard-tune --wanted=40-55 --comfort=42 data.log.gz data.log
+*/
+
+#ifndef SOLARD_ROOT
+#define SOLARD_ROOT     ""
+#endif
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "solard_control.h"
+
+#define CONFIG_FILE     SOLARD_ROOT "/etc/solard.cfg"
+#define RULES_FILE      SOLARD_ROOT "/etc/solard.rules"
+#define DATA_DIR        SOLARD_ROOT "/run/shm"
+#define DATA_NAME       "solard_data.log"
+#define DATA_ARCHIVE    SOLARD_ROOT "/var/log/solard_data.log.gz"
+
+#define MAXLEN          80
+#define MAX_FILES       64
+#define MAX_WORKERS     256
+
+/* cycles further apart than this start a new stretch of history */
+#define GAP_SECONDS     60
+
+/* a model part is only fitted on at least this many cycles */
+#define MIN_FIT_CYCLES  30
+
+/* changes of the boiler mean temperature bigger than this in a cycle are sensor glitches */
+#define MAX_CYCLE_CHANGE 2.0
+
+/* one cycle of the history */
+struct sample
+{
+    long long       t;
+    float           furnace, collector, low, high;
+    unsigned char   hour, month;
+    unsigned char   outputs;        /* bits: 1 - P1, 2 - P2, 4 - valve, 8 - heater */
+    unsigned char   start;          /* first cycle after a gap */
+    unsigned char   sched;          /* SCHED_* bits of the schedule in the config... */
+    unsigned char   nestart, nestop;
+    unsigned short  night_left;     /* ...and the rest of its entry for the cycle's minute */
+};
+
+struct model
+{
+    double          idle[24];       /* mean change per cycle with no source running, per hour of day */
+    double          idle_t;         /* mean temperature in those cycles... */
+    double          loss;           /* ...and change per cycle per degree above it */
+    double          heater;         /* change per cycle the heater adds */
+    double          solar;          /* change per cycle per degree the collector is above boiler low */
+    double          furnace;        /* change per cycle per degree the furnace is above boiler low */
+    unsigned long   n_idle, n_heater, n_solar, n_furnace;
+};
+
+/* settings tuned */
+struct params
+{
+    short           wanted_T, abs_max, night_boost, heater_day, heater_night;
+};
+
+/* outcome of replaying the history with some settings */
+struct outcome
+{
+    double          cost;
+    unsigned long long mwh_day, mwh_night;
+    unsigned long   cold;           /* comfort cycles with the boiler top below the comfort temp */
+};
+
+/* settings solard-tune keeps as they are */
+struct config
+{
+    int             mode, wanted_T, abs_max, night_boost, heater_day, heater_night, pump1_always_on;
+    int             nt_summer_start, nt_summer_stop, nt_winter_start, nt_winter_stop;
+    int             summer_first_month, summer_last_month;
+    float           day_price, night_price;
+    int             tank_liters;
+    char            night_tariff[SCHED_CFG_MAX], holidays[SCHED_CFG_MAX], away[SCHED_CFG_MAX];
+    char            pump_exercise[SCHED_CFG_MAX];
+};
+
+struct worker
+{
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    int             *tasks;         /* numbers of settings to replay */
+    int             head;           /* the next one others take */
+    int             tail;           /* one after the next one this worker takes */
+    unsigned long   done, taken;    /* replays run, and of those taken from others */
+    char            pad[64];        /* keep workers' counters off each other's cache lines */
+};
+
+struct sample *samples = NULL;
+long n_samples = 0;
+struct model model;
+struct config cfg;
+struct rule_table rules;
+struct schedule_cfg sched_cfg;
+struct schedule schedule;
+short comfort_T = -1, comfort_first = 6, comfort_last = 22;
+unsigned long comfort_cycles = 0;
+
+struct params *grid = NULL;
+struct outcome *outcomes = NULL;
+int n_grid = 0;
+struct worker *workers = NULL;
+int n_workers = 0;
+
+void
+usage() {
+    fprintf( stderr, "Usage: solard-tune [options] [DATA_FILE...]\n"\
+    "  --cfg=PATH          config to start from, default "CONFIG_FILE"\n"\
+    "  --rules=PATH        heating rules to replay, default "RULES_FILE" or the built-in ones\n"\
+    "  --wanted=A-B        wanted_T values to try, default 10 below to 5 above the config's\n"\
+    "  --abs-max=A-B       abs_max values to try, default 5 around the config's\n"\
+    "  --comfort=T         lowest boiler top temperature wanted, default 5 below the config's wanted_T\n"\
+    "  --comfort-hours=A-B hours the comfort temperature is wanted, default 6-22\n"\
+    "  --max-cold=PCT      how often the boiler top may be below it, default as often as now\n"\
+    "  --tank=LITRES       boiler volume, if the history has too little heater use to fit the heater\n"\
+    "  --threads=N         worker threads, default one per CPU core\n"\
+    "Reads the data archive and data files of this machine if no DATA_FILE (plain or gzipped) is given.\n"\
+    "Prints the recommended config on standard output, and the expected savings on standard error.\n" );
+    exit( 1 );
+}
+
+/* Parse "A-B" into first and last; returns 0 if s does not make sense */
+short
+parse_range( const char *s, int *first, int *last, int min, int max ) {
+    int a, b;
+
+    if ( (sscanf( s, "%d-%d", &a, &b ) != 2) || (a < min) || (b > max) || (a > b) ) return 0;
+    *first = a;
+    *last = b;
+    return 1;
+}
+
+/* Same as solard: schedule values given on several lines add up */
+void
+config_append( char *s, const char *value ) {
+    size_t l = strlen( s );
+
+    snprintf( s + l, SCHED_CFG_MAX - l, "%s%s", l ? "; " : "", value );
+}
+
+/* Same as solard: a range which does not make sense keeps the default */
+void
+config_range( const char *s, int *first, int *last, int min, int max ) {
+    int a, b;
+
+    if ( (sscanf( s, "%d-%d", &a, &b ) != 2) || (a < min) || (a > max) || (b < min) || (b > max) ) return;
+    *first = a;
+    *last = b;
+}
+
+void
+ReadConfig( const char *filename ) {
+    char buff[200], name[MAXLEN], value[MAXLEN], err[120];
+    FILE *fp;
+    size_t l;
+
+    /* solard's defaults */
+    cfg.mode = 1;
+    cfg.wanted_T = 40;
+    cfg.abs_max = 47;
+    cfg.night_boost = 0;
+    cfg.heater_day = 1;
+    cfg.heater_night = 1;
+    cfg.pump1_always_on = 0;
+    cfg.nt_summer_start = 23; cfg.nt_summer_stop = 6;
+    cfg.nt_winter_start = 22; cfg.nt_winter_stop = 5;
+    cfg.summer_first_month = 4; cfg.summer_last_month = 10;
+    cfg.day_price = cfg.night_price = 0;
+    cfg.tank_liters = 0;
+    cfg.night_tariff[0] = cfg.holidays[0] = cfg.away[0] = cfg.pump_exercise[0] = 0;
+
+    fp = fopen( filename, "r" );
+    if ( fp == NULL ) {
+        fprintf( stderr, "Cannot open %s - using solard defaults.\n", filename );
+    }
+    while ( (fp != NULL) && (fgets( buff, sizeof buff, fp ) != NULL) ) {
+        if ( (buff[0] == '#') || (sscanf( buff, " %79[^= ] = %79[^\n]", name, value ) != 2) ) continue;
+        for ( l = strlen( value ); (l > 0) && isspace( value[l-1] ); l-- ) value[l-1] = 0;
+        if ( strcmp( name, "mode" ) == 0 ) cfg.mode = atoi( value );
+        else if ( strcmp( name, "wanted_T" ) == 0 ) cfg.wanted_T = atoi( value );
+        else if ( strcmp( name, "abs_max" ) == 0 ) cfg.abs_max = atoi( value );
+        else if ( strcmp( name, "night_boost" ) == 0 ) cfg.night_boost = atoi( value );
+        else if ( strcmp( name, "use_electric_heater_day" ) == 0 ) cfg.heater_day = atoi( value );
+        else if ( strcmp( name, "use_electric_heater_night" ) == 0 ) cfg.heater_night = atoi( value );
+        else if ( strcmp( name, "pump1_always_on" ) == 0 ) cfg.pump1_always_on = atoi( value );
+        else if ( strcmp( name, "night_tariff_summer" ) == 0 )
+            config_range( value, &cfg.nt_summer_start, &cfg.nt_summer_stop, 0, 23 );
+        else if ( strcmp( name, "night_tariff_winter" ) == 0 )
+            config_range( value, &cfg.nt_winter_start, &cfg.nt_winter_stop, 0, 23 );
+        else if ( strcmp( name, "summer_months" ) == 0 )
+            config_range( value, &cfg.summer_first_month, &cfg.summer_last_month, 1, 12 );
+        else if ( strcmp( name, "day_price" ) == 0 ) cfg.day_price = atof( value );
+        else if ( strcmp( name, "night_price" ) == 0 ) cfg.night_price = atof( value );
+        else if ( strcmp( name, "tank_liters" ) == 0 ) cfg.tank_liters = atoi( value );
+        else if ( strcmp( name, "night_tariff" ) == 0 ) config_append( cfg.night_tariff, value );
+        else if ( strcmp( name, "holidays" ) == 0 ) config_append( cfg.holidays, value );
+        else if ( strcmp( name, "away" ) == 0 ) config_append( cfg.away, value );
+        else if ( strcmp( name, "pump_exercise" ) == 0 ) config_append( cfg.pump_exercise, value );
+    }
+    if ( fp != NULL ) fclose( fp );
+    if ( cfg.day_price < 0 ) cfg.day_price = 0;
+    if ( cfg.night_price < 0 ) cfg.night_price = 0;
+    sched_cfg.nt_summer_start = cfg.nt_summer_start;
+    sched_cfg.nt_summer_stop = cfg.nt_summer_stop;
+    sched_cfg.nt_winter_start = cfg.nt_winter_start;
+    sched_cfg.nt_winter_stop = cfg.nt_winter_stop;
+    sched_cfg.summer_first_month = cfg.summer_first_month;
+    sched_cfg.summer_last_month = cfg.summer_last_month;
+    if ( CompileScheduleCfg( &sched_cfg, cfg.night_tariff, cfg.holidays, cfg.away, cfg.pump_exercise, err ) ) {
+        fprintf( stderr, "Schedule config error, %s - the value is left out, as solard does.\n", err );
+    }
+}
+
+void
+ReadRules( const char *filename, short must_exist ) {
+    char buff[300], err[100];
+    unsigned short line_no = 0;
+    short i, errors = 0;
+    FILE *fp;
+
+    memset( &rules, 0, sizeof rules );
+    fp = fopen( filename, "r" );
+    if ( fp == NULL ) {
+        if ( must_exist ) {
+            fprintf( stderr, "Cannot open %s!\n", filename );
+            exit( 2 );
+        }
+        for (i=0;default_rules[i]!=NULL;i++) {
+            strcpy( buff, default_rules[i] );
+            CompileRuleLine( &rules, buff, i+1, err );
+        }
+        return;
+    }
+    while ( fgets( buff, sizeof buff, fp ) != NULL ) {
+        line_no++;
+        buff[strcspn( buff, "\r\n" )] = 0;
+        for (i=0;isspace( buff[i] );i++) ;
+        if ( (buff[i] == 0) || (buff[i] == '#') ) continue;
+        if ( CompileRuleLine( &rules, buff+i, line_no, err ) ) {
+            fprintf( stderr, "%s line %d: %s\n", filename, line_no, err );
+            errors++;
+        }
+    }
+    fclose( fp );
+    if ( errors || !rules.n_rules ) {
+        fprintf( stderr, "No usable heating rules in %s!\n", filename );
+        exit( 2 );
+    }
+}
+
+/* Append the cycles in data file filename (plain or gzipped) to samples[] */
+void
+ReadData( const char *filename ) {
+    static long allocated = 0;
+    static int last_key = -1;
+    static long long last_base = 0;
+    char line[300];
+    struct tm tm;
+    struct sample *s;
+    int y, mo, d, h, mi, sec, p1, p2, v, heater, key;
+    float tkotel, tkolektor, tlow, thigh;
+    long before = n_samples;
+    gzFile f;
+
+    f = gzopen( filename, "r" );
+    if ( f == NULL ) {
+        fprintf( stderr, "Cannot open %s!\n", filename );
+        return;
+    }
+    while ( gzgets( f, line, sizeof line ) != NULL ) {
+        if ( sscanf( line, "%d-%d-%d %d:%d:%d %*d, %f,%f,%f,%f, %*d,%*d,%*d, %*d, %d,%d,%d,%d", &y, &mo, &d, &h,
+             &mi, &sec, &tkotel, &tkolektor, &tlow, &thigh, &p1, &p2, &v, &heater ) != 14 ) continue;
+        if ( (mo < 1) || (mo > 12) || (h < 0) || (h > 23) ) continue;
+        if ( n_samples == allocated ) {
+            allocated = allocated ? allocated * 2 : 65536;
+            samples = realloc( samples, allocated * sizeof *samples );
+            if ( samples == NULL ) {
+                fprintf( stderr, "Out of memory!\n" );
+                exit( 3 );
+            }
+        }
+        /* mktime() only once an hour of data */
+        key = ((y * 13 + mo) * 32 + d) * 24 + h;
+        if ( key != last_key ) {
+            memset( &tm, 0, sizeof tm );
+            tm.tm_year = y - 1900;
+            tm.tm_mon = mo - 1;
+            tm.tm_mday = d;
+            tm.tm_hour = h;
+            tm.tm_isdst = -1;
+            last_base = mktime( &tm );
+            last_key = key;
+        }
+        s = &samples[n_samples++];
+        s->t = last_base + mi * 60 + sec;
+        s->furnace = tkotel;
+        s->collector = tkolektor;
+        s->low = tlow;
+        s->high = thigh;
+        s->hour = h;
+        s->month = mo;
+        s->outputs = (p1 ? 1 : 0) | (p2 ? 2 : 0) | (v ? 4 : 0) | (heater ? 8 : 0);
+        s->start = 0;
+    }
+    gzclose( f );
+    fprintf( stderr, "%s: %ld cycles\n", filename, n_samples - before );
+}
+
+int
+by_time( const void *a, const void *b ) {
+    const struct sample *x = a, *y = b;
+
+    return (x->t > y->t) - (x->t < y->t);
+}
+
+int
+by_name( const void *a, const void *b ) {
+    return strcmp( *(char * const *)a, *(char * const *)b );
+}
+
+/* Read the data archive, the data segments not archived yet, and the current data file */
+void
+ReadLocalData() {
+    char *names[MAX_FILES], path[MAXLEN+40];
+    struct dirent *e;
+    DIR *dir;
+    int n = 0, i;
+
+    ReadData( DATA_ARCHIVE );
+    dir = opendir( DATA_DIR );
+    if ( dir != NULL ) {
+        while ( ((e = readdir( dir )) != NULL) && (n < MAX_FILES) ) {
+            if ( strncmp( e->d_name, DATA_NAME ".", sizeof(DATA_NAME) ) || (strlen( e->d_name ) > MAXLEN) ) continue;
+            names[n++] = strdup( e->d_name );
+        }
+        closedir( dir );
+    }
+    qsort( names, n, sizeof names[0], by_name );
+    for (i=0;i<n;i++) {
+        snprintf( path, sizeof path, DATA_DIR "/%s", names[i] );
+        ReadData( path );
+        free( names[i] );
+    }
+    ReadData( DATA_DIR "/" DATA_NAME );
+}
+
+/* Sort the history, drop repeated cycles and mark the gaps */
+void
+PrepareData() {
+    const struct sched_minute *e;
+    long i, n = 0;
+
+    qsort( samples, n_samples, sizeof *samples, by_time );
+    for (i=0;i<n_samples;i++) {
+        if ( n && (samples[i].t == samples[n-1].t) ) continue;
+        samples[n] = samples[i];
+        samples[n].start = !n || (samples[n].t - samples[n-1].t > GAP_SECONDS);
+        n++;
+    }
+    n_samples = n;
+    /* look the cycles up in the schedule once - the replays only read them */
+    for (i=0;i<n_samples;i++) {
+        if ( (e = ScheduleAt( &schedule, (time_t)samples[i].t )) == NULL ) {
+            BuildSchedule( &schedule, &sched_cfg, (time_t)samples[i].t );
+            if ( (e = ScheduleAt( &schedule, (time_t)samples[i].t )) == NULL ) e = &schedule.m[0];
+        }
+        samples[i].sched = e->flags;
+        samples[i].nestart = e->nestart;
+        samples[i].nestop = e->nestop;
+        samples[i].night_left = e->night_left;
+    }
+}
+
+double
+mean_t( const struct sample *s ) {
+    return ((double)s->low + s->high) / 2;
+}
+
+/* Change of the boiler mean temperature the model expects in a cycle with nothing heating it */
+double
+idle_change( short hour, double t ) {
+    return model.idle[hour] + model.loss * (t - model.idle_t);
+}
+
+/* Fit the thermal model to the history; cycle i counts with the outputs logged in it, which
+stay so until cycle i+1 */
+void
+FitModel() {
+    double sum[24], sum_t = 0, sxx = 0, sxy = 0, dt, x, r;
+    double heater_sum = 0, solar_sxx = 0, solar_sxy = 0, furnace_sxx = 0, furnace_sxy = 0;
+    unsigned long n[24];
+    long i;
+    short h, pass;
+
+    memset( &model, 0, sizeof model );
+    memset( sum, 0, sizeof sum );
+    memset( n, 0, sizeof n );
+    /* idle changes per hour first, then how they depend on the temperature, then the sources */
+    for (pass=0;pass<3;pass++) {
+        for (i=0;i+1<n_samples;i++) {
+            if ( samples[i+1].start ) continue;
+            dt = mean_t( &samples[i+1] ) - mean_t( &samples[i] );
+            if ( (dt > MAX_CYCLE_CHANGE) || (dt < -MAX_CYCLE_CHANGE) ) continue;
+            h = samples[i].hour;
+            if ( pass == 0 ) {
+                if ( samples[i].outputs & (2|4|8) ) continue;
+                sum[h] += dt;
+                n[h]++;
+                sum_t += mean_t( &samples[i] );
+                model.n_idle++;
+                continue;
+            }
+            if ( pass == 1 ) {
+                if ( samples[i].outputs & (2|4|8) ) continue;
+                x = mean_t( &samples[i] ) - model.idle_t;
+                sxx += x * x;
+                sxy += x * (dt - model.idle[h]);
+                continue;
+            }
+            r = dt - idle_change( h, mean_t( &samples[i] ) );
+            switch ( samples[i].outputs & (2|4|8) ) {
+                case 8:
+                heater_sum += r;
+                model.n_heater++;
+                break;
+                case 2:
+                x = samples[i].collector - samples[i].low;
+                solar_sxx += x * x;
+                solar_sxy += x * r;
+                model.n_solar++;
+                break;
+                case 4:
+                x = samples[i].furnace - samples[i].low;
+                furnace_sxx += x * x;
+                furnace_sxy += x * r;
+                model.n_furnace++;
+                break;
+            }
+        }
+        if ( pass == 0 ) {
+            if ( model.n_idle < MIN_FIT_CYCLES ) {
+                fprintf( stderr, "Too little history with nothing heating the boiler to fit a model to!\n" );
+                exit( 4 );
+            }
+            model.idle_t = sum_t / model.n_idle;
+            for (h=0;h<24;h++) if ( n[h] ) model.idle[h] = sum[h] / n[h];
+        }
+        else if ( (pass == 1) && (sxx > 0) ) {
+            model.loss = sxy / sxx;
+            /* a boiler does not warm up by itself however hot it is */
+            if ( model.loss > 0 ) model.loss = 0;
+        }
+    }
+    if ( model.n_heater >= MIN_FIT_CYCLES ) model.heater = heater_sum / model.n_heater;
+    else if ( cfg.tank_liters > 0 ) model.heater = HEATERPPC * 3.6 / (cfg.tank_liters * 4186.0);
+    else {
+        fprintf( stderr, "Too little heater use in the history to fit it - give the boiler volume with --tank!\n" );
+        exit( 4 );
+    }
+    if ( (model.n_solar >= MIN_FIT_CYCLES) && (solar_sxx > 0) ) model.solar = solar_sxy / solar_sxx;
+    if ( (model.n_furnace >= MIN_FIT_CYCLES) && (furnace_sxx > 0) ) model.furnace = furnace_sxy / furnace_sxx;
+}
+
+/* Replay the history with the settings p into o */
+void
+Replay( const struct params *p, struct outcome *o ) {
+    double ro[RO_COUNT], t, shift, prev_high = 0, prev_low = 0, prev_furnace = 0, prev_collector = 0;
+    unsigned short modes[2], mode, on[5];
+    unsigned long sc[5];
+    unsigned long long mwh;
+    short winter, night, critical, i, j;
+    const struct sample *s;
+    long n;
+
+    memset( o, 0, sizeof *o );
+    memset( on, 0, sizeof on );
+    memset( sc, 0, sizeof sc );
+    memset( ro, 0, sizeof ro );
+    t = 0;
+    ro[RO_MODE] = cfg.mode;
+    ro[RO_WANTEDT] = p->wanted_T;
+    ro[RO_ABSMAX] = p->abs_max;
+    ro[RO_NIGHTBOOST] = p->night_boost;
+    ro[RO_P1ALWAYSON] = cfg.pump1_always_on;
+    ro[RO_NIGHTTEMP] = ((float)p->wanted_T + 12 > (float)p->abs_max) ? (float)p->abs_max : (float)p->wanted_T + 12;
+    for (n=0;n<n_samples;n++) {
+        s = &samples[n];
+        if ( s->start ) {
+            /* start a stretch of history as it was */
+            t = mean_t( s );
+            for (i=1;i<=4;i++) {
+                on[i] = (s->outputs >> (i-1)) & 1;
+                sc[i] = 100000;
+            }
+            prev_furnace = s->furnace;
+            prev_collector = s->collector;
+            prev_high = s->high;
+            prev_low = s->low;
+        }
+        /* the recorded stratification, moved to the simulated mean temperature */
+        shift = t - mean_t( s );
+        winter = (s->sched & SCHED_WINTER) != 0;
+        night = (s->sched & SCHED_NIGHT) != 0;
+
+        ro[RO_TKOTEL] = s->furnace;
+        ro[RO_TKOLEKTOR] = s->collector;
+        ro[RO_TBOILERH] = (float)(s->high + shift);
+        ro[RO_TBOILERL] = (float)(s->low + shift);
+        ro[RO_TKOTELPRV] = prev_furnace;
+        ro[RO_TKOLEKTORPRV] = prev_collector;
+        ro[RO_TBOILERHPRV] = prev_high;
+        ro[RO_TBOILERLPRV] = prev_low;
+        ro[RO_CPUMP1] = on[1];
+        ro[RO_CPUMP2] = on[2];
+        ro[RO_CVALVE] = on[3];
+        ro[RO_CHEATER] = on[4];
+        ro[RO_SCPUMP1] = sc[1];
+        ro[RO_SCPUMP2] = sc[2];
+        ro[RO_SCVALVE] = sc[3];
+        ro[RO_SCHEATER] = sc[4];
+        ro[RO_HOUR] = s->hour;
+        ro[RO_MONTH] = s->month;
+        ro[RO_PUMPHOUR] = pump_start_hour_for[s->month];
+        ro[RO_NESTART] = s->nestart;
+        ro[RO_NESTOP] = s->nestop;
+        ro[RO_WINTER] = winter;
+        ro[RO_NIGHT] = night;
+        ro[RO_NIGHTLEFT] = s->night_left;
+        ro[RO_AWAY] = (s->sched & SCHED_AWAY) != 0;
+        ro[RO_EXERCISE] = (s->sched & SCHED_EXERCISE) != 0;
+
+        /* as solard's DecideHeatingMode() in modes 1 and 2 */
+        critical = CriticalTemps( s->furnace, ro[RO_TBOILERH] );
+        if ( critical ) mode = 7;
+        else {
+            EvaluateRuleTable( &rules, ro, modes );
+            mode = modes[RULES_IDLE];
+            if ( BoilerNeedsHeating( ro[RO_TBOILERL], ro[RO_TBOILERH], prev_high, p->wanted_T, winter ) )
+                mode |= modes[RULES_HEAT];
+        }
+        if ( (mode & 8) && ((s->sched & SCHED_AWAY) || !(night ? p->heater_night : p->heater_day)) ) mode &= ~8;
+        for (i=1;i<=4;i++) {
+            j = (mode >> (i-1)) & 1;
+            if ( j != on[i] ) { on[i] = j; sc[i] = 0; }
+            sc[i]++;
+        }
+
+        mwh = SELFPPC;
+        if ( on[1] ) mwh += PUMP1PPC;
+        if ( on[2] ) mwh += PUMP2PPC;
+        if ( on[3] ) mwh += VALVEPPC;
+        if ( on[4] ) mwh += HEATERPPC;
+        if ( night ) o->mwh_night += mwh;
+        else o->mwh_day += mwh;
+        if ( (s->hour >= comfort_first) && (s->hour <= comfort_last) && (ro[RO_TBOILERH] < comfort_T) ) o->cold++;
+
+        prev_furnace = s->furnace;
+        prev_collector = s->collector;
+        prev_high = ro[RO_TBOILERH];
+        prev_low = ro[RO_TBOILERL];
+        t += idle_change( s->hour, t );
+        if ( on[2] ) t += model.solar * (s->collector - ro[RO_TBOILERL]);
+        if ( on[3] ) t += model.furnace * (s->furnace - ro[RO_TBOILERL]);
+        if ( on[4] ) t += model.heater;
+    }
+    if ( (cfg.day_price > 0) || (cfg.night_price > 0) )
+        o->cost = (o->mwh_day * cfg.day_price + o->mwh_night * cfg.night_price) / 1000000;
+    else o->cost = (double)(o->mwh_day + o->mwh_night) / 1000000;
+}
+
+/* Next replay for worker w: its own newest one, or else the oldest one of another worker */
+int
+NextTask( struct worker *w ) {
+    struct worker *v;
+    int i, task = -1;
+
+    pthread_mutex_lock( &w->lock );
+    if ( w->tail > w->head ) task = w->tasks[--w->tail];
+    pthread_mutex_unlock( &w->lock );
+    if ( task >= 0 ) return task;
+    for (i=1;(i<n_workers) && (task < 0);i++) {
+        v = &workers[(w - workers + i) % n_workers];
+        pthread_mutex_lock( &v->lock );
+        if ( v->tail > v->head ) task = v->tasks[v->head++];
+        pthread_mutex_unlock( &v->lock );
+    }
+    if ( task >= 0 ) w->taken++;
+    return task;
+}
+
+void *
+Worker( void *arg ) {
+    struct worker *w = arg;
+    int task;
+
+    while ( (task = NextTask( w )) >= 0 ) {
+        Replay( &grid[task], &outcomes[task] );
+        w->done++;
+    }
+    return NULL;
+}
+
+void
+describe( const struct params *p, const struct outcome *o, char *buf, size_t len ) {
+    snprintf( buf, len, "wanted_T=%d abs_max=%d night_boost=%d heater day=%d night=%d: %s %.2f, %.1f kWh "\
+    "(%.1f day, %.1f night), boiler top cold %.2f%%", p->wanted_T, p->abs_max, p->night_boost, p->heater_day,
+    p->heater_night, ((cfg.day_price > 0) || (cfg.night_price > 0)) ? "cost" : "kWh", o->cost,
+    (o->mwh_day + o->mwh_night) / 1e6, o->mwh_day / 1e6, o->mwh_night / 1e6,
+    comfort_cycles ? 100.0 * o->cold / comfort_cycles : 0.0 );
+}
+
+/* Print the config in filename with the settings in p on standard output */
+void
+WriteConfig( const char *filename, const struct params *p ) {
+    static const char *keys[] = { "wanted_T", "abs_max", "night_boost", "use_electric_heater_day",
+                                  "use_electric_heater_night" };
+    char buff[200], name[MAXLEN];
+    short values[5], seen[5] = { 0, 0, 0, 0, 0 }, i;
+    FILE *fp;
+
+    values[0] = p->wanted_T;
+    values[1] = p->abs_max;
+    values[2] = p->night_boost;
+    values[3] = p->heater_day;
+    values[4] = p->heater_night;
+    fp = fopen( filename, "r" );
+    while ( fp && (fgets( buff, sizeof buff, fp ) != NULL) ) {
+        if ( (buff[0] != '#') && (sscanf( buff, " %79[^= ] =", name ) == 1) ) {
+            for (i=0;i<5;i++) if ( strcmp( name, keys[i] ) == 0 ) break;
+            if ( i < 5 ) {
+                printf( "%s=%d\n", keys[i], values[i] );
+                seen[i] = 1;
+                continue;
+            }
+        }
+        fputs( buff, stdout );
+    }
+    if ( fp ) fclose( fp );
+    for (i=0;i<5;i++) if ( !seen[i] ) printf( "%s=%d\n", keys[i], values[i] );
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *cfg_file = CONFIG_FILE, *rules_file = RULES_FILE;
+    const char *files[MAX_FILES];
+    short rules_given = 0;
+    int n_files = 0, wanted_first = -1, wanted_last = -1, abs_first = -1, abs_last = -1;
+    int a, b, i, w, best = -1, allowed_cold;
+    double max_cold = -1, days, seconds;
+    struct params current;
+    struct outcome baseline;
+    struct timeval start, end;
+    unsigned long long recorded_mwh = 0;
+    unsigned long taken = 0;
+    char buf[250];
+    long n;
+
+    n_workers = sysconf( _SC_NPROCESSORS_ONLN );
+    for (i=1;i<argc;i++) {
+        if ( strncmp( argv[i], "--cfg=", 6 ) == 0 ) cfg_file = argv[i]+6;
+        else if ( strncmp( argv[i], "--rules=", 8 ) == 0 ) { rules_file = argv[i]+8; rules_given = 1; }
+        else if ( strncmp( argv[i], "--wanted=", 9 ) == 0 ) {
+            if ( !parse_range( argv[i]+9, &wanted_first, &wanted_last, 25, 62 ) ) usage();
+        }
+        else if ( strncmp( argv[i], "--abs-max=", 10 ) == 0 ) {
+            if ( !parse_range( argv[i]+10, &abs_first, &abs_last, 40, 70 ) ) usage();
+        }
+        else if ( strncmp( argv[i], "--comfort=", 10 ) == 0 ) comfort_T = atoi( argv[i]+10 );
+        else if ( strncmp( argv[i], "--comfort-hours=", 16 ) == 0 ) {
+            if ( !parse_range( argv[i]+16, &a, &b, 0, 23 ) ) usage();
+            comfort_first = a;
+            comfort_last = b;
+        }
+        else if ( strncmp( argv[i], "--max-cold=", 11 ) == 0 ) max_cold = atof( argv[i]+11 );
+        else if ( strncmp( argv[i], "--tank=", 7 ) == 0 ) cfg.tank_liters = atoi( argv[i]+7 );
+        else if ( strncmp( argv[i], "--threads=", 10 ) == 0 ) n_workers = atoi( argv[i]+10 );
+        else if ( (argv[i][0] != '-') && (n_files < MAX_FILES) ) files[n_files++] = argv[i];
+        else usage();
+    }
+    if ( n_workers < 1 ) n_workers = 1;
+    if ( n_workers > MAX_WORKERS ) n_workers = MAX_WORKERS;
+
+    a = cfg.tank_liters;
+    ReadConfig( cfg_file );
+    if ( a > 0 ) cfg.tank_liters = a;
+    if ( (cfg.mode != 1) && (cfg.mode != 2) ) {
+        fprintf( stderr, "Config mode is %d - only modes 1 and 2 decide by the heating rules.\n", cfg.mode );
+        exit( 1 );
+    }
+    ReadRules( rules_file, rules_given );
+    if ( comfort_T < 0 ) comfort_T = cfg.wanted_T - 5;
+    if ( wanted_first < 0 ) {
+        wanted_first = (cfg.wanted_T - 10 < 25) ? 25 : cfg.wanted_T - 10;
+        wanted_last = (cfg.wanted_T + 5 > 62) ? 62 : cfg.wanted_T + 5;
+    }
+    if ( abs_first < 0 ) {
+        abs_first = (cfg.abs_max - 5 < 40) ? 40 : cfg.abs_max - 5;
+        abs_last = (cfg.abs_max + 5 > 70) ? 70 : cfg.abs_max + 5;
+    }
+
+    if ( n_files ) for (i=0;i<n_files;i++) ReadData( files[i] );
+    else ReadLocalData();
+    PrepareData();
+    if ( n_samples < 2 ) {
+        fprintf( stderr, "No data history to replay!\n" );
+        exit( 4 );
+    }
+    for (n=0, a=0;n<n_samples;n++) {
+        if ( samples[n].start ) a++;
+        if ( (samples[n].hour >= comfort_first) && (samples[n].hour <= comfort_last) ) comfort_cycles++;
+        recorded_mwh += SELFPPC + ((samples[n].outputs & 1) ? PUMP1PPC : 0) + ((samples[n].outputs & 2) ? PUMP2PPC : 0) +
+                        ((samples[n].outputs & 4) ? VALVEPPC : 0) + ((samples[n].outputs & 8) ? HEATERPPC : 0);
+    }
+    days = n_samples / 8640.0;
+    fprintf( stderr, "History: %ld cycles, %.1f days in %d stretches\n", n_samples, days, a );
+
+    FitModel();
+    fprintf( stderr, "Model: idle %+.4f C/cycle at %.1f C, %+.6f C/cycle per C above; heater %+.4f C/cycle (%lu "\
+    "cycles%s); solar %+.6f per C over boiler low (%lu cycles); furnace %+.6f per C (%lu cycles)\n",
+    (model.idle_t ? idle_change( 12, model.idle_t ) : 0), model.idle_t, model.loss, model.heater, model.n_heater,
+    (model.n_heater >= MIN_FIT_CYCLES) ? "" : " - from tank volume", model.solar, model.n_solar, model.furnace,
+    model.n_furnace );
+
+    current.wanted_T = cfg.wanted_T;
+    current.abs_max = cfg.abs_max;
+    current.night_boost = cfg.night_boost ? 1 : 0;
+    current.heater_day = cfg.heater_day ? 1 : 0;
+    current.heater_night = cfg.heater_night ? 1 : 0;
+    Replay( &current, &baseline );
+    fprintf( stderr, "Model check: recorded electricity use %.1f kWh, replayed with the config %.1f kWh\n",
+    recorded_mwh / 1e6, (baseline.mwh_day + baseline.mwh_night) / 1e6 );
+
+    /* all combinations - abs_max at least 3 above wanted_T, as solard wants it */
+    grid = malloc( (wanted_last - wanted_first + 1) * (abs_last - abs_first + 1) * 8 * sizeof *grid );
+    if ( grid == NULL ) exit( 3 );
+    for (a=wanted_first;a<=wanted_last;a++) for (b=abs_first;b<=abs_last;b++) for (i=0;i<8;i++) {
+        if ( b < a + 3 ) continue;
+        grid[n_grid].wanted_T = a;
+        grid[n_grid].abs_max = b;
+        grid[n_grid].night_boost = i & 1;
+        grid[n_grid].heater_day = (i >> 1) & 1;
+        grid[n_grid].heater_night = (i >> 2) & 1;
+        n_grid++;
+    }
+    if ( !n_grid ) {
+        fprintf( stderr, "No settings to try in the given ranges!\n" );
+        exit( 1 );
+    }
+    outcomes = calloc( n_grid, sizeof *outcomes );
+    workers = calloc( n_workers, sizeof *workers );
+    if ( !outcomes || !workers ) exit( 3 );
+    for (w=0;w<n_workers;w++) {
+        workers[w].tasks = malloc( (n_grid / n_workers + 1) * sizeof(int) );
+        if ( workers[w].tasks == NULL ) exit( 3 );
+        pthread_mutex_init( &workers[w].lock, NULL );
+    }
+    /* deal the settings out like cards, so neighbours - which replay alike - go to different workers */
+    for (i=0;i<n_grid;i++) {
+        w = i % n_workers;
+        workers[w].tasks[workers[w].tail++] = i;
+    }
+    gettimeofday( &start, NULL );
+    for (w=0;w<n_workers;w++) {
+        if ( pthread_create( &workers[w].thread, NULL, Worker, &workers[w] ) ) {
+            fprintf( stderr, "Cannot start worker threads!\n" );
+            exit( 3 );
+        }
+    }
+    for (w=0;w<n_workers;w++) {
+        pthread_join( workers[w].thread, NULL );
+        taken += workers[w].taken;
+    }
+    gettimeofday( &end, NULL );
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    fprintf( stderr, "Replayed %d settings on %d threads in %.2f s (%.0f cycles/s), %lu taken from other threads\n",
+    n_grid, n_workers, seconds, seconds > 0 ? (double)n_grid * n_samples / seconds : 0.0, taken );
+
+    /* cheapest of the ones which keep the boiler top warm enough */
+    allowed_cold = (max_cold >= 0) ? (int)(max_cold * comfort_cycles / 100) : (int)baseline.cold;
+    for (i=0;i<n_grid;i++) {
+        if ( outcomes[i].cold > (unsigned long)allowed_cold ) continue;
+        if ( (best < 0) || (outcomes[i].cost < outcomes[best].cost) ||
+             ((outcomes[i].cost == outcomes[best].cost) && (outcomes[i].cold < outcomes[best].cold)) ) best = i;
+    }
+    describe( &current, &baseline, buf, sizeof buf );
+    fprintf( stderr, "Now:         %s\n", buf );
+    if ( best < 0 ) {
+        fprintf( stderr, "None of the settings tried keeps the boiler top warm enough - config left as it is.\n" );
+        WriteConfig( cfg_file, &current );
+        return 5;
+    }
+    describe( &grid[best], &outcomes[best], buf, sizeof buf );
+    fprintf( stderr, "Recommended: %s\n", buf );
+    fprintf( stderr, "Expected savings: %.2f (%.1f%%) over the %.1f days replayed, %.2f a year\n",
+    baseline.cost - outcomes[best].cost, baseline.cost > 0 ? 100 * (baseline.cost - outcomes[best].cost) / baseline.cost : 0.0,
+    days, days > 0 ? (baseline.cost - outcomes[best].cost) * 365 / days : 0.0 );
+    WriteConfig( cfg_file, &grid[best] );
+    return 0;
+}
@@ -14,44 +14,117 @@
 * The daemon is controlled via its configuration file, which solard can be told to
 * re-read and parse while running to change config in flight. This is done by
 * sending SIGUSR1 signal to the daemon process. The event is noted in the log file.
+* Heating decisions are taken by rules, read from a rules file (or built in), which
+* are re-read together with the configuration file.
 * The logfile itself can be "grep"-ed for "ALARM" and "INFO" to catch and notify
-* of notable events, recorded by the daemon.
+* of notable events, recorded by the daemon. These events are also kept as typed
+* records in an indexed event log, which the solard-events tool can query.
 */
 
 #ifndef PGMVER
 #error Need to define PGMVER in order to compile me!
 #endif
 
+#define _GNU_SOURCE
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/time.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <ctype.h>
 #include <time.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <zlib.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+#ifdef BENCHMARK
+#include <sys/resource.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#endif
+
+/* SOLARD_ROOT puts every file solard uses (and the GPIO sysfs tree) under another directory -
+the benchmark build uses it to run against a fake tree on tmpfs */
+#ifndef SOLARD_ROOT
+#define SOLARD_ROOT     ""
+#endif
 
 #define RUNNING_DIR     "/tmp"
-#define LOCK_FILE       "/run/solard.pid"
-#define LOG_FILE        "/var/log/solard.log"
-#define DATA_FILE       "/run/shm/solard_data.log"
-#define TABLE_FILE      "/run/shm/solard_current"
-#define JSON_FILE	"/run/shm/solard_current_json"
-#define CFG_TABLE_FILE  "/run/shm/solard_cur_cfg"
-#define CONFIG_FILE     "/etc/solard.cfg"
-#define POWER_FILE      "/var/log/solard_power"
+#define SOLARD_EXE      "/usr/bin/solard"
+#define LOCK_FILE       SOLARD_ROOT "/run/solard.pid"
+#define LOG_FILE        SOLARD_ROOT "/var/log/solard.log"
+#define DATA_DIR        SOLARD_ROOT "/run/shm"
+#define DATA_NAME       "solard_data.log"
+#define DATA_FILE       DATA_DIR "/" DATA_NAME
+#define ARCHIVE_DIR     SOLARD_ROOT "/var/log"
+#define DATA_ARCHIVE    ARCHIVE_DIR "/solard_data.log.gz"
+#define ARCHIVE_PENDING SOLARD_ROOT "/var/log/solard_data.log.gz.pending"
+#define TABLE_FILE      SOLARD_ROOT "/run/shm/solard_current"
+#define JSON_FILE       SOLARD_ROOT "/run/shm/solard_current_json"
+#define INFLUX_FILE     SOLARD_ROOT "/run/shm/solard_current_influx"
+#define PUTVAL_FILE     SOLARD_ROOT "/run/shm/solard_current_putval"
+#define CFG_TABLE_FILE  SOLARD_ROOT "/run/shm/solard_cur_cfg"
+#define CONFIG_FILE     SOLARD_ROOT "/etc/solard.cfg"
+#define RULES_FILE      SOLARD_ROOT "/etc/solard.rules"
+#define SHADOW_RULES_FILE SOLARD_ROOT "/etc/solard.rules.candidate"
+#define POWER_FILE      SOLARD_ROOT "/var/log/solard_power"
+#define STATS_FILE      SOLARD_ROOT "/run/shm/solard_stats"
+#define LEDGER_FILE     SOLARD_ROOT "/var/log/solard_ledger"
+#define STATE_FILE      SOLARD_ROOT "/var/log/solard_state"
+#define FLIGHT_FILE     SOLARD_ROOT "/var/log/solard_flight"
+#define SENSOR_MAP_FILE SOLARD_ROOT "/var/log/solard_sensors"
+#define RESPONSE_FILE   SOLARD_ROOT "/var/log/solard_responses"
+#define SHADOW_FILE     SOLARD_ROOT "/var/log/solard_shadow"
+#define W1_DEVICES      SOLARD_ROOT "/sys/bus/w1/devices"
+#define GPIO_DIR        SOLARD_ROOT "/sys/class/gpio"
+
+#include "solard_events.h"
+#include "solard_control.h"
 
 #define BUFFER_MAX 3
-#define DIRECTION_MAX 35
-#define VALUE_MAX 50
+#define GPIO_EXPORT_WAIT_MS 500
+#define DIRECTION_MAX (35 + sizeof(SOLARD_ROOT))
+#define VALUE_MAX (50 + sizeof(SOLARD_ROOT))
 #define MAXLEN 80
 
+#ifdef BENCHMARK
+/* latency the benchmark injects to make its fake w1 and GPIO files as slow as the real ones */
+long bench_w1_latency_us = 0;
+long bench_gpio_latency_us = 0;
+#define W1_LATENCY()    if ( bench_w1_latency_us ) usleep( bench_w1_latency_us )
+#define GPIO_LATENCY()  if ( bench_gpio_latency_us ) usleep( bench_gpio_latency_us )
+#else
+#define W1_LATENCY()
+#define GPIO_LATENCY()
+#endif
+
 #define IN  0
 #define OUT 1
+/* output, starting at the given level - no glitch between setting direction and value */
+#define OUT_LOW  2
+#define OUT_HIGH 3
 
 #define LOW  0
 #define HIGH 1
@@ -62,8 +135,15 @@
 /* Number of all sensors to be used by the system */
 #define TOTALSENSORS         4
 
-/* Array of char* holding the paths to temperature DS18B20 sensors */
+/* Array of char* holding the paths to temperature DS18B20 sensors, and the paths themselves */
 char* sensor_paths[TOTALSENSORS+1];
+char sensor_path[TOTALSENSORS+1][MAXLEN];
+
+/* Array of char* holding what config says for each sensor: a path, a device ID or "auto" */
+char* sensor_roles[TOTALSENSORS+1];
+
+/* Array of int* holding the configured resolutions (9-12 bit) of the sensors */
+int* sensor_resolutions[TOTALSENSORS+1];
 
 /*  var to keep track of read errors, so if a threshold is reached - the
     program can safely shut down everything, send notification and bail out;
@@ -90,45 +170,103 @@ float sensors_prv[TOTALSENSORS+1] = { 0, -200, -200, -200, -200 };
 #define   TboilerLowPrev        sensors_prv[4]
 
 /* current controls state - e.g. set on last decision making */
-short controls[7] = { -1, 0, 0, 0, 0, 0, 0 };
+short controls[8] = { -1, 0, 0, 0, 0, 0, 0, 0 };
 
 /* and control name mappings */
 #define   CPump1                controls[1]
 #define   CPump2                controls[2]
 #define   CValve                controls[3]
 #define   CHeater               controls[4]
-#define   CPowerByBattery       controls[5]
-#define   CPowerByBatteryPrev   controls[6]
+#define   CHeatPump             controls[5]
+#define   CPowerByBattery       controls[6]
+#define   CPowerByBatteryPrev   controls[7]
 
 /* controls state cycles - zeroed on change to state */
-long ctrlstatecycles[5] = { -1, 150000, 150000, 2200, 2200 };
+long ctrlstatecycles[6] = { -1, 150000, 150000, 2200, 2200, 2200 };
 
 #define   SCPump1               ctrlstatecycles[1]
 #define   SCPump2               ctrlstatecycles[2]
 #define   SCValve               ctrlstatecycles[3]
 #define   SCHeater              ctrlstatecycles[4]
+#define   SCHeatPump            ctrlstatecycles[5]
+
+/* Number of relays driven - they use the same indexes in controls[] and ctrlstatecycles[] */
+#define TOTALRELAYS          5
 
-float TotalPowerUsed;
-float NightlyPowerUsed;
+/* Upper limit for the number of cycles the flight recorder keeps - one hour */
+#define FLIGHT_MAX           360
+
+/* Upper limit for the configurable relay toggles per hour budget */
+#define MAX_TOGGLES_PER_HOUR 120
 
 float nightEnergyTemp;
 
-/* solard keeps track of total and night tariff watt-hours electrical power used */
-/* night tariff is between 23:00 and 06:00 */
-/* constants of Watt-hours of electricity used per 10 secs */
-#define   HEATERPPC         8.340
-#define   PUMP1PPC          0.135
-#define   PUMP2PPC          0.021
-#define   VALVEPPC          0.006
-#define   SELFPPC           0.022
-/* my boiler uses 3kW per hour, so this is 0,00834 kWh per 10 seconds */
-/* this in Wh per 10 seconds is 8.34 W */
-/* pump 1 (furnace) runs at 48 W setting, pump 2 (solar) - 7 W */
-
-/* NightEnergy (NE) start and end hours variables - get recalculated every day */
+/* solard keeps track of total and night tariff electrical energy used, in integer milli-Wh */
+/* night tariff hours are configurable - by default 23:00 to 06:59 in summer, 22:00 to 05:59 in winter */
+/* the power each device uses is in solard_control.h */
+
+/* devices energy is accounted for */
+#define   TOTALDEVICES      6
+#define   DEV_HEATER        0
+#define   DEV_PUMP1         1
+#define   DEV_PUMP2         2
+#define   DEV_VALVE         3
+#define   DEV_SELF          4
+#define   DEV_HEATPUMP      5
+
+static const char *device_names[TOTALDEVICES] = { "heater", "pump1", "pump2", "valve", "self", "heatpump" };
+
+/* the heat pump's power is in the config, as cfg.heat_pump_watts - this is it in milli-Wh per 10 seconds */
+unsigned long heat_pump_ppc = 0;
+
+/* the heat pump's COP estimated this cycle, by EstimateHeatPumpCOP() */
+float heat_pump_cop = 1;
+
+/* electric heat sources ElectricHeatSource() picks from */
+#define   EH_NONE           0
+#define   EH_HEATER         1
+#define   EH_HEATPUMP       2
+
+/* energy used since the last power counters reset, milli-Wh */
+unsigned long long TotalEnergyUsed;
+unsigned long long NightlyEnergyUsed;
+
+/* ...and the same in Wh, as logged and shown */
+#define   TotalPowerUsed        ((double)TotalEnergyUsed/1000)
+#define   NightlyPowerUsed      ((double)NightlyEnergyUsed/1000)
+
+/* energy used today, milli-Wh: per device, per hour of day, and per device, per tariff (0 - day, 1 - night);
+these go in LEDGER_FILE once the day is over */
+unsigned long energy_hour[TOTALDEVICES][24];
+unsigned long energy_tariff[TOTALDEVICES][2];
+
+/* the date (YYYY-MM-DD) the above counters are for */
+char energy_date[12] = "";
+
+/* heat put in the tank by each source, milli-Wh: today and since the power counters reset */
+#define   HEAT_SOURCES      4
+#define   HEAT_SOLAR        0
+#define   HEAT_FURNACE      1
+#define   HEAT_HEATER       2
+#define   HEAT_HEATPUMP     3
+
+static const char *heat_source_names[HEAT_SOURCES] = { "solar", "furnace", "heater", "heatpump" };
+
+unsigned long long heat_today[HEAT_SOURCES];
+unsigned long long heat_month[HEAT_SOURCES];
+
+/* NightEnergy (NE) start and end hours variables - seasonal hours of the current month */
 unsigned short NEstart = 20;
 unsigned short NEstop  = 11;
 
+/* the weekly schedule compiled from config, and its table of the minutes ahead */
+struct schedule_cfg sched_cfg;
+struct schedule schedule;
+
+/* schedule entry of the current cycle - nothing is scheduled until the first lookup */
+static const struct sched_minute sched_none;
+const struct sched_minute *sched_now = &sched_none;
+
 /* Nubmer of cycles (circa 10 seconds each) that the program has run */
 unsigned long ProgramRunCycles  = 0;
 
@@ -139,9 +277,6 @@ unsigned short current_month = 0;
 /* a var to be non-zero if it is winter time - so furnace should not be allowed to go too cold */
 unsigned short now_is_winter = 0;
 
-/* array storing the hour at wich to make the solar pump daily run for each month */
-unsigned short pump_start_hour_for[13] = { 11, 14, 13, 12, 11, 10, 9, 9, 10, 11, 12, 13, 14 };
-
 struct cfg_struct
 {
     char    tkotel_sensor[MAXLEN];
@@ -180,6 +315,107 @@ struct cfg_struct
     int     night_boost;
     char    abs_max_str[MAXLEN];
     int     abs_max;
+    char    pump1_min_on_str[MAXLEN];
+    int     pump1_min_on;
+    char    pump1_min_off_str[MAXLEN];
+    int     pump1_min_off;
+    char    pump1_max_toggles_str[MAXLEN];
+    int     pump1_max_toggles;
+    char    pump2_min_on_str[MAXLEN];
+    int     pump2_min_on;
+    char    pump2_min_off_str[MAXLEN];
+    int     pump2_min_off;
+    char    pump2_max_toggles_str[MAXLEN];
+    int     pump2_max_toggles;
+    char    valve_min_on_str[MAXLEN];
+    int     valve_min_on;
+    char    valve_min_off_str[MAXLEN];
+    int     valve_min_off;
+    char    valve_max_toggles_str[MAXLEN];
+    int     valve_max_toggles;
+    char    heater_min_on_str[MAXLEN];
+    int     heater_min_on;
+    char    heater_min_off_str[MAXLEN];
+    int     heater_min_off;
+    char    heater_max_toggles_str[MAXLEN];
+    int     heater_max_toggles;
+    char    heat_pump_pin_str[MAXLEN];
+    int     heat_pump_pin;
+    int     use_heat_pump;
+    char    heat_pump_min_on_str[MAXLEN];
+    int     heat_pump_min_on;
+    char    heat_pump_min_off_str[MAXLEN];
+    int     heat_pump_min_off;
+    char    heat_pump_max_toggles_str[MAXLEN];
+    int     heat_pump_max_toggles;
+    char    heat_pump_watts_str[MAXLEN];
+    int     heat_pump_watts;
+    char    heat_pump_efficiency_str[MAXLEN];
+    int     heat_pump_efficiency;
+    char    relay_stagger_ms_str[MAXLEN];
+    int     relay_stagger_ms;
+    char    night_tariff_summer_str[MAXLEN];
+    int     nt_summer_start;
+    int     nt_summer_stop;
+    char    night_tariff_winter_str[MAXLEN];
+    int     nt_winter_start;
+    int     nt_winter_stop;
+    char    summer_months_str[MAXLEN];
+    int     summer_first_month;
+    int     summer_last_month;
+    char    night_tariff_str[SCHED_CFG_MAX];
+    char    holidays_str[SCHED_CFG_MAX];
+    char    away_str[SCHED_CFG_MAX];
+    char    pump_exercise_str[SCHED_CFG_MAX];
+    char    day_price_str[MAXLEN];
+    float   day_price;
+    char    night_price_str[MAXLEN];
+    float   night_price;
+    char    tank_liters_str[MAXLEN];
+    int     tank_liters;
+    char    state_sync_cycles_str[MAXLEN];
+    int     state_sync_cycles;
+    char    state_max_age_str[MAXLEN];
+    int     state_max_age;
+    char    tkotel_resolution_str[MAXLEN];
+    int     tkotel_resolution;
+    char    tkolektor_resolution_str[MAXLEN];
+    int     tkolektor_resolution;
+    char    tboilerh_resolution_str[MAXLEN];
+    int     tboilerh_resolution;
+    char    tboilerl_resolution_str[MAXLEN];
+    int     tboilerl_resolution;
+    char    sensor_max_interval_str[MAXLEN];
+    int     sensor_max_interval;
+    char    influx_output_str[MAXLEN];
+    int     influx_output;
+    char    collectd_output_str[MAXLEN];
+    int     collectd_output;
+    char    realtime_priority_str[MAXLEN];
+    int     realtime_priority;
+    char    cpu_core_str[MAXLEN];
+    int     cpu_core;
+    char    safe_relay_state_str[MAXLEN];
+    int     safe_relay_state;
+    char    log_repeat_window_str[MAXLEN];
+    int     log_repeat_window;
+    char    data_archive_str[MAXLEN];
+    int     data_archive;
+    char    data_roll_kb_str[MAXLEN];
+    int     data_roll_kb;
+    char    data_roll_minutes_str[MAXLEN];
+    int     data_roll_minutes;
+    char    sse_port_str[MAXLEN];
+    int     sse_port;
+    char    sse_socket[MAXLEN];
+    char    flight_cycles_str[MAXLEN];
+    int     flight_cycles;
+    char    anomaly_minutes_str[MAXLEN];
+    int     anomaly_minutes;
+    char    anomaly_warn_str[MAXLEN];
+    int     anomaly_warn;
+    char    anomaly_alarm_str[MAXLEN];
+    int     anomaly_alarm;
 }
 cfg_struct;
 
@@ -187,11 +423,37 @@ struct cfg_struct cfg;
 
 short need_to_read_cfg = 0;
 
+short need_to_reexec = 0;
+
+/* set when the flight recorder is asked for a dump from outside the control loop */
+volatile sig_atomic_t flight_dump_requested = 0;
+
 short just_started = 0;
 
+/* non-zero while emergency cooling is active */
+unsigned short AlarmRaised = 0;
+
 /* FORWARD DECLARATIONS so functions can be used in preceding ones */
 short
+log_message(char *filename, char *message);
+short
 DisableGPIOpins();
+void
+ReWrite_STATS_FILE();
+void
+WriteState( short must_sync );
+void
+FlightSensor( short i, float raw, short status, long took );
+void
+FlightDump( const char *reason );
+short
+MapSensors();
+short
+ElectricHeatSource();
+void
+LoadShadowRules();
+void
+ShadowDayEnd();
 /* end of forward-declared functions */
 
 void
@@ -215,6 +477,14 @@ not_every_GPIO_pin_is_UNIQUE()
 	if (cfg.pump2_pin == cfg.valve1_pin) result++;
 	if (cfg.pump2_pin == cfg.el_heater_pin) result++;
 	if (cfg.valve1_pin == cfg.el_heater_pin) result++;
+	/* pin 0 - there is no heat pump */
+	if (cfg.heat_pump_pin) {
+		if (cfg.bat_powered_pin == cfg.heat_pump_pin) result++;
+		if (cfg.pump1_pin == cfg.heat_pump_pin) result++;
+		if (cfg.pump2_pin == cfg.heat_pump_pin) result++;
+		if (cfg.valve1_pin == cfg.heat_pump_pin) result++;
+		if (cfg.el_heater_pin == cfg.heat_pump_pin) result++;
+	}
 	return result;
 }
 
@@ -247,6 +517,47 @@ rangecheck_day_of_month( int d )
     if (d > 28) d = 28;
 }
 
+/* parse "first-last" range from s into first and last, each within min..max;
+on error use the default values */
+void
+parse_range( const char *s, int *first, int *last, int min, int max, int def_first, int def_last )
+{
+    int a, b;
+
+    if ( (sscanf( s, "%d-%d", &a, &b ) != 2) || (a < min) || (a > max) || (b < min) || (b > max) ) {
+        a = def_first;
+        b = def_last;
+    }
+    *first = a;
+    *last = b;
+}
+
+/* relay min on/off times are in seconds, up to 1 hour */
+int
+rangecheck_relay_time( int s )
+{
+    if (s < 0) s = 0;
+    if (s > 3600) s = 3600;
+    return s;
+}
+
+/* relay max toggles per hour - 0 means no limit */
+int
+rangecheck_relay_toggles( int t )
+{
+    if (t < 0) t = 0;
+    if (t > MAX_TOGGLES_PER_HOUR) t = MAX_TOGGLES_PER_HOUR;
+    return t;
+}
+
+/* DS18B20 resolution in bits - 12 (the sensor's own default) if not set right */
+int
+rangecheck_sensor_resolution( int r )
+{
+    if ((r < 9) || (r > 12)) r = 12;
+    return r;
+}
+
 void
 SetDefaultPINs() {
     cfg.bat_powered_pin = 25;
@@ -254,10 +565,13 @@ SetDefaultPINs() {
     cfg.pump2_pin = 18;
     cfg.valve1_pin = 27;
     cfg.el_heater_pin = 22;
+    cfg.heat_pump_pin = 0;
 }
 
 void
 SetDefaultCfg() {
+    short i;
+
     strcpy( cfg.tkotel_sensor, "/dev/zero/1");
     strcpy( cfg.tkolektor_sensor, "/dev/zero/2");
     strcpy( cfg.tboilerh_sensor, "/dev/zero/3");
@@ -274,64 +588,1015 @@ SetDefaultCfg() {
     cfg.day_to_reset_Pcounters = 4;
     cfg.night_boost = 0;
     cfg.abs_max = 47;
+    /* relay timings - these keep the anti-chatter delays solard always had; since
+    these settings are new, keep their defaults even if the config file lacks them */
+    strcpy( cfg.pump1_min_on_str, "60" );
+    strcpy( cfg.pump1_min_off_str, "30" );
+    strcpy( cfg.pump1_max_toggles_str, "0" );
+    strcpy( cfg.pump2_min_on_str, "60" );
+    strcpy( cfg.pump2_min_off_str, "30" );
+    strcpy( cfg.pump2_max_toggles_str, "0" );
+    strcpy( cfg.valve_min_on_str, "180" );
+    strcpy( cfg.valve_min_off_str, "60" );
+    strcpy( cfg.valve_max_toggles_str, "0" );
+    strcpy( cfg.heater_min_on_str, "180" );
+    strcpy( cfg.heater_min_off_str, "300" );
+    strcpy( cfg.heater_max_toggles_str, "0" );
+    strcpy( cfg.heat_pump_pin_str, "0" );
+    strcpy( cfg.heat_pump_min_on_str, "600" );
+    strcpy( cfg.heat_pump_min_off_str, "600" );
+    strcpy( cfg.heat_pump_max_toggles_str, "3" );
+    strcpy( cfg.heat_pump_watts_str, "1000" );
+    strcpy( cfg.heat_pump_efficiency_str, "45" );
+    strcpy( cfg.relay_stagger_ms_str, "250" );
+    strcpy( cfg.night_tariff_summer_str, "23-6" );
+    strcpy( cfg.night_tariff_winter_str, "22-5" );
+    strcpy( cfg.summer_months_str, "4-10" );
+    cfg.night_tariff_str[0] = 0;
+    cfg.holidays_str[0] = 0;
+    cfg.away_str[0] = 0;
+    cfg.pump_exercise_str[0] = 0;
+    strcpy( cfg.day_price_str, "0" );
+    strcpy( cfg.night_price_str, "0" );
+    strcpy( cfg.tank_liters_str, "0" );
+    strcpy( cfg.state_sync_cycles_str, "30" );
+    strcpy( cfg.state_max_age_str, "600" );
+    strcpy( cfg.tkotel_resolution_str, "12" );
+    strcpy( cfg.tkolektor_resolution_str, "12" );
+    strcpy( cfg.tboilerh_resolution_str, "12" );
+    strcpy( cfg.tboilerl_resolution_str, "12" );
+    strcpy( cfg.sensor_max_interval_str, "1" );
+    strcpy( cfg.influx_output_str, "0" );
+    strcpy( cfg.collectd_output_str, "0" );
+    strcpy( cfg.realtime_priority_str, "0" );
+    strcpy( cfg.cpu_core_str, "-1" );
+    strcpy( cfg.safe_relay_state_str, "0" );
+    strcpy( cfg.log_repeat_window_str, "600" );
+    strcpy( cfg.data_archive_str, "1" );
+    strcpy( cfg.data_roll_kb_str, "256" );
+    strcpy( cfg.data_roll_minutes_str, "60" );
+    strcpy( cfg.sse_port_str, "0" );
+    strcpy( cfg.sse_socket, "" );
+    strcpy( cfg.flight_cycles_str, "360" );
+    strcpy( cfg.anomaly_minutes_str, "5" );
+    strcpy( cfg.anomaly_warn_str, "4" );
+    strcpy( cfg.anomaly_alarm_str, "8" );
+    cfg.pump1_min_on = 60;
+    cfg.pump1_min_off = 30;
+    cfg.pump1_max_toggles = 0;
+    cfg.pump2_min_on = 60;
+    cfg.pump2_min_off = 30;
+    cfg.pump2_max_toggles = 0;
+    cfg.valve_min_on = 180;
+    cfg.valve_min_off = 60;
+    cfg.valve_max_toggles = 0;
+    cfg.heater_min_on = 180;
+    cfg.heater_min_off = 300;
+    cfg.heater_max_toggles = 0;
+    cfg.use_heat_pump = 0;
+    cfg.heat_pump_min_on = 600;
+    cfg.heat_pump_min_off = 600;
+    cfg.heat_pump_max_toggles = 3;
+    cfg.heat_pump_watts = 1000;
+    cfg.heat_pump_efficiency = 45;
+    cfg.relay_stagger_ms = 250;
+    cfg.nt_summer_start = 23;
+    cfg.nt_summer_stop = 6;
+    cfg.nt_winter_start = 22;
+    cfg.nt_winter_stop = 5;
+    cfg.summer_first_month = 4;
+    cfg.summer_last_month = 10;
+    cfg.day_price = 0;
+    cfg.night_price = 0;
+    cfg.tank_liters = 0;
+    cfg.state_sync_cycles = 30;
+    cfg.state_max_age = 600;
+    cfg.tkotel_resolution = 12;
+    cfg.tkolektor_resolution = 12;
+    cfg.tboilerh_resolution = 12;
+    cfg.tboilerl_resolution = 12;
+    cfg.sensor_max_interval = 1;
+    cfg.influx_output = 0;
+    cfg.collectd_output = 0;
+    cfg.realtime_priority = 0;
+    cfg.cpu_core = -1;
+    cfg.safe_relay_state = 0;
+    cfg.log_repeat_window = 600;
+    cfg.data_archive = 1;
+    cfg.data_roll_kb = 256;
+    cfg.data_roll_minutes = 60;
+    cfg.sse_port = 0;
+    cfg.flight_cycles = 360;
+    cfg.anomaly_minutes = 5;
+    cfg.anomaly_warn = 4;
+    cfg.anomaly_alarm = 8;
 
     nightEnergyTemp = 0;
-    sensor_paths[0] = (char *) &cfg.tkotel_sensor;
-    sensor_paths[1] = (char *) &cfg.tkotel_sensor;
-    sensor_paths[2] = (char *) &cfg.tkolektor_sensor;
-    sensor_paths[3] = (char *) &cfg.tboilerh_sensor;
-    sensor_paths[4] = (char *) &cfg.tboilerl_sensor;
+    sensor_roles[0] = (char *) &cfg.tkotel_sensor;
+    sensor_roles[1] = (char *) &cfg.tkotel_sensor;
+    sensor_roles[2] = (char *) &cfg.tkolektor_sensor;
+    sensor_roles[3] = (char *) &cfg.tboilerh_sensor;
+    sensor_roles[4] = (char *) &cfg.tboilerl_sensor;
+    for (i=0;i<=TOTALSENSORS;i++) {
+        sensor_paths[i] = sensor_path[i];
+        strcpy( sensor_path[i], sensor_roles[i] );
+    }
+    sensor_resolutions[0] = &cfg.tkotel_resolution;
+    sensor_resolutions[1] = &cfg.tkotel_resolution;
+    sensor_resolutions[2] = &cfg.tkolektor_resolution;
+    sensor_resolutions[3] = &cfg.tboilerh_resolution;
+    sensor_resolutions[4] = &cfg.tboilerl_resolution;
+}
+
+/* Background output writer: the control loop hands finished log and export file contents to a
+normal priority thread through a single producer, single consumer ring, so file system latency
+never delays a relay decision. Only the main thread queues; signal handlers and other threads write
+directly. A job which finds the ring full is dropped and counted. */
+#define OUTPUT_JOBS         32
+#define OUTPUT_JOB_MAX      3072
+#define OUTPUT_FLUSH_MS     2000
+
+#define JOB_WRITE           0
+#define JOB_SYNC            1
+#define JOB_ROLL            2
+
+struct output_job_struct {
+    short type;
+    char filename[MAXLEN];
+    int flags;
+    int fd;
+    int len;
+    char data[OUTPUT_JOB_MAX];
+};
+
+struct output_job_struct output_jobs[OUTPUT_JOBS];
+unsigned long output_head = 0;
+unsigned long output_tail = 0;
+unsigned long output_jobs_dropped = 0;
+short output_thread_running = 0;
+volatile sig_atomic_t in_signal_handler = 0;
+pthread_t output_thread;
+pthread_t main_thread;
+pthread_mutex_t output_lock;
+pthread_cond_t output_wake = PTHREAD_COND_INITIALIZER;
+
+short
+WriteFileNow( const char *filename, int flags, const char *data, int len ) {
+    int fd;
+
+    fd = open( filename, O_WRONLY|O_CREAT|O_CLOEXEC|flags, 0666 );
+    if ( fd == -1 ) return -1;
+    if ( len > 0 ) write( fd, data, len );
+    close( fd );
+    return 0;
+}
+
+/* Data file archive: DATA_FILE on tmpfs is rolled - renamed to DATA_FILE.<date-time> - when it
+reaches cfg.data_roll_kb or is cfg.data_roll_minutes old, so no more than that is lost on power
+failure. The archiver thread gzips the rolled segments, oldest first, a chunk at a time, and
+appends each as a gzip member to DATA_ARCHIVE - zcat reads it as one file. ARCHIVE_PENDING notes
+the archive size before an append, and is removed (for good) only once the append is on disk, so
+while it is there the archive is cut back to that size on start-up - the segment, if it is still
+there after a power failure took tmpfs, is then appended again. */
+#define ARCHIVE_CHUNK       16384
+
+pthread_t archive_thread;
+pthread_mutex_t archive_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t archive_wake_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t archive_wake = PTHREAD_COND_INITIALIZER;
+short archive_wanted = 0;
+short archiver_running = 0;
+unsigned long data_file_bytes = 0;
+time_t data_file_started = 0;
+unsigned long data_segments_archived = 0;
+unsigned long data_archive_errors = 0;
+
+/* Compress segment (a file name in DATA_DIR) onto the end of DATA_ARCHIVE. Returns 0 on success. */
+short
+ArchiveSegment( const char *segment ) {
+    static unsigned char in[ARCHIVE_CHUNK], out[ARCHIVE_CHUNK];
+    char path[MAXLEN+40], pending[MAXLEN+80];
+    z_stream z;
+    struct stat st;
+    ssize_t n;
+    int fd, afd, pfd, dfd, flush, len;
+    short failed = 0;
+
+    snprintf( path, sizeof path, DATA_DIR "/%s", segment );
+    fd = open( path, O_RDONLY|O_CLOEXEC );
+    if ( fd == -1 ) return -1;
+    afd = open( DATA_ARCHIVE, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, 0644 );
+    if ( (afd == -1) || fstat( afd, &st ) ) {
+        close( fd );
+        if ( afd != -1 ) close( afd );
+        return -1;
+    }
+    len = snprintf( pending, sizeof pending, "%s %lld\n", segment, (long long)st.st_size );
+    pfd = open( ARCHIVE_PENDING, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644 );
+    if ( (pfd == -1) || (write( pfd, pending, len ) != len) || fdatasync( pfd ) ) failed = 1;
+    if ( pfd != -1 ) close( pfd );
+
+    memset( &z, 0, sizeof z );
+    /* 15+16: gzip wrapper; level 6 and 8 (128 KB) of memory - bounded, whatever the segment size */
+    if ( !failed && (deflateInit2( &z, 6, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY ) != Z_OK) ) failed = 1;
+    else if ( !failed ) {
+        do {
+            n = read( fd, in, sizeof in );
+            if ( n < 0 ) { failed = 1; break; }
+            flush = ( n == 0 ) ? Z_FINISH : Z_NO_FLUSH;
+            z.next_in = in;
+            z.avail_in = n;
+            do {
+                z.next_out = out;
+                z.avail_out = sizeof out;
+                deflate( &z, flush );
+                len = sizeof out - z.avail_out;
+                if ( len && (write( afd, out, len ) != len) ) { failed = 1; break; }
+            } while ( z.avail_out == 0 );
+        } while ( !failed && (flush != Z_FINISH) );
+        deflateEnd( &z );
+    }
+    close( fd );
+    if ( !failed && fdatasync( afd ) ) failed = 1;
+    if ( failed ) {
+        /* leave the archive as it was - the segment is tried again later */
+        ftruncate( afd, st.st_size );
+        close( afd );
+        unlink( ARCHIVE_PENDING );
+        return -1;
+    }
+    close( afd );
+    /* the append is complete only once ARCHIVE_PENDING is gone from the disk too */
+    unlink( ARCHIVE_PENDING );
+    dfd = open( ARCHIVE_DIR, O_RDONLY|O_DIRECTORY|O_CLOEXEC );
+    if ( dfd != -1 ) {
+        fsync( dfd );
+        close( dfd );
+    }
+    unlink( path );
+    return 0;
+}
+
+/* Undo an append cut short, as noted in ARCHIVE_PENDING - whether its segment is still there
+or not, as a power failure takes the tmpfs segment and leaves a torn gzip member */
+void
+RecoverArchive() {
+    char buf[MAXLEN+80], segment[MAXLEN+1], format[20];
+    long long size;
+    ssize_t n;
+    int fd;
+
+    fd = open( ARCHIVE_PENDING, O_RDONLY|O_CLOEXEC );
+    if ( fd == -1 ) return;
+    n = read( fd, buf, sizeof(buf)-1 );
+    close( fd );
+    if ( n > 0 ) {
+        buf[n] = 0;
+        snprintf( format, sizeof format, "%%%ds %%lld", MAXLEN );
+        if ( (sscanf( buf, format, segment, &size ) == 2) && (size >= 0) ) truncate( DATA_ARCHIVE, size );
+    }
+    unlink( ARCHIVE_PENDING );
+}
+
+/* Archive the oldest segment in DATA_DIR. Returns 0 if there was none, or it failed. */
+short
+ArchiveNextSegment() {
+    char oldest[MAXLEN+1] = "";
+    char msg[150];
+    struct dirent *e;
+    DIR *d;
+    short r;
+
+    pthread_mutex_lock( &archive_lock );
+    d = opendir( DATA_DIR );
+    if ( d ) {
+        while ( (e = readdir( d )) ) {
+            if ( strncmp( e->d_name, DATA_NAME ".", sizeof(DATA_NAME) ) || (strlen( e->d_name ) > MAXLEN) ) continue;
+            if ( !oldest[0] || (strcmp( e->d_name, oldest ) < 0) ) strcpy( oldest, e->d_name );
+        }
+        closedir( d );
+    }
+    r = oldest[0] ? ArchiveSegment( oldest ) : 0;
+    pthread_mutex_unlock( &archive_lock );
+    if ( !oldest[0] ) return 0;
+    if ( r ) {
+        data_archive_errors++;
+        snprintf( msg, sizeof msg, "WARNING: Failed to archive "DATA_DIR"/%.40s to "DATA_ARCHIVE"! Will retry.", oldest );
+        log_message(LOG_FILE, msg);
+        return 0;
+    }
+    data_segments_archived++;
+    return 1;
+}
+
+void *
+DataArchiver( void *arg ) {
+    (void)arg;
+    RecoverArchive();
+    while (1) {
+        while ( ArchiveNextSegment() );
+        pthread_mutex_lock( &archive_wake_lock );
+        while ( !archive_wanted ) pthread_cond_wait( &archive_wake, &archive_wake_lock );
+        archive_wanted = 0;
+        pthread_mutex_unlock( &archive_wake_lock );
+    }
+    return NULL;
+}
+
+void
+WakeArchiver() {
+    pthread_mutex_lock( &archive_wake_lock );
+    archive_wanted = 1;
+    pthread_cond_signal( &archive_wake );
+    pthread_mutex_unlock( &archive_wake_lock );
+}
+
+/* Rename DATA_FILE to segment and have it archived - in order with the queued writes to it */
+void
+RollNow( const char *segment ) {
+    char path[MAXLEN+40];
+
+    snprintf( path, sizeof path, DATA_DIR "/%s", segment );
+    if ( rename( DATA_FILE, path ) ) return;
+    WakeArchiver();
+}
+
+void *
+OutputWriter( void *arg ) {
+    struct output_job_struct *j;
+
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock( &output_lock );
+        while ( __atomic_load_n( &output_tail, __ATOMIC_SEQ_CST ) == __atomic_load_n( &output_head, __ATOMIC_SEQ_CST ) ) {
+            pthread_cond_wait( &output_wake, &output_lock );
+        }
+        pthread_mutex_unlock( &output_lock );
+        j = &output_jobs[output_tail % OUTPUT_JOBS];
+        if ( j->type == JOB_SYNC ) { fdatasync( j->fd ); }
+        else if ( j->type == JOB_ROLL ) { RollNow( j->filename ); }
+        else { WriteFileNow( j->filename, j->flags, j->data, j->len ); }
+        __atomic_store_n( &output_tail, output_tail + 1, __ATOMIC_SEQ_CST );
+    }
+    return NULL;
+}
+
+/* the job the caller fills in when the ring is full; OutputJobQueued() drops it */
+struct output_job_struct output_job_spare;
+
+/* Get a free job slot, or NULL if the caller has to do the work itself. A full ring means the
+file system is stalled - waiting for the writer, or writing here, would stall the control loop
+too, so the job is dropped: the caller gets the spare slot, and is back at once. */
+struct output_job_struct *
+OutputJobSlot() {
+    if ( !output_thread_running || in_signal_handler || !pthread_equal( pthread_self(), main_thread ) ) return NULL;
+    if ( output_head - __atomic_load_n( &output_tail, __ATOMIC_SEQ_CST ) >= OUTPUT_JOBS ) {
+        output_jobs_dropped++;
+        return &output_job_spare;
+    }
+    return &output_jobs[output_head % OUTPUT_JOBS];
+}
+
+void
+OutputJobQueued( const struct output_job_struct *j ) {
+    if ( j == &output_job_spare ) return;
+    __atomic_store_n( &output_head, output_head + 1, __ATOMIC_SEQ_CST );
+    pthread_mutex_lock( &output_lock );
+    pthread_cond_signal( &output_wake );
+    pthread_mutex_unlock( &output_lock );
+}
+
+/* Wait up to OUTPUT_FLUSH_MS for the writer to catch up - before exit and exec */
+void
+FlushOutputs() {
+    short ms;
+
+    if ( !output_thread_running ) return;
+    for (ms=0; ms<OUTPUT_FLUSH_MS; ms++) {
+        if ( __atomic_load_n( &output_tail, __ATOMIC_SEQ_CST ) == __atomic_load_n( &output_head, __ATOMIC_SEQ_CST ) ) return;
+        usleep( 1000 );
+    }
+}
+
+/* Start a helper thread with normal scheduling, whatever the main thread runs with, and with
+signals blocked so they are always handled by the main thread. Returns 0 on success. */
+int
+StartThread( pthread_t *thread, void *(*fn)(void *), void *arg ) {
+    pthread_attr_t attr;
+    struct sched_param sp;
+    sigset_t all, old;
+    int err;
+
+    pthread_attr_init( &attr );
+    pthread_attr_setinheritsched( &attr, PTHREAD_EXPLICIT_SCHED );
+    pthread_attr_setschedpolicy( &attr, SCHED_OTHER );
+    sp.sched_priority = 0;
+    pthread_attr_setschedparam( &attr, &sp );
+    pthread_attr_setstacksize( &attr, 65536 );
+    sigfillset( &all );
+    pthread_sigmask( SIG_SETMASK, &all, &old );
+    err = pthread_create( thread, &attr, fn, arg );
+    pthread_sigmask( SIG_SETMASK, &old, NULL );
+    pthread_attr_destroy( &attr );
+    return err;
+}
+
+void
+StartOutputThread() {
+    pthread_mutexattr_t mattr;
+
+    main_thread = pthread_self();
+    pthread_mutexattr_init( &mattr );
+    pthread_mutexattr_setprotocol( &mattr, PTHREAD_PRIO_INHERIT );
+    pthread_mutex_init( &output_lock, &mattr );
+    pthread_mutexattr_destroy( &mattr );
+    if ( !StartThread( &output_thread, OutputWriter, NULL ) ) output_thread_running = 1;
+    if ( output_thread_running ) atexit( FlushOutputs );
+}
+
+/* The log functions format the whole line first and put it in the file with a single write() -
+no stdio buffers, and appended lines never get mixed */
+short
+WriteWholeFile( const char *filename, int flags, const char *data, int len ) {
+    struct output_job_struct *j;
+
+    if ( (len > OUTPUT_JOB_MAX) || (strlen( filename ) >= MAXLEN) || !(j = OutputJobSlot()) ) {
+        return WriteFileNow( filename, flags, data, len );
+    }
+    j->type = JOB_WRITE;
+    strcpy( j->filename, filename );
+    j->flags = flags;
+    j->len = ( len > 0 ) ? len : 0;
+    memcpy( j->data, data, j->len );
+    OutputJobQueued( j );
+    return 0;
+}
+
+void
+StartArchiver() {
+    struct stat st;
+
+    data_file_bytes = stat( DATA_FILE, &st ) ? 0 : st.st_size;
+    data_file_started = time(NULL);
+    if ( !StartThread( &archive_thread, DataArchiver, NULL ) ) archiver_running = 1;
+}
+
+/* Roll DATA_FILE if it is due; called after each line written to it */
+void
+RollDataFile() {
+    struct output_job_struct *j;
+    char segment[MAXLEN];
+    struct tm *t_struct;
+    time_t t = time(NULL);
+
+    if ( !cfg.data_archive || !archiver_running || !data_file_bytes ) return;
+    if ( (data_file_bytes < (unsigned long)cfg.data_roll_kb * 1024) &&
+         ((t - data_file_started) < cfg.data_roll_minutes * 60L) ) return;
+    t_struct = localtime( &t );
+    strftime( segment, sizeof segment, DATA_NAME ".%Y%m%d-%H%M%S", t_struct );
+    j = OutputJobSlot();
+    /* ring full - roll after a later line */
+    if ( j == &output_job_spare ) return;
+    data_file_bytes = 0;
+    data_file_started = t;
+    if ( !j ) { RollNow( segment ); return; }
+    j->type = JOB_ROLL;
+    strcpy( j->filename, segment );
+    OutputJobQueued( j );
+}
+
+/* Roll DATA_FILE and archive it right away - on the way out */
+void
+ArchiveDataNow() {
+    if ( !cfg.data_archive || !archiver_running ) return;
+    data_file_bytes = 1;
+    data_file_started = 0;
+    RollDataFile();
+    FlushOutputs();
+    while ( ArchiveNextSegment() );
+}
+
+/* fdatasync() fd from the writer thread */
+void
+SyncInBackground( int fd ) {
+    struct output_job_struct *j;
+
+    if ( !(j = OutputJobSlot()) ) { fdatasync( fd ); return; }
+    j->type = JOB_SYNC;
+    j->fd = fd;
+    OutputJobQueued( j );
 }
 
 short
 log_message(char *filename, char *message) {
-    FILE *logfile;
     char file_string[300];
-    char timestamp[30];
     time_t t;
     struct tm *t_struct;
+    int len;
 
     t = time(NULL);
     t_struct = localtime( &t );
-    strftime( timestamp, sizeof timestamp, "%F %T", t_struct );
-    sprintf( file_string, "%s %s", timestamp, message );
-    logfile = fopen( filename, "a" );
-    if ( !logfile ) return -1;
-    fprintf( logfile, "%s\n", file_string );
-    fclose( logfile );
-    return 0;
+    len = strftime( file_string, 30, "%F %T ", t_struct );
+    len += snprintf( file_string+len, sizeof(file_string)-len-1, "%s", message );
+    if ( len > (int)sizeof(file_string)-2 ) len = sizeof(file_string)-2;
+    file_string[len++] = '\n';
+    return WriteWholeFile( filename, O_APPEND, file_string, len );
 }
 
 /* this version of the logging function destroys the opened file contents */
 void
 log_msg_ovr(char *filename, char *message) {
-    FILE *logfile;
-    char file_string[300];
-    char timestamp[30];
+    char file_string[2600];
     time_t t;
     struct tm *t_struct;
+    int len;
 
     t = time(NULL);
     t_struct = localtime( &t );
-    strftime( timestamp, sizeof timestamp, "%F %T", t_struct );
-    sprintf( file_string, "%s%s", timestamp, message );
-    logfile = fopen( filename, "w" );
-    if ( !logfile ) return;
-    fprintf( logfile, "%s\n", file_string );
-    fclose( logfile );
+    len = strftime( file_string, 30, "%F %T", t_struct );
+    len += snprintf( file_string+len, sizeof(file_string)-len-1, "%s", message );
+    if ( len > (int)sizeof(file_string)-2 ) len = sizeof(file_string)-2;
+    file_string[len++] = '\n';
+    WriteWholeFile( filename, O_TRUNC, file_string, len );
 }
 
 /* this version of the logging function destroys the opened file contents, no timestamp and new line */
 void
 log_msg_cln(char *filename, char *message) {
-    FILE *logfile;
-    char file_string[300];
+    WriteWholeFile( filename, O_TRUNC, message, strlen( message ) );
+}
 
-    sprintf( file_string, "%s", message );
-    logfile = fopen( filename, "w" );
-    if ( !logfile ) return;
-    fprintf( logfile, "%s", file_string );
-    fclose( logfile );
+/* Live stream: with cfg.sse_port (on 127.0.0.1) or cfg.sse_socket set, a thread of its own serves
+Server-Sent Events over HTTP at /events - every cycle's data ("state"), relay switches ("relay")
+and event log events ("event") - to up to SSE_MAX_CLIENTS clients. The control path only puts each
+message in a history ring and wakes the thread. A new client gets the history first, or what it
+missed if it sends Last-Event-ID; a client too slow for the ring skips to its oldest message.
+The listening sockets are set up at start only. */
+#define SSE_HISTORY         256
+#define SSE_MSG_MAX         1280
+#define SSE_MAX_CLIENTS     64
+#define SSE_REQUEST_MAX     1024
+
+struct sse_msg_struct {
+    unsigned long   id;
+    short           len;
+    char            data[SSE_MSG_MAX];
+};
+
+struct sse_client_struct {
+    int             fd;             /* -1: free */
+    short           streaming;      /* request answered, sending messages */
+    short           req_len;
+    char            req[SSE_REQUEST_MAX];
+    unsigned long   next;           /* id of message to send after pending */
+    short           pending_len;
+    short           sent;
+    char            pending[SSE_MSG_MAX];
+};
+
+struct sse_msg_struct sse_msgs[SSE_HISTORY];
+struct sse_client_struct sse_clients[SSE_MAX_CLIENTS];
+unsigned long sse_next_id = 1;
+pthread_mutex_t sse_lock;
+pthread_t sse_thread;
+short sse_running = 0;
+int sse_wake_fd = -1;
+int sse_listen_fd[2] = { -1, -1 };
+
+/* Put a message in the history ring; data may be several lines. Data too long for a message is cut
+at the end. Not from a signal handler (SIGTERM logs events on the way out) - it takes sse_lock. */
+void
+SsePublish( const char *event, const char *data ) {
+    struct sse_msg_struct *m;
+    const char *line, *eol;
+    uint64_t one = 1;
+    int n;
+
+    if ( !sse_running || in_signal_handler ) return;
+    pthread_mutex_lock( &sse_lock );
+    m = &sse_msgs[sse_next_id % SSE_HISTORY];
+    n = snprintf( m->data, SSE_MSG_MAX, "id: %lu\nevent: %s\n", sse_next_id, event );
+    for (line = data; *line && (n < SSE_MSG_MAX); line = *eol ? eol+1 : eol) {
+        eol = strchr( line, '\n' );
+        if ( !eol ) eol = line + strlen( line );
+        n += snprintf( m->data+n, SSE_MSG_MAX-n, "data: %.*s\n", (int)(eol-line), line );
+    }
+    if ( n > SSE_MSG_MAX-2 ) {
+        /* cut short - end the last line where it was cut */
+        n = SSE_MSG_MAX-2;
+        m->data[n-1] = '\n';
+    }
+    m->data[n++] = '\n';
+    m->len = n;
+    m->id = sse_next_id++;
+    pthread_mutex_unlock( &sse_lock );
+    write( sse_wake_fd, &one, sizeof one );
+}
+
+void
+SseClose( struct sse_client_struct *c ) {
+    close( c->fd );
+    c->fd = -1;
+}
+
+/* Send c what is there for it; returns 0 if it was closed */
+short
+SseSend( struct sse_client_struct *c ) {
+    struct sse_msg_struct *m;
+    unsigned long oldest;
+    ssize_t n;
+
+    while (1) {
+        if ( c->sent == c->pending_len ) {
+            pthread_mutex_lock( &sse_lock );
+            oldest = ( sse_next_id > SSE_HISTORY ) ? sse_next_id - SSE_HISTORY : 1;
+            if ( c->next < oldest ) c->next = oldest;
+            c->pending_len = c->sent = 0;
+            if ( c->next < sse_next_id ) {
+                m = &sse_msgs[c->next % SSE_HISTORY];
+                memcpy( c->pending, m->data, m->len );
+                c->pending_len = m->len;
+                c->next++;
+            }
+            pthread_mutex_unlock( &sse_lock );
+            if ( !c->pending_len ) return 1;
+        }
+        n = send( c->fd, c->pending + c->sent, c->pending_len - c->sent, MSG_NOSIGNAL|MSG_DONTWAIT );
+        if ( n < 0 ) {
+            if ( (errno == EAGAIN) || (errno == EWOULDBLOCK) ) return 1;
+            SseClose( c );
+            return 0;
+        }
+        c->sent += n;
+    }
+}
+
+/* Read from a client which has not got its answer yet, and answer once the request is all in */
+void
+SseRequest( struct sse_client_struct *c ) {
+    static const char ok[] = "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\n"\
+    "Connection: keep-alive\r\nAccess-Control-Allow-Origin: *\r\n\r\n";
+    static const char accepted[] = "HTTP/1.1 202 Accepted\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    static const char not_found[] = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    ssize_t n;
+    char *h;
+
+    n = recv( c->fd, c->req + c->req_len, SSE_REQUEST_MAX-1 - c->req_len, MSG_DONTWAIT );
+    if ( n <= 0 ) {
+        if ( (n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ) return;
+        SseClose( c );
+        return;
+    }
+    c->req_len += n;
+    c->req[c->req_len] = 0;
+    if ( !strstr( c->req, "\r\n\r\n" ) ) {
+        if ( c->req_len >= SSE_REQUEST_MAX-1 ) SseClose( c );
+        return;
+    }
+    if ( strncmp( c->req, "POST /flight-dump ", 18 ) == 0 ) {
+        flight_dump_requested = 1;
+        send( c->fd, accepted, sizeof(accepted)-1, MSG_NOSIGNAL|MSG_DONTWAIT );
+        SseClose( c );
+        return;
+    }
+    if ( strncmp( c->req, "GET /events", 11 ) || !strchr( " ?", c->req[11] ) ) {
+        send( c->fd, not_found, sizeof(not_found)-1, MSG_NOSIGNAL|MSG_DONTWAIT );
+        SseClose( c );
+        return;
+    }
+    c->next = 0;
+    h = strcasestr( c->req, "\r\nLast-Event-ID:" );
+    if ( h ) c->next = strtoul( h + 16, NULL, 10 ) + 1;
+    c->streaming = 1;
+    c->pending_len = c->sent = 0;
+    if ( send( c->fd, ok, sizeof(ok)-1, MSG_NOSIGNAL|MSG_DONTWAIT ) != sizeof(ok)-1 ) SseClose( c );
+}
+
+void *
+SseServer( void *arg ) {
+    static struct pollfd pfd[3+SSE_MAX_CLIENTS];
+    struct sse_client_struct *c;
+    short i, n, ci[3+SSE_MAX_CLIENTS];
+    uint64_t count;
+    int fd;
+
+    (void)arg;
+    for (i=0;i<SSE_MAX_CLIENTS;i++) sse_clients[i].fd = -1;
+    while (1) {
+        pfd[0].fd = sse_wake_fd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = sse_listen_fd[0];
+        pfd[1].events = POLLIN;
+        pfd[2].fd = sse_listen_fd[1];
+        pfd[2].events = POLLIN;
+        n = 3;
+        for (i=0;i<SSE_MAX_CLIENTS;i++) {
+            c = &sse_clients[i];
+            if ( c->fd == -1 ) continue;
+            pfd[n].fd = c->fd;
+            pfd[n].events = POLLIN | ((c->streaming && (c->sent < c->pending_len)) ? POLLOUT : 0);
+            ci[n++] = i;
+        }
+        if ( poll( pfd, n, -1 ) < 0 ) continue;
+        if ( pfd[0].revents & POLLIN ) read( sse_wake_fd, &count, sizeof count );
+        for (i=1;i<=2;i++) {
+            if ( !(pfd[i].revents & POLLIN) ) continue;
+            fd = accept4( pfd[i].fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC );
+            if ( fd == -1 ) continue;
+            for (c=NULL, count=0; count<SSE_MAX_CLIENTS; count++) {
+                if ( sse_clients[count].fd == -1 ) { c = &sse_clients[count]; break; }
+            }
+            if ( !c ) { close( fd ); continue; }
+            c->fd = fd;
+            c->streaming = 0;
+            c->req_len = 0;
+        }
+        for (i=3;i<n;i++) {
+            c = &sse_clients[ci[i]];
+            if ( c->fd != pfd[i].fd ) continue;
+            if ( pfd[i].revents & (POLLERR|POLLNVAL) ) { SseClose( c ); continue; }
+            if ( !c->streaming ) {
+                if ( pfd[i].revents & (POLLIN|POLLHUP) ) SseRequest( c );
+                continue;
+            }
+            if ( pfd[i].revents & (POLLIN|POLLHUP) ) {
+                /* clients have nothing to say once streaming - only see if they are gone */
+                if ( recv( c->fd, c->req, SSE_REQUEST_MAX, MSG_DONTWAIT ) == 0 ) { SseClose( c ); continue; }
+            }
+        }
+        for (i=0;i<SSE_MAX_CLIENTS;i++) {
+            c = &sse_clients[i];
+            if ( (c->fd != -1) && c->streaming ) SseSend( c );
+        }
+    }
+    return NULL;
+}
+
+/* Open the listening sockets and start the thread serving them */
+void
+StartSse() {
+    struct sockaddr_in in;
+    struct sockaddr_un un;
+    pthread_mutexattr_t mattr;
+    char msg[150];
+    int fd, on = 1;
+
+    if ( !cfg.sse_port && !cfg.sse_socket[0] ) return;
+    if ( cfg.sse_port ) {
+        memset( &in, 0, sizeof in );
+        in.sin_family = AF_INET;
+        in.sin_port = htons( cfg.sse_port );
+        in.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+        fd = socket( AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0 );
+        if ( fd != -1 ) setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on );
+        if ( (fd == -1) || bind( fd, (struct sockaddr *)&in, sizeof in ) || listen( fd, 16 ) ) {
+            sprintf( msg, "WARNING: Can not listen on 127.0.0.1:%d (errno %d) - no live stream there.", cfg.sse_port, errno );
+            log_message(LOG_FILE, msg);
+            if ( fd != -1 ) close( fd );
+        }
+        else sse_listen_fd[0] = fd;
+    }
+    if ( cfg.sse_socket[0] ) {
+        memset( &un, 0, sizeof un );
+        un.sun_family = AF_UNIX;
+        snprintf( un.sun_path, sizeof un.sun_path, "%s", cfg.sse_socket );
+        unlink( un.sun_path );
+        fd = socket( AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0 );
+        if ( (fd == -1) || bind( fd, (struct sockaddr *)&un, sizeof un ) || listen( fd, 16 ) ) {
+            sprintf( msg, "WARNING: Can not listen on %.60s (errno %d) - no live stream there.", cfg.sse_socket, errno );
+            log_message(LOG_FILE, msg);
+            if ( fd != -1 ) close( fd );
+        }
+        else {
+            /* for a web server proxy running as another user */
+            chmod( un.sun_path, 0666 );
+            sse_listen_fd[1] = fd;
+        }
+    }
+    if ( (sse_listen_fd[0] == -1) && (sse_listen_fd[1] == -1) ) return;
+    sse_wake_fd = eventfd( 0, EFD_NONBLOCK|EFD_CLOEXEC );
+    if ( sse_wake_fd == -1 ) return;
+    pthread_mutexattr_init( &mattr );
+    pthread_mutexattr_setprotocol( &mattr, PTHREAD_PRIO_INHERIT );
+    pthread_mutex_init( &sse_lock, &mattr );
+    pthread_mutexattr_destroy( &mattr );
+    sse_running = 1;
+    if ( StartThread( &sse_thread, SseServer, NULL ) ) {
+        sse_running = 0;
+        log_message(LOG_FILE, "WARNING: Can not start the live stream thread.");
+        return;
+    }
+    log_message(LOG_FILE, "INFO: Serving the live stream at /events.");
+}
+
+/* Event log: notable events also go to EVENTS_FILE as typed records, with a per day index in
+EVENTS_INDEX, for solard-events to query - see solard_events.h */
+int events_fd = -1;
+int events_index_fd = -1;
+uint32_t events_total = 0;
+struct event_day events_day;
+long events_day_slot = -1;
+
+/* Write EVENTS_INDEX anew from EVENTS_FILE, leaving the last day's entry in events_day */
+void
+RebuildEventsIndex() {
+    static struct event_record r[64];
+    ssize_t n;
+    off_t at = 0;
+    short i;
+
+    events_day_slot = -1;
+    events_total = 0;
+    ftruncate( events_index_fd, 0 );
+    while ( (n = pread( events_fd, r, sizeof r, at )) >= (ssize_t)sizeof r[0] ) {
+        at += n - n % sizeof r[0];
+        for (i=0; i<n/(ssize_t)sizeof r[0]; i++) {
+            if ( (events_day_slot < 0) || (r[i].time / 86400 > events_day.day) ) {
+                if ( events_day_slot >= 0 ) pwrite( events_index_fd, &events_day, sizeof events_day,
+                    events_day_slot * sizeof events_day );
+                memset( &events_day, 0, sizeof events_day );
+                events_day.day = r[i].time / 86400;
+                events_day.first = events_total;
+                events_day_slot++;
+            }
+            if ( r[i].severity < EV_SEVERITIES ) events_day.count[r[i].severity]++;
+            events_total++;
+        }
+    }
+    if ( events_day_slot >= 0 ) pwrite( events_index_fd, &events_day, sizeof events_day,
+        events_day_slot * sizeof events_day );
+}
+
+/* Open the event log files; a torn last record is dropped and an index which does not add up
+to the records there are is rebuilt */
+void
+OpenEvents() {
+    struct stat st;
+    short i;
+    uint32_t indexed;
+
+    events_fd = open( EVENTS_FILE, O_RDWR|O_APPEND|O_CREAT|O_CLOEXEC, 0644 );
+    events_index_fd = open( EVENTS_INDEX, O_RDWR|O_CREAT|O_CLOEXEC, 0644 );
+    if ( (events_fd == -1) || (events_index_fd == -1) || fstat( events_fd, &st ) ) {
+        log_message(LOG_FILE, "WARNING: Failed to open "EVENTS_FILE" or its index! Events will not be recorded.");
+        if ( events_fd != -1 ) close( events_fd );
+        if ( events_index_fd != -1 ) close( events_index_fd );
+        events_fd = events_index_fd = -1;
+        return;
+    }
+    if ( st.st_size % sizeof(struct event_record) ) ftruncate( events_fd, st.st_size - st.st_size % sizeof(struct event_record) );
+    events_total = st.st_size / sizeof(struct event_record);
+    indexed = 0;
+    events_day_slot = -1;
+    if ( !fstat( events_index_fd, &st ) && (st.st_size >= (off_t)sizeof events_day) &&
+         !(st.st_size % sizeof events_day) ) {
+        events_day_slot = st.st_size / sizeof events_day - 1;
+        if ( pread( events_index_fd, &events_day, sizeof events_day, events_day_slot * sizeof events_day ) ==
+             sizeof events_day ) {
+            indexed = events_day.first;
+            for (i=0;i<EV_SEVERITIES;i++) indexed += events_day.count[i];
+        }
+        else indexed = events_total + 1;
+    }
+    if ( indexed != events_total ) {
+        RebuildEventsIndex();
+        log_message(LOG_FILE, "INFO: Rebuilt the index of "EVENTS_FILE".");
+    }
+}
+
+/* Record an event; see solard_events.h for what id and the values mean with each code */
+void
+LogEvent( short severity, short code, short id, float v0, float v1, float v2 ) {
+    struct event_record r;
+    char buf[200];
+
+    if ( events_fd == -1 ) return;
+    memset( &r, 0, sizeof r );
+    r.time = time(NULL);
+    r.code = code;
+    r.severity = severity;
+    r.id = id;
+    r.values[0] = v0;
+    r.values[1] = v1;
+    r.values[2] = v2;
+    if ( write( events_fd, &r, sizeof r ) != sizeof r ) return;
+    /* the signal handler may have stopped the main loop half way through updating the day's
+    counts - leave the index to the next start, which rebuilds it as it is behind the file */
+    if ( in_signal_handler ) return;
+    if ( (events_day_slot < 0) || (r.time / 86400 > events_day.day) ) {
+        memset( &events_day, 0, sizeof events_day );
+        events_day.day = r.time / 86400;
+        events_day.first = events_total;
+        events_day_slot++;
+    }
+    events_day.count[severity]++;
+    events_total++;
+    pwrite( events_index_fd, &events_day, sizeof events_day, events_day_slot * sizeof events_day );
+    if ( sse_running ) {
+        snprintf( buf, sizeof buf, "{\"time\":%lld,\"severity\":\"%s\",\"event\":\"%s\",\"id\":%d,"\
+        "\"values\":[%.3f,%.3f,%.3f]}", (long long)r.time, event_severity_names[severity], event_names[code], id,
+        v0, v1, v2 );
+        SsePublish( "event", buf );
+    }
+}
+
+/* Repeated warnings: the first of a class for a sensor or pin goes to LOG_FILE, the ones following
+it within cfg.log_repeat_window seconds are only counted - with the range of values they were
+about - and summed up in one line when the window is over. ALARM lines are never held back. */
+#define LOGC_SENSOR_BAD         0
+#define LOGC_SENSOR_LOW         1
+#define LOGC_SENSOR_HIGH        2
+#define LOGC_SENSOR_FAILED      3
+#define LOGC_SENSOR_SLOW        4
+#define LOGC_GPIO               5
+
+#define LOG_LIMIT_SLOTS         32
+
+struct log_class_struct {
+    const char      *subject;
+    const char      *what;
+    const char      *value_fmt;     /* NULL if the values mean nothing */
+};
+
+const struct log_class_struct log_classes[] = {
+    { "Sensor", "readings counted as BAD", "%.3f" },
+    { "Sensor", "LOW corrections", "%.3f" },
+    { "Sensor", "HIGH corrections", "%.3f" },
+    { "Sensor", "read failures", NULL },
+    { "Sensor", "slow reads", "%.0f ms" },
+    { "GPIO pin", "errors", NULL }
+};
+
+struct log_limit_struct {
+    short           used;
+    short           cls;
+    short           id;
+    unsigned long   since;          /* ProgramRunCycles of the logged line */
+    unsigned long   count;          /* held back since */
+    float           min;
+    float           max;
+};
+
+struct log_limit_struct log_limits[LOG_LIMIT_SLOTS];
+
+unsigned long log_lines_held = 0;
+
+/* Log message, unless one of class cls for id was logged less than cfg.log_repeat_window s ago */
+void
+log_limited( short cls, short id, float value, char *message ) {
+    struct log_limit_struct *l, *free_slot = NULL;
+    short i;
+
+    if ( !cfg.log_repeat_window || (strncmp( message, "ALARM", 5 ) == 0) ) {
+        log_message(LOG_FILE, message);
+        return;
+    }
+    for (i=0;i<LOG_LIMIT_SLOTS;i++) {
+        l = &log_limits[i];
+        if ( !l->used ) { if ( !free_slot ) free_slot = l; continue; }
+        if ( (l->cls != cls) || (l->id != id) ) continue;
+        if ( l->count == 0 ) { l->min = value; l->max = value; }
+        if ( value < l->min ) l->min = value;
+        if ( value > l->max ) l->max = value;
+        l->count++;
+        log_lines_held++;
+        return;
+    }
+    /* first of its kind - or no room to keep track of it */
+    log_message(LOG_FILE, message);
+    if ( !free_slot ) return;
+    free_slot->used = 1;
+    free_slot->cls = cls;
+    free_slot->id = id;
+    free_slot->since = ProgramRunCycles;
+    free_slot->count = 0;
+}
+
+/* Sum up the held back lines of windows which are over; called once a cycle */
+void
+LogSummaries() {
+    struct log_limit_struct *l;
+    const struct log_class_struct *c;
+    char msg[200], lo[20], hi[20];
+    unsigned long window = cfg.log_repeat_window / 10;
+    short i, n;
+
+    for (i=0;i<LOG_LIMIT_SLOTS;i++) {
+        l = &log_limits[i];
+        if ( !l->used || ((ProgramRunCycles - l->since) < window) ) continue;
+        l->used = 0;
+        if ( !l->count ) continue;
+        c = &log_classes[l->cls];
+        n = snprintf( msg, sizeof msg, "WARNING: %s %d: %lu more %s in last %lu min", c->subject, l->id, l->count,
+        c->what, ((ProgramRunCycles - l->since) * 10 + 30) / 60 );
+        if ( c->value_fmt ) {
+            snprintf( lo, sizeof lo, c->value_fmt, l->min );
+            snprintf( hi, sizeof hi, c->value_fmt, l->max );
+            n += snprintf( msg+n, sizeof msg - n, ", seen %s to %s", lo, hi );
+        }
+        if ( n < (short)sizeof msg - 1 ) strcpy( msg+n, "." );
+        log_message(LOG_FILE, msg);
+    }
 }
 
 /* trim: get rid of trailing and leading whitespace...
@@ -357,15 +1622,36 @@ trim (char * s)
     return s;
 }
 
+/* schedule keys can be given on several lines - add value to what the lines before gave */
+void
+append_schedule_value (char *s, const char *value)
+{
+    size_t l = strlen (s);
+
+    if (l && (l < SCHED_CFG_MAX - 2)) {
+        strcpy (s + l, "; ");
+        l += 2;
+    }
+    strncpy (s + l, value, SCHED_CFG_MAX - 1 - l);
+    s[SCHED_CFG_MAX - 1] = 0;
+}
+
 void
 parse_config()
 {
     int i = 0;
-    char *s, buff[150];
+    char *s, buff[200];
+    char sched_err[120];
     FILE *fp = fopen(CONFIG_FILE, "r");
     if (fp == NULL) {
         log_message(LOG_FILE,"WARNING: Failed to open "CONFIG_FILE" file for reading!");
         } else {
+        /* schedule values add up over the lines they are on - start them anew */
+        cfg.night_tariff_str[0] = 0;
+        cfg.holidays_str[0] = 0;
+        cfg.away_str[0] = 0;
+        cfg.pump_exercise_str[0] = 0;
+
         /* Read next line */
         while ((s = fgets (buff, sizeof buff, fp)) != NULL)
         {
@@ -424,6 +1710,108 @@ parse_config()
             strncpy (cfg.night_boost_str, value, MAXLEN);
             else if (strcmp(name, "abs_max")==0)
             strncpy (cfg.abs_max_str, value, MAXLEN);
+            else if (strcmp(name, "pump1_min_on")==0)
+            strncpy (cfg.pump1_min_on_str, value, MAXLEN);
+            else if (strcmp(name, "pump1_min_off")==0)
+            strncpy (cfg.pump1_min_off_str, value, MAXLEN);
+            else if (strcmp(name, "pump1_max_toggles")==0)
+            strncpy (cfg.pump1_max_toggles_str, value, MAXLEN);
+            else if (strcmp(name, "pump2_min_on")==0)
+            strncpy (cfg.pump2_min_on_str, value, MAXLEN);
+            else if (strcmp(name, "pump2_min_off")==0)
+            strncpy (cfg.pump2_min_off_str, value, MAXLEN);
+            else if (strcmp(name, "pump2_max_toggles")==0)
+            strncpy (cfg.pump2_max_toggles_str, value, MAXLEN);
+            else if (strcmp(name, "valve_min_on")==0)
+            strncpy (cfg.valve_min_on_str, value, MAXLEN);
+            else if (strcmp(name, "valve_min_off")==0)
+            strncpy (cfg.valve_min_off_str, value, MAXLEN);
+            else if (strcmp(name, "valve_max_toggles")==0)
+            strncpy (cfg.valve_max_toggles_str, value, MAXLEN);
+            else if (strcmp(name, "heater_min_on")==0)
+            strncpy (cfg.heater_min_on_str, value, MAXLEN);
+            else if (strcmp(name, "heater_min_off")==0)
+            strncpy (cfg.heater_min_off_str, value, MAXLEN);
+            else if (strcmp(name, "heater_max_toggles")==0)
+            strncpy (cfg.heater_max_toggles_str, value, MAXLEN);
+            else if (strcmp(name, "heat_pump_pin")==0)
+            strncpy (cfg.heat_pump_pin_str, value, MAXLEN);
+            else if (strcmp(name, "heat_pump_min_on")==0)
+            strncpy (cfg.heat_pump_min_on_str, value, MAXLEN);
+            else if (strcmp(name, "heat_pump_min_off")==0)
+            strncpy (cfg.heat_pump_min_off_str, value, MAXLEN);
+            else if (strcmp(name, "heat_pump_max_toggles")==0)
+            strncpy (cfg.heat_pump_max_toggles_str, value, MAXLEN);
+            else if (strcmp(name, "heat_pump_watts")==0)
+            strncpy (cfg.heat_pump_watts_str, value, MAXLEN);
+            else if (strcmp(name, "heat_pump_efficiency")==0)
+            strncpy (cfg.heat_pump_efficiency_str, value, MAXLEN);
+            else if (strcmp(name, "relay_stagger_ms")==0)
+            strncpy (cfg.relay_stagger_ms_str, value, MAXLEN);
+            else if (strcmp(name, "night_tariff_summer")==0)
+            strncpy (cfg.night_tariff_summer_str, value, MAXLEN);
+            else if (strcmp(name, "night_tariff_winter")==0)
+            strncpy (cfg.night_tariff_winter_str, value, MAXLEN);
+            else if (strcmp(name, "summer_months")==0)
+            strncpy (cfg.summer_months_str, value, MAXLEN);
+            else if (strcmp(name, "night_tariff")==0)
+            append_schedule_value (cfg.night_tariff_str, value);
+            else if (strcmp(name, "holidays")==0)
+            append_schedule_value (cfg.holidays_str, value);
+            else if (strcmp(name, "away")==0)
+            append_schedule_value (cfg.away_str, value);
+            else if (strcmp(name, "pump_exercise")==0)
+            append_schedule_value (cfg.pump_exercise_str, value);
+            else if (strcmp(name, "day_price")==0)
+            strncpy (cfg.day_price_str, value, MAXLEN);
+            else if (strcmp(name, "night_price")==0)
+            strncpy (cfg.night_price_str, value, MAXLEN);
+            else if (strcmp(name, "tank_liters")==0)
+            strncpy (cfg.tank_liters_str, value, MAXLEN);
+            else if (strcmp(name, "state_sync_cycles")==0)
+            strncpy (cfg.state_sync_cycles_str, value, MAXLEN);
+            else if (strcmp(name, "state_max_age")==0)
+            strncpy (cfg.state_max_age_str, value, MAXLEN);
+            else if (strcmp(name, "tkotel_resolution")==0)
+            strncpy (cfg.tkotel_resolution_str, value, MAXLEN);
+            else if (strcmp(name, "tkolektor_resolution")==0)
+            strncpy (cfg.tkolektor_resolution_str, value, MAXLEN);
+            else if (strcmp(name, "tboilerh_resolution")==0)
+            strncpy (cfg.tboilerh_resolution_str, value, MAXLEN);
+            else if (strcmp(name, "tboilerl_resolution")==0)
+            strncpy (cfg.tboilerl_resolution_str, value, MAXLEN);
+            else if (strcmp(name, "sensor_max_interval")==0)
+            strncpy (cfg.sensor_max_interval_str, value, MAXLEN);
+            else if (strcmp(name, "influx_output")==0)
+            strncpy (cfg.influx_output_str, value, MAXLEN);
+            else if (strcmp(name, "collectd_output")==0)
+            strncpy (cfg.collectd_output_str, value, MAXLEN);
+            else if (strcmp(name, "realtime_priority")==0)
+            strncpy (cfg.realtime_priority_str, value, MAXLEN);
+            else if (strcmp(name, "cpu_core")==0)
+            strncpy (cfg.cpu_core_str, value, MAXLEN);
+            else if (strcmp(name, "safe_relay_state")==0)
+            strncpy (cfg.safe_relay_state_str, value, MAXLEN);
+            else if (strcmp(name, "log_repeat_window")==0)
+            strncpy (cfg.log_repeat_window_str, value, MAXLEN);
+            else if (strcmp(name, "data_archive")==0)
+            strncpy (cfg.data_archive_str, value, MAXLEN);
+            else if (strcmp(name, "data_roll_kb")==0)
+            strncpy (cfg.data_roll_kb_str, value, MAXLEN);
+            else if (strcmp(name, "data_roll_minutes")==0)
+            strncpy (cfg.data_roll_minutes_str, value, MAXLEN);
+            else if (strcmp(name, "sse_port")==0)
+            strncpy (cfg.sse_port_str, value, MAXLEN);
+            else if (strcmp(name, "sse_socket")==0)
+            strncpy (cfg.sse_socket, value, MAXLEN);
+            else if (strcmp(name, "flight_cycles")==0)
+            strncpy (cfg.flight_cycles_str, value, MAXLEN);
+            else if (strcmp(name, "anomaly_minutes")==0)
+            strncpy (cfg.anomaly_minutes_str, value, MAXLEN);
+            else if (strcmp(name, "anomaly_warn")==0)
+            strncpy (cfg.anomaly_warn_str, value, MAXLEN);
+            else if (strcmp(name, "anomaly_alarm")==0)
+            strncpy (cfg.anomaly_alarm_str, value, MAXLEN);
         }
         /* Close file */
         fclose (fp);
@@ -450,11 +1838,16 @@ parse_config()
     i = atoi( buff );
     cfg.el_heater_pin = i;
     rangecheck_GPIO_pin( cfg.el_heater_pin );
+    /* 0 - there is no heat pump; the pin is exported on start only, like the others */
+    cfg.heat_pump_pin = atoi( cfg.heat_pump_pin_str );
+    if ((cfg.heat_pump_pin < 0) || (cfg.heat_pump_pin > 27)) cfg.heat_pump_pin = 0;
+    if ((cfg.heat_pump_pin > 0) && (cfg.heat_pump_pin < 4)) cfg.heat_pump_pin = 4;
 	if (not_every_GPIO_pin_is_UNIQUE()) {
        log_message(LOG_FILE,"ALERT: Check config - found configured GPIO pin assigned more than once!");
        log_message(LOG_FILE,"ALERT: The above is an error. Switching to using default GPIO pins config...");
        SetDefaultPINs();
 	}
+    cfg.use_heat_pump = (cfg.heat_pump_pin != 0);
     strcpy( buff, cfg.invert_output_str );
     i = atoi( buff );
     cfg.invert_output = i;
@@ -500,21 +1893,118 @@ parse_config()
     i = atoi( buff );
     cfg.abs_max = i;
     rangecheck_abs_max_temp( cfg.abs_max );
-
-    /* Prepare log messages with sensor paths and write them to log file */
-    sprintf( buff, "Furnace temp sensor file: %s", cfg.tkotel_sensor );
+    cfg.pump1_min_on = rangecheck_relay_time( atoi( cfg.pump1_min_on_str ) );
+    cfg.pump1_min_off = rangecheck_relay_time( atoi( cfg.pump1_min_off_str ) );
+    cfg.pump1_max_toggles = rangecheck_relay_toggles( atoi( cfg.pump1_max_toggles_str ) );
+    cfg.pump2_min_on = rangecheck_relay_time( atoi( cfg.pump2_min_on_str ) );
+    cfg.pump2_min_off = rangecheck_relay_time( atoi( cfg.pump2_min_off_str ) );
+    cfg.pump2_max_toggles = rangecheck_relay_toggles( atoi( cfg.pump2_max_toggles_str ) );
+    cfg.valve_min_on = rangecheck_relay_time( atoi( cfg.valve_min_on_str ) );
+    cfg.valve_min_off = rangecheck_relay_time( atoi( cfg.valve_min_off_str ) );
+    cfg.valve_max_toggles = rangecheck_relay_toggles( atoi( cfg.valve_max_toggles_str ) );
+    cfg.heater_min_on = rangecheck_relay_time( atoi( cfg.heater_min_on_str ) );
+    cfg.heater_min_off = rangecheck_relay_time( atoi( cfg.heater_min_off_str ) );
+    cfg.heater_max_toggles = rangecheck_relay_toggles( atoi( cfg.heater_max_toggles_str ) );
+    cfg.heat_pump_min_on = rangecheck_relay_time( atoi( cfg.heat_pump_min_on_str ) );
+    cfg.heat_pump_min_off = rangecheck_relay_time( atoi( cfg.heat_pump_min_off_str ) );
+    cfg.heat_pump_max_toggles = rangecheck_relay_toggles( atoi( cfg.heat_pump_max_toggles_str ) );
+    cfg.heat_pump_watts = atoi( cfg.heat_pump_watts_str );
+    if (cfg.heat_pump_watts < 100) cfg.heat_pump_watts = 100;
+    if (cfg.heat_pump_watts > 10000) cfg.heat_pump_watts = 10000;
+    heat_pump_ppc = (unsigned long)cfg.heat_pump_watts * 1000 / (6*60);
+    cfg.heat_pump_efficiency = atoi( cfg.heat_pump_efficiency_str );
+    if ((cfg.heat_pump_efficiency < 10) || (cfg.heat_pump_efficiency > 80)) cfg.heat_pump_efficiency = 45;
+    cfg.relay_stagger_ms = atoi( cfg.relay_stagger_ms_str );
+    if (cfg.relay_stagger_ms < 0) cfg.relay_stagger_ms = 0;
+    if (cfg.relay_stagger_ms > 2000) cfg.relay_stagger_ms = 2000;
+    parse_range( cfg.night_tariff_summer_str, &cfg.nt_summer_start, &cfg.nt_summer_stop, 0, 23, 23, 6 );
+    parse_range( cfg.night_tariff_winter_str, &cfg.nt_winter_start, &cfg.nt_winter_stop, 0, 23, 22, 5 );
+    parse_range( cfg.summer_months_str, &cfg.summer_first_month, &cfg.summer_last_month, 1, 12, 4, 10 );
+    sched_cfg.nt_summer_start = cfg.nt_summer_start;
+    sched_cfg.nt_summer_stop = cfg.nt_summer_stop;
+    sched_cfg.nt_winter_start = cfg.nt_winter_start;
+    sched_cfg.nt_winter_stop = cfg.nt_winter_stop;
+    sched_cfg.summer_first_month = cfg.summer_first_month;
+    sched_cfg.summer_last_month = cfg.summer_last_month;
+    if ( CompileScheduleCfg( &sched_cfg, cfg.night_tariff_str, cfg.holidays_str, cfg.away_str,
+                             cfg.pump_exercise_str, sched_err ) ) {
+        sprintf( buff, "WARNING: Schedule config error, %.80s - the value is left out!", sched_err );
+        log_message(LOG_FILE, buff);
+    }
+    /* the next cycle builds the schedule anew */
+    schedule.minutes = 0;
+    cfg.day_price = atof( cfg.day_price_str );
+    if (cfg.day_price < 0) cfg.day_price = 0;
+    cfg.night_price = atof( cfg.night_price_str );
+    if (cfg.night_price < 0) cfg.night_price = 0;
+    cfg.tank_liters = atoi( cfg.tank_liters_str );
+    if ((cfg.tank_liters < 0) || (cfg.tank_liters > 2000)) cfg.tank_liters = 0;
+    cfg.state_sync_cycles = atoi( cfg.state_sync_cycles_str );
+    if (cfg.state_sync_cycles < 1) cfg.state_sync_cycles = 1;
+    if (cfg.state_sync_cycles > 360) cfg.state_sync_cycles = 360;
+    cfg.state_max_age = atoi( cfg.state_max_age_str );
+    if (cfg.state_max_age < 0) cfg.state_max_age = 0;
+    if (cfg.state_max_age > 86400) cfg.state_max_age = 86400;
+    cfg.tkotel_resolution = rangecheck_sensor_resolution( atoi( cfg.tkotel_resolution_str ) );
+    cfg.tkolektor_resolution = rangecheck_sensor_resolution( atoi( cfg.tkolektor_resolution_str ) );
+    cfg.tboilerh_resolution = rangecheck_sensor_resolution( atoi( cfg.tboilerh_resolution_str ) );
+    cfg.tboilerl_resolution = rangecheck_sensor_resolution( atoi( cfg.tboilerl_resolution_str ) );
+    cfg.sensor_max_interval = atoi( cfg.sensor_max_interval_str );
+    if (cfg.sensor_max_interval < 1) cfg.sensor_max_interval = 1;
+    if (cfg.sensor_max_interval > 30) cfg.sensor_max_interval = 30;
+    cfg.influx_output = atoi( cfg.influx_output_str );
+    /* ^ no need for range check - 0 is OFF, non-zero is ON */
+    cfg.collectd_output = atoi( cfg.collectd_output_str );
+    /* ^ no need for range check - 0 is OFF, non-zero is ON */
+    cfg.realtime_priority = atoi( cfg.realtime_priority_str );
+    if (cfg.realtime_priority < 0) cfg.realtime_priority = 0;
+    if (cfg.realtime_priority > 99) cfg.realtime_priority = 99;
+    cfg.cpu_core = atoi( cfg.cpu_core_str );
+    if (cfg.cpu_core < -1) cfg.cpu_core = -1;
+    if (cfg.cpu_core >= CPU_SETSIZE) cfg.cpu_core = -1;
+    cfg.safe_relay_state = atoi( cfg.safe_relay_state_str ) & 31;
+    cfg.log_repeat_window = atoi( cfg.log_repeat_window_str );
+    if (cfg.log_repeat_window < 0) cfg.log_repeat_window = 0;
+    if (cfg.log_repeat_window > 86400) cfg.log_repeat_window = 86400;
+    cfg.data_archive = atoi( cfg.data_archive_str );
+    /* ^ no need for range check - 0 is OFF, non-zero is ON */
+    cfg.data_roll_kb = atoi( cfg.data_roll_kb_str );
+    if (cfg.data_roll_kb < 16) cfg.data_roll_kb = 16;
+    if (cfg.data_roll_kb > 65536) cfg.data_roll_kb = 65536;
+    cfg.data_roll_minutes = atoi( cfg.data_roll_minutes_str );
+    if (cfg.data_roll_minutes < 1) cfg.data_roll_minutes = 1;
+    if (cfg.data_roll_minutes > 1440) cfg.data_roll_minutes = 1440;
+    cfg.sse_port = atoi( cfg.sse_port_str );
+    if ((cfg.sse_port < 0) || (cfg.sse_port > 65535)) cfg.sse_port = 0;
+    cfg.flight_cycles = atoi( cfg.flight_cycles_str );
+    if ((cfg.flight_cycles < 0) || (cfg.flight_cycles > FLIGHT_MAX)) cfg.flight_cycles = 360;
+    cfg.anomaly_minutes = atoi( cfg.anomaly_minutes_str );
+    if ((cfg.anomaly_minutes < 1) || (cfg.anomaly_minutes > 30)) cfg.anomaly_minutes = 5;
+    cfg.anomaly_warn = atoi( cfg.anomaly_warn_str );
+    if ((cfg.anomaly_warn < 0) || (cfg.anomaly_warn > 50)) cfg.anomaly_warn = 4;
+    cfg.anomaly_alarm = atoi( cfg.anomaly_alarm_str );
+    if ((cfg.anomaly_alarm < cfg.anomaly_warn) || (cfg.anomaly_alarm > 50)) cfg.anomaly_alarm = 2*cfg.anomaly_warn;
+
+    /* Find the sensor files, then log them */
+    MapSensors();
+    sprintf( buff, "Furnace temp sensor file: %s", sensor_paths[1] );
+    log_message(LOG_FILE, buff);
+    sprintf( buff, "Solar collector temp sensor file: %s", sensor_paths[2] );
     log_message(LOG_FILE, buff);
-    sprintf( buff, "Solar collector temp sensor file: %s", cfg.tkolektor_sensor );
+    sprintf( buff, "Boiler high temp sensor file: %s", sensor_paths[3] );
     log_message(LOG_FILE, buff);
-    sprintf( buff, "Boiler high temp sensor file: %s", cfg.tboilerh_sensor );
+    sprintf( buff, "Boiler low temp sensor file: %s", sensor_paths[4] );
     log_message(LOG_FILE, buff);
-    sprintf( buff, "Boiler low temp sensor file: %s", cfg.tboilerl_sensor );
+    sprintf( buff, "Sensor resolutions: furnace %d bit, solar collector %d bit, boiler high %d bit, boiler low %d bit; "\
+    "read at least every %d cycles", cfg.tkotel_resolution, cfg.tkolektor_resolution, cfg.tboilerh_resolution,
+    cfg.tboilerl_resolution, cfg.sensor_max_interval );
     log_message(LOG_FILE, buff);
     /* Prepare log messages with GPIO pins used and write them to log file */
     sprintf( buff, "Using INPUT GPIO pins (BCM mode) as follows: battery powered: %d", cfg.bat_powered_pin );
     log_message(LOG_FILE, buff);
     sprintf( buff, "Using OUTPUT GPIO pins (BCM mode) as follows: furnace pump: %d, ETC pump: %d, boiler valve: %d, "\
-	"electrical heater: %d ", cfg.pump1_pin, cfg.pump2_pin, cfg.valve1_pin, cfg.el_heater_pin );
+	"electrical heater: %d, heat pump: %d", cfg.pump1_pin, cfg.pump2_pin, cfg.valve1_pin, cfg.el_heater_pin,\
+	cfg.heat_pump_pin );
     log_message(LOG_FILE, buff);
     if (cfg.invert_output) {
         sprintf( buff, "OUTPUT GPIO pins controlling is INVERTED - ON is LOW (0)" );
@@ -538,19 +2028,57 @@ parse_config()
     "night boiler boost=%d, absMAX=%d", cfg.pump1_always_on, cfg.use_pump1, cfg.use_pump2,\
     cfg.day_to_reset_Pcounters, cfg.night_boost, cfg.abs_max );
     log_message(LOG_FILE, buff);
-	
-    /* stuff for after parsing config file: */
-    /* calculate maximum possible temp for use in night_boost case */
-    nightEnergyTemp = ((float)cfg.wanted_T + 12);
-    if (nightEnergyTemp > (float)cfg.abs_max) { nightEnergyTemp = (float)cfg.abs_max; }
-}
-
-void
+    /* Prepare log message part 3 and write it to log file */
+    sprintf( buff, "INFO: Relays min on/off s, max toggles/h: furnace pump %d/%d,%d; solar pump %d/%d,%d; "\
+    "valve %d/%d,%d; heater %d/%d,%d; stagger %d ms", cfg.pump1_min_on, cfg.pump1_min_off,\
+    cfg.pump1_max_toggles, cfg.pump2_min_on, cfg.pump2_min_off, cfg.pump2_max_toggles,\
+    cfg.valve_min_on, cfg.valve_min_off, cfg.valve_max_toggles, cfg.heater_min_on,\
+    cfg.heater_min_off, cfg.heater_max_toggles, cfg.relay_stagger_ms );
+    log_message(LOG_FILE, buff);
+    sprintf( buff, "INFO: Heat pump %s: min on/off %d/%d s, max toggles/h %d, %d W, COP %d%% of the ideal",
+    cfg.use_heat_pump ? "in use" : "not in use (heat_pump_pin=0)", cfg.heat_pump_min_on, cfg.heat_pump_min_off,\
+    cfg.heat_pump_max_toggles, cfg.heat_pump_watts, cfg.heat_pump_efficiency );
+    log_message(LOG_FILE, buff);
+    /* Prepare log message part 4 and write it to log file */
+    snprintf( buff, sizeof buff, "INFO: Night tariff summer %.2d:00-%.2d:59, winter %.2d:00-%.2d:59, summer months %d-%d, "\
+    "price per kWh day=%.4f, night=%.4f, tank %d l (0=no heat estimate)", cfg.nt_summer_start, cfg.nt_summer_stop,\
+    cfg.nt_winter_start, cfg.nt_winter_stop, cfg.summer_first_month, cfg.summer_last_month, cfg.day_price,\
+    cfg.night_price, cfg.tank_liters );
+    log_message(LOG_FILE, buff);
+    sprintf( buff, "INFO: Schedule: %d night tariff windows (0=seasonal hours), %d holidays, %d away dates, "\
+    "%d pump exercise windows (0=hour for the month)", sched_cfg.n_night, sched_cfg.n_holidays, sched_cfg.n_away,\
+    sched_cfg.n_exercise );
+    log_message(LOG_FILE, buff);
+    sprintf( buff, "INFO: State checkpoint written every %d cycles and on relay changes, resumed if not older than %d s; "\
+    "repeated warnings summed up every %d s", cfg.state_sync_cycles, cfg.state_max_age, cfg.log_repeat_window );
+    log_message(LOG_FILE, buff);
+    sprintf( buff, "INFO: Real-time priority=%d (0=off), CPU core=%d (-1=any), safe relay state at start=%d",
+    cfg.realtime_priority, cfg.cpu_core, cfg.safe_relay_state );
+    log_message(LOG_FILE, buff);
+    sprintf( buff, "INFO: Data archive=%d, data file rolled at %d KB or after %d min", cfg.data_archive,
+    cfg.data_roll_kb, cfg.data_roll_minutes );
+    log_message(LOG_FILE, buff);
+    sprintf( buff, "INFO: Live stream port=%d (0=off), socket=%.60s", cfg.sse_port, cfg.sse_socket );
+    log_message(LOG_FILE, buff);
+    sprintf( buff, "INFO: Flight recorder keeps the last %d cycles (0=off)", cfg.flight_cycles );
+    log_message(LOG_FILE, buff);
+    sprintf( buff, "INFO: Pump and flow responses checked %d min after switch on, WARNING at score %d, ALARM at %d "\
+    "(0=off)", cfg.anomaly_minutes, cfg.anomaly_warn, cfg.anomaly_alarm );
+    log_message(LOG_FILE, buff);
+	
+    /* stuff for after parsing config file: */
+    /* calculate maximum possible temp for use in night_boost case */
+    nightEnergyTemp = ((float)cfg.wanted_T + 12);
+    if (nightEnergyTemp > (float)cfg.abs_max) { nightEnergyTemp = (float)cfg.abs_max; }
+}
+
+void
 WritePersistentPower() {
     FILE *logfile;
     char timestamp[30];
     time_t t;
     struct tm *t_struct;
+    short d, h;
 
     t = time(NULL);
     t_struct = localtime( &t );
@@ -561,18 +2089,51 @@ WritePersistentPower() {
     fprintf( logfile, "# solard power persistence file written %s\n", timestamp );
     fprintf( logfile, "total=%6.3f\n", TotalPowerUsed );
     fprintf( logfile, "nightly=%6.3f\n", NightlyPowerUsed );
+    fprintf( logfile, "total_mwh=%llu\n", TotalEnergyUsed );
+    fprintf( logfile, "nightly_mwh=%llu\n", NightlyEnergyUsed );
+    fprintf( logfile, "# milli-Wh used on the day below: per device day,night tariff and per hour of day\n" );
+    fprintf( logfile, "date=%s\n", energy_date );
+    for (d=0;d<TOTALDEVICES;d++) {
+        fprintf( logfile, "tariff_%s=%lu,%lu\n", device_names[d], energy_tariff[d][0], energy_tariff[d][1] );
+    }
+    for (d=0;d<TOTALDEVICES;d++) {
+        fprintf( logfile, "hours_%s=", device_names[d] );
+        for (h=0;h<24;h++) fprintf( logfile, (h<23) ? "%lu," : "%lu\n", energy_hour[d][h] );
+    }
+    fprintf( logfile, "# milli-Wh of heat put in the tank per source: on the day above,since the power counters reset\n" );
+    for (d=0;d<HEAT_SOURCES;d++) {
+        fprintf( logfile, "heat_%s=%llu,%llu\n", heat_source_names[d], heat_today[d], heat_month[d] );
+    }
     fclose( logfile );
 }
 
+/* parse up to n comma separated numbers from s into a[] */
+void
+parse_counters( char *s, unsigned long *a, short n ) {
+    short i;
+    char *e;
+
+    for (i=0;i<n;i++) {
+        a[i] = strtoul( s, &e, 10 );
+        if ( (e == s) || (*e != ',') ) break;
+        s = e + 1;
+    }
+}
+
 void
 ReadPersistentPower() {
     float f = 0;
-    char *s, buff[150];
+    char *s, buff[400], msg[150];
     char totalP_str[MAXLEN];
     char nightlyP_str[MAXLEN];
+    char totalE_str[MAXLEN];
+    char nightlyE_str[MAXLEN];
     short should_write=0;
+    short d;
     strcpy( totalP_str, "0" );
     strcpy( nightlyP_str, "0" );
+    totalE_str[0] = 0;
+    nightlyE_str[0] = 0;
     FILE *fp = fopen(POWER_FILE, "r");
     if (fp == NULL) {
         log_message(LOG_FILE,"WARNING: Failed to open "POWER_FILE" file for reading!");
@@ -592,7 +2153,8 @@ ReadPersistentPower() {
             else strncpy (name, s, MAXLEN);
             s = strtok (NULL, "=");
             if (s==NULL) continue;
-            else strncpy (value, s, MAXLEN);
+            /* the hours lines do not fit in value[] - keep it terminated */
+            else snprintf (value, MAXLEN, "%s", s);
             trim (value);
 
             /* Copy data in corresponding strings */
@@ -600,6 +2162,25 @@ ReadPersistentPower() {
             strncpy (totalP_str, value, MAXLEN);
             else if (strcmp(name, "nightly")==0)
             strncpy (nightlyP_str, value, MAXLEN);
+            else if (strcmp(name, "total_mwh")==0)
+            strncpy (totalE_str, value, MAXLEN);
+            else if (strcmp(name, "nightly_mwh")==0)
+            strncpy (nightlyE_str, value, MAXLEN);
+            else if (strcmp(name, "date")==0)
+            snprintf (energy_date, sizeof energy_date, "%.10s", value);
+            else {
+                /* per device counters - the hours lines are longer than value[] */
+                for (d=0;d<TOTALDEVICES;d++) {
+                    if ( (strncmp(name, "tariff_", 7)==0) && (strcmp(name+7, device_names[d])==0) )
+                    parse_counters( s, energy_tariff[d], 2 );
+                    else if ( (strncmp(name, "hours_", 6)==0) && (strcmp(name+6, device_names[d])==0) )
+                    parse_counters( s, energy_hour[d], 24 );
+                }
+                for (d=0;d<HEAT_SOURCES;d++) {
+                    if ( (strncmp(name, "heat_", 5)==0) && (strcmp(name+5, heat_source_names[d])==0) )
+                    sscanf( s, "%llu,%llu", &heat_today[d], &heat_month[d] );
+                }
+            }
         }
         /* Close file */
         fclose (fp);
@@ -610,43 +2191,203 @@ ReadPersistentPower() {
         WritePersistentPower();
     }
     else {
-        /* Convert strings to float */
-        strcpy( buff, totalP_str );
-        f = atof( buff );
-        TotalPowerUsed = f;
-        strcpy( buff, nightlyP_str );
-        f = atof( buff );
-        NightlyPowerUsed = f;
+        /* Convert strings to milli-Wh; files written before energy was counted in
+        milli-Wh have only the Wh values */
+        if ( totalE_str[0] ) {
+            TotalEnergyUsed = strtoull( totalE_str, NULL, 10 );
+        }
+        else {
+            f = atof( totalP_str );
+            TotalEnergyUsed = (unsigned long long)(f*1000 + 0.5);
+        }
+        if ( nightlyE_str[0] ) {
+            NightlyEnergyUsed = strtoull( nightlyE_str, NULL, 10 );
+        }
+        else {
+            f = atof( nightlyP_str );
+            NightlyEnergyUsed = (unsigned long long)(f*1000 + 0.5);
+        }
     }
 
     /* Prepare log message and write it to log file */
     if (fp == NULL) {
-        sprintf( buff, "INFO: Using power counters start values: Total=%6.3f, Nightly=%6.3f",
+        sprintf( msg, "INFO: Using power counters start values: Total=%6.3f, Nightly=%6.3f",
         TotalPowerUsed, NightlyPowerUsed );
         } else {
-        sprintf( buff, "INFO: Read power counters start values: Total=%6.3f, Nightly=%6.3f",
-        TotalPowerUsed, NightlyPowerUsed );
+        sprintf( msg, "INFO: Read power counters start values: Total=%6.3f, Nightly=%6.3f, day counters date=%s",
+        TotalPowerUsed, NightlyPowerUsed, energy_date );
     }
-    log_message(LOG_FILE, buff);
+    log_message(LOG_FILE, msg);
+}
+
+/* Append the energy used on energy_date to LEDGER_FILE as one line: total, day and night tariff
+milli-Wh, cost, per device day and night tariff milli-Wh, milli-Wh used in each hour of the day,
+milli-Wh of heat each source put in the tank, and the heat pump's day and night tariff milli-Wh (its
+columns came last, so the ones before keep their place).
+The line is written with a single write() to a file opened for appending, so it is either all there
+or not there at all. */
+void
+WriteEnergyLedger() {
+    char line[800];
+    unsigned long long day_mwh = 0, night_mwh = 0;
+    unsigned long hour_mwh;
+    struct stat st;
+    short d, h;
+    int n = 0;
+    int fd;
+
+    for (d=0;d<TOTALDEVICES;d++) {
+        day_mwh += energy_tariff[d][0];
+        night_mwh += energy_tariff[d][1];
+    }
+    fd = open( LEDGER_FILE, O_WRONLY|O_APPEND|O_CREAT, 0644 );
+    if (-1 == fd) {
+        log_message(LOG_FILE, "WARNING: Failed to open "LEDGER_FILE" for appending!");
+        return;
+    }
+    if ( (fstat( fd, &st ) == 0) && (st.st_size == 0) ) {
+        n += snprintf( line+n, sizeof(line)-n, "# date,total_mwh,day_mwh,night_mwh,cost,"\
+        "heater_day,heater_night,pump1_day,pump1_night,pump2_day,pump2_night,valve_day,valve_night,"\
+        "self_day,self_night,h00..h23 mwh,heat_solar,heat_furnace,heat_heater,heat_heatpump,"\
+        "heatpump_day,heatpump_night mwh\n" );
+        if ( n > (int)sizeof(line)-2 ) n = sizeof(line)-2;
+    }
+    n += snprintf( line+n, sizeof(line)-n, "%s,%llu,%llu,%llu,%.2f", energy_date, day_mwh+night_mwh,
+    day_mwh, night_mwh, (day_mwh*cfg.day_price + night_mwh*cfg.night_price)/1000000 );
+    if ( n > (int)sizeof(line)-2 ) n = sizeof(line)-2;
+    for (d=0;d<DEV_HEATPUMP;d++) {
+        n += snprintf( line+n, sizeof(line)-n, ",%lu,%lu", energy_tariff[d][0], energy_tariff[d][1] );
+        if ( n > (int)sizeof(line)-2 ) n = sizeof(line)-2;
+    }
+    for (h=0;h<24;h++) {
+        hour_mwh = 0;
+        for (d=0;d<TOTALDEVICES;d++) hour_mwh += energy_hour[d][h];
+        n += snprintf( line+n, sizeof(line)-n, ",%lu", hour_mwh );
+        if ( n > (int)sizeof(line)-2 ) n = sizeof(line)-2;
+    }
+    for (d=0;d<HEAT_SOURCES;d++) {
+        n += snprintf( line+n, sizeof(line)-n, ",%llu", heat_today[d] );
+        if ( n > (int)sizeof(line)-2 ) n = sizeof(line)-2;
+    }
+    n += snprintf( line+n, sizeof(line)-n, ",%lu,%lu\n", energy_tariff[DEV_HEATPUMP][0],
+    energy_tariff[DEV_HEATPUMP][1] );
+    if ( n > (int)sizeof(line)-2 ) n = sizeof(line)-2;
+    /* a cut line still ends the record */
+    if ( line[n-1] != '\n' ) line[n++] = '\n';
+    if ( write( fd, line, n ) != n ) {
+        log_message(LOG_FILE, "WARNING: Failed to append day data to "LEDGER_FILE"!");
+    }
+    fsync( fd );
+    close( fd );
+}
+
+/* Start counting energy used for a new day */
+void
+ResetDailyEnergy( const char *date ) {
+    memset( energy_hour, 0, sizeof energy_hour );
+    memset( energy_tariff, 0, sizeof energy_tariff );
+    memset( heat_today, 0, sizeof heat_today );
+    snprintf( energy_date, sizeof energy_date, "%.10s", date );
+}
+
+/* Sensor and GPIO value files are kept open, and read or written at offset 0 - sysfs asks the driver
+again on every access from the start of the file, so this saves an open() and a close() each time.
+A descriptor which fails is closed, so the next access opens the file anew. */
+#define FD_CACHE_SIZE   12
+
+struct fd_cache_struct
+{
+    char    path[MAXLEN];
+    int     flags;
+    int     fd;
+};
+
+struct fd_cache_struct fd_cache[FD_CACHE_SIZE];
+short fd_cache_next = 0;
+
+/* Returns an open descriptor for path, -1 if it cannot be opened */
+int
+CachedOpen( const char *path, int flags ) {
+    struct fd_cache_struct *c;
+    short i;
+
+    for (i=0;i<FD_CACHE_SIZE;i++) {
+        if ( fd_cache[i].path[0] && (fd_cache[i].flags == flags) && (strcmp( fd_cache[i].path, path ) == 0) )
+            return fd_cache[i].fd;
+    }
+    /* not open yet - take a free slot, or the oldest one */
+    for (i=0;(i<FD_CACHE_SIZE) && fd_cache[i].path[0];i++);
+    if ( i == FD_CACHE_SIZE ) {
+        i = fd_cache_next;
+        fd_cache_next = (fd_cache_next + 1) % FD_CACHE_SIZE;
+        close( fd_cache[i].fd );
+        fd_cache[i].path[0] = 0;
+    }
+    c = &fd_cache[i];
+    c->fd = open( path, flags|O_CLOEXEC );
+    if ( c->fd == -1 ) return -1;
+    snprintf( c->path, MAXLEN, "%s", path );
+    c->flags = flags;
+    return c->fd;
 }
 
+void
+CachedClose( int fd ) {
+    short i;
+
+    for (i=0;i<FD_CACHE_SIZE;i++) {
+        if ( fd_cache[i].path[0] && (fd_cache[i].fd == fd) ) {
+            close( fd );
+            fd_cache[i].path[0] = 0;
+        }
+    }
+}
+
+/* Closes all kept open files - sensors or pins may be about to change */
+void
+CloseCachedFiles() {
+    short i;
+
+    for (i=0;i<FD_CACHE_SIZE;i++) {
+        if ( fd_cache[i].path[0] ) close( fd_cache[i].fd );
+        fd_cache[i].path[0] = 0;
+    }
+}
+
+/* Export pin, unless it is exported already (e.g. left so by a crash), and wait for its
+direction file to show up */
 int
 GPIOExport(int pin)
 {
     char buffer[BUFFER_MAX];
+    char path[DIRECTION_MAX];
     ssize_t bytes_written;
+    short ms;
     int fd;
 
-    fd = open("/sys/class/gpio/export", O_WRONLY);
+    snprintf(path, DIRECTION_MAX, GPIO_DIR "/gpio%d/direction", pin);
+    if (0 == access(path, W_OK)) return(0);
+
+    fd = open(GPIO_DIR "/export", O_WRONLY);
     if (-1 == fd) {
         log_message(LOG_FILE,"Failed to open GPIO export for writing!");
         return(-1);
     }
 
     bytes_written = snprintf(buffer, BUFFER_MAX, "%d", pin);
-    write(fd, buffer, bytes_written);
+    if ((write(fd, buffer, bytes_written) != bytes_written) && (errno != EBUSY)) {
+        log_message(LOG_FILE,"Failed to export GPIO pin!");
+        close(fd);
+        return(-1);
+    }
     close(fd);
-    return(0);
+    /* udev may take a moment to make the new files writable */
+    for (ms=0; ms<GPIO_EXPORT_WAIT_MS; ms++) {
+        if (0 == access(path, W_OK)) return(0);
+        usleep(1000);
+    }
+    log_message(LOG_FILE,"GPIO pin exported, but its direction file is not writable!");
+    return(-1);
 }
 
 int
@@ -656,7 +2397,7 @@ GPIOUnexport(int pin)
     ssize_t bytes_written;
     int fd;
 
-    fd = open("/sys/class/gpio/unexport", O_WRONLY);
+    fd = open(GPIO_DIR "/unexport", O_WRONLY);
     if (-1 == fd) {
         log_message(LOG_FILE,"Failed to open GPIO unexport for writing!");
         return(-1);
@@ -671,20 +2412,21 @@ GPIOUnexport(int pin)
 int
 GPIODirection(int pin, int dir)
 {
-    static const char s_directions_str[]  = "in\0out";
+    static const char *s_directions_str[] = { "in", "out", "low", "high" };
 
     char path[DIRECTION_MAX];
     int fd;
 
-    snprintf(path, DIRECTION_MAX, "/sys/class/gpio/gpio%d/direction", pin);
+    snprintf(path, DIRECTION_MAX, GPIO_DIR "/gpio%d/direction", pin);
     fd = open(path, O_WRONLY);
     if (-1 == fd) {
         log_message(LOG_FILE,"Failed to open GPIO direction for writing!");
         return(-1);
     }
 
-    if (-1 == write(fd, &s_directions_str[IN == dir ? 0 : 3], IN == dir ? 2 : 3)) {
+    if (-1 == write(fd, s_directions_str[dir], strlen(s_directions_str[dir]))) {
         log_message(LOG_FILE,"Failed to set GPIO direction!");
+        close(fd);
         return(-1);
     }
 
@@ -699,20 +2441,20 @@ GPIORead(int pin)
     char value_str[3];
     int fd;
 
-    snprintf(path, VALUE_MAX, "/sys/class/gpio/gpio%d/value", pin);
-    fd = open(path, O_RDONLY);
+    snprintf(path, VALUE_MAX, GPIO_DIR "/gpio%d/value", pin);
+    fd = CachedOpen(path, O_RDONLY);
     if (-1 == fd) {
-        log_message(LOG_FILE,"Failed to open GPIO value for reading!");
+        log_limited(LOGC_GPIO, pin, 0, "Failed to open GPIO value for reading!");
         return(-1);
     }
+    GPIO_LATENCY();
 
-    if (-1 == read(fd, value_str, 3)) {
-        log_message(LOG_FILE,"Failed to read GPIO value!");
+    if (pread(fd, value_str, 3, 0) <= 0) {
+        log_limited(LOGC_GPIO, pin, 0, "Failed to read GPIO value!");
+        CachedClose(fd);
         return(-1);
     }
 
-    close(fd);
-
     return(atoi(value_str));
 }
 
@@ -724,19 +2466,20 @@ GPIOWrite(int pin, int value)
     char path[VALUE_MAX];
     int fd;
 
-    snprintf(path, VALUE_MAX, "/sys/class/gpio/gpio%d/value", pin);
-    fd = open(path, O_WRONLY);
+    snprintf(path, VALUE_MAX, GPIO_DIR "/gpio%d/value", pin);
+    fd = CachedOpen(path, O_WRONLY);
     if (-1 == fd) {
-        log_message(LOG_FILE,"Failed to open GPIO value for writing!");
+        log_limited(LOGC_GPIO, pin, 0, "Failed to open GPIO value for writing!");
         return(-1);
     }
+    GPIO_LATENCY();
 
-    if (1 != write(fd, &s_values_str[LOW == value ? 0 : 1], 1)) {
-        log_message(LOG_FILE,"Failed to write GPIO value!");
+    if (1 != pwrite(fd, &s_values_str[LOW == value ? 0 : 1], 1, 0)) {
+        log_limited(LOGC_GPIO, pin, 0, "Failed to write GPIO value!");
+        CachedClose(fd);
         return(-1);
     }
 
-    close(fd);
     return(0);
 }
 
@@ -750,77 +2493,429 @@ GPIOWrite(int pin, int value)
     real    0m0.834s
     user    0m0.000s
     sys     0m0.050s
+
+    The 9 bytes are the DS18B20 scratchpad: temperature LSB and MSB (1/16 degree), alarm limits,
+    configuration register, 3 reserved bytes and CRC8 of the first 8.
 */
 
-float
-sensorRead(const char* sensor)
+/* sensorRead() results */
+#define SENSOR_OK             0
+#define SENSOR_NO_FILE        1     /* cannot open - sensor gone from the bus */
+#define SENSOR_READ_ERROR     2
+#define SENSOR_BAD_DATA       3     /* not what a DS18B20 reports */
+#define SENSOR_CRC_ERROR      4     /* kernel or scratchpad CRC check failed */
+#define SENSOR_POWER_ON       5     /* 85 C - the value a DS18B20 has before its first conversion */
+#define SENSOR_FAULT          6     /* all zeros, all ones or -127 C - shorted or disconnected data line */
+#define SENSOR_STATUSES       7
+
+static const char *sensor_status_names[] = { "ok", "no sensor file", "read error", "bad data",
+                                             "CRC error", "85 C power-on value", "bus fault" };
+/* names of the counters in STATS_FILE */
+static const char *sensor_status_keys[] = { "", "NoFile", "ReadErr", "BadData", "Crc", "PowerOn", "Fault" };
+
+/* failed reads since start, per sensor and status */
+unsigned long sensor_errors[TOTALSENSORS+1][SENSOR_STATUSES];
+
+/* resolution the sensors actually have, as last read from them */
+short sensor_resolution[TOTALSENSORS+1] = { 12, 12, 12, 12, 12 };
+
+/* reads that took longer than SensorReadBudget() since start */
+unsigned long sensor_slow_reads[TOTALSENSORS+1];
+
+/* status of the failed read a sensor is in, SENSOR_OK if it reads fine - for the event log */
+short sensor_fault[TOTALSENSORS+1];
+
+/* Dallas/Maxim 1-wire CRC8 */
+unsigned char
+DS18B20Crc8( const unsigned char *data, short len ) {
+    unsigned char crc = 0, b;
+    short i, j;
+
+    for ( i = 0; i < len; i++ ) {
+        b = data[i];
+        for ( j = 0; j < 8; j++ ) {
+            crc = ( (crc ^ b) & 1 ) ? (crc >> 1) ^ 0x8C : (crc >> 1);
+            b >>= 1;
+        }
+    }
+    return crc;
+}
+
+#define HEXVAL(c) ( isdigit( c ) ? (c) - '0' : (tolower( c ) - 'a' + 10) )
+
+/* Parses w1_slave contents in buf into *temp and, if not NULL, the resolution the sensor
+is set to into *resolution; returns a SENSOR_* status */
+short
+ParseW1Slave( const char *buf, float *temp, short *resolution ) {
+    unsigned char sp[9];
+    const char *p = buf;
+    const char *t;
+    long milli;
+    short raw, masked, bits;
+    int i;
+
+    /* 1st line: scratchpad bytes, then ": crc=XX YES" */
+    for ( i = 0; i < 9; i++, p += 3 ) {
+        if ( !isxdigit( p[0] ) || !isxdigit( p[1] ) || (p[2] != ' ') ) return SENSOR_BAD_DATA;
+        sp[i] = (HEXVAL( p[0] ) << 4) | HEXVAL( p[1] );
+    }
+    if ( (strncmp( p, ": crc=", 6 ) != 0) || !isxdigit( p[6] ) || !isxdigit( p[7] ) ) return SENSOR_BAD_DATA;
+    p += 8;
+    if ( strncmp( p, " YES\n", 5 ) != 0 ) {
+        /* disconnected data line reads as all ones, with a bad CRC */
+        for ( i = 0; (i < 9) && (sp[i] == 0xff); i++ );
+        return ( i == 9 ) ? SENSOR_FAULT : SENSOR_CRC_ERROR;
+    }
+    if ( DS18B20Crc8( sp, 8 ) != sp[8] ) return SENSOR_CRC_ERROR;
+    /* all zeros have a valid CRC - but the configuration register never is 0 */
+    for ( i = 0; (i < 9) && (sp[i] == 0); i++ );
+    if ( i == 9 ) return SENSOR_FAULT;
+    if ( (sp[4] & 0x9F) != 0x1F ) return SENSOR_BAD_DATA;
+
+    /* 2nd line: the same bytes and "t=<millidegrees>" which must agree with the scratchpad */
+    t = strstr( p, "t=" );
+    if ( !t ) return SENSOR_BAD_DATA;
+    milli = atol( t+2 );
+    if ( milli == -127000 ) return SENSOR_FAULT;
+    raw = (short)( sp[0] | (sp[1] << 8) );
+    /* below 12 bit resolution the low bits of the reading are undefined - they are cleared here,
+    and by the kernel in t= too, or not, depending on its version */
+    bits = 9 + ((sp[4] >> 5) & 3);
+    masked = raw & ~((1 << (12 - bits)) - 1);
+    if ( (labs( milli - (raw*1000L)/16 ) > 1) && (labs( milli - (masked*1000L)/16 ) > 1) ) return SENSOR_BAD_DATA;
+    raw = masked;
+
+    *temp = raw / 16.0;
+    if ( resolution ) *resolution = bits;
+    /* 85 C is what the sensor has until its first conversion is done - could be real, could be not */
+    if ( raw == 0x0550 ) return SENSOR_POWER_ON;
+    return SENSOR_OK;
+}
+
+/* Read and check the w1_slave file open on fd */
+short
+sensorReadFd( int fd, float *temp, short *resolution )
 {
-    char path[VALUE_MAX];
-    char value_str[50];
+    char buf[128];
+    ssize_t len;
+
+    W1_LATENCY();
+    len = pread( fd, buf, sizeof(buf)-1, 0 );
+    if ( len <= 0 ) return SENSOR_READ_ERROR;
+    buf[len] = 0;
+    return ParseW1Slave( buf, temp, resolution );
+}
+
+short
+sensorRead( const char* sensor, float *temp, short *resolution )
+{
+    short status;
     int fd;
-    char *str = "84 01 55 00 3f ff 3f 10 d7 t=114250";
-    const char *result = str;
-    long int_temp = 0;
-    float temp = -200;
-    /* if having trouble - return -200 */
-
-    /* try to open sensor file */
-    snprintf(path, VALUE_MAX, "%s", sensor);
-    fd = open(path, O_RDONLY);
-    if (-1 == fd) {
-        log_message(LOG_FILE,"Error opening sensor file. Continuing.");
-        return(temp);
+
+    fd = CachedOpen( sensor, O_RDONLY );
+    if ( -1 == fd ) return SENSOR_NO_FILE;
+    status = sensorReadFd( fd, temp, resolution );
+    /* sensor may be gone from the bus - open it anew next time */
+    if ( status == SENSOR_READ_ERROR ) CachedClose( fd );
+    return status;
+}
+
+/* Batched sensor reads. Where the kernel has io_uring (5.1 and later, unless turned off with the
+kernel.io_uring_disabled sysctl), the sensors due in a cycle are read with one io_uring_enter()
+instead of a pread() each. The kernel runs the reads in its own workers side by side, and the w1
+driver lets go of the bus while an externally powered sensor converts, so their conversions overlap.
+Raw syscalls and the kernel's own header - solard links with nothing but zlib. If there is no
+<linux/io_uring.h> to build with, or io_uring_setup() fails, sensors are read one by one. */
+#ifdef IORING_OFF_SQ_RING
+struct uring_struct
+{
+    int                 fd;         /* -1: not set up yet, -2: not available */
+    unsigned int        *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int        *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+};
+
+struct uring_struct uring = { -1, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL };
+
+/* Set up the ring for as many reads as there are sensors; returns 0 if io_uring is not available */
+short
+UringSetup() {
+    struct io_uring_params p;
+    char *sq, *cq;
+    char msg[150];
+
+    memset( &p, 0, sizeof p );
+    uring.fd = syscall( __NR_io_uring_setup, TOTALSENSORS, &p );
+    if ( uring.fd < 0 ) {
+        sprintf( msg, "INFO: No io_uring (errno %d) - sensors are read one by one.", errno );
+        log_message(LOG_FILE, msg);
+        uring.fd = -2;
+        return 0;
     }
+    sq = mmap( NULL, p.sq_off.array + p.sq_entries * sizeof(unsigned int), PROT_READ|PROT_WRITE,
+               MAP_SHARED|MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING );
+    cq = mmap( NULL, p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe), PROT_READ|PROT_WRITE,
+               MAP_SHARED|MAP_POPULATE, uring.fd, IORING_OFF_CQ_RING );
+    uring.sqes = mmap( NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_POPULATE, uring.fd, IORING_OFF_SQES );
+    if ( (sq == MAP_FAILED) || (cq == MAP_FAILED) || (uring.sqes == MAP_FAILED) ) {
+        log_message(LOG_FILE, "WARNING: Can not map io_uring rings - sensors are read one by one.");
+        close( uring.fd );
+        uring.fd = -2;
+        return 0;
+    }
+    uring.sq_head = (unsigned int *)(sq + p.sq_off.head);
+    uring.sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    uring.sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+    uring.sq_array = (unsigned int *)(sq + p.sq_off.array);
+    uring.cq_head = (unsigned int *)(cq + p.cq_off.head);
+    uring.cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    uring.cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 1;
+}
 
-    /* read the first line of data */
-    if (-1 == read(fd, value_str, 39)) {
-        log_message(LOG_FILE,"Error reading from sensor file. Continuing.");
-        close(fd);
-        return(temp);
+/* Read the sensors marked in due[] in one batch, into status[], temp[] and took[] (ms since the
+previous reading came in, so reads the bus takes one after another are not all counted as slow).
+Returns 0, with nothing read, if io_uring is not available - the caller reads them itself then. */
+short
+SensorReadBatch( const short *due, short *status, float *temp, long *took ) {
+    static char buf[TOTALSENSORS+1][128];
+    static struct iovec iov[TOTALSENSORS+1];
+    int fd[TOTALSENSORS+1];
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    struct timespec before, after;
+    unsigned int tail, head, submit = 0, left;
+    long n;
+    short i;
+
+    if ( (uring.fd == -2) || ((uring.fd == -1) && !UringSetup()) ) return 0;
+    clock_gettime( CLOCK_MONOTONIC, &before );
+    tail = *uring.sq_tail;
+    for (i=1;i<=TOTALSENSORS;i++) {
+        if ( !due[i] ) continue;
+        took[i] = 0;
+        temp[i] = 0;
+        status[i] = SENSOR_READ_ERROR;
+        fd[i] = CachedOpen( sensor_paths[i], O_RDONLY );
+        if ( fd[i] == -1 ) {
+            status[i] = SENSOR_NO_FILE;
+            continue;
+        }
+        W1_LATENCY();
+        iov[i].iov_base = buf[i];
+        iov[i].iov_len = sizeof(buf[i]) - 1;
+        sqe = &uring.sqes[tail & *uring.sq_mask];
+        memset( sqe, 0, sizeof *sqe );
+        sqe->opcode = IORING_OP_READV;
+        sqe->fd = fd[i];
+        sqe->addr = (unsigned long)&iov[i];
+        sqe->len = 1;
+        sqe->off = 0;
+        sqe->user_data = i;
+        uring.sq_array[tail & *uring.sq_mask] = tail & *uring.sq_mask;
+        tail++;
+        submit++;
+    }
+    __atomic_store_n( uring.sq_tail, tail, __ATOMIC_SEQ_CST );
+    left = submit;
+    while ( left ) {
+        head = *uring.cq_head;
+        if ( head == __atomic_load_n( uring.cq_tail, __ATOMIC_SEQ_CST ) ) {
+            n = syscall( __NR_io_uring_enter, uring.fd, submit, 1, IORING_ENTER_GETEVENTS, NULL, 0 );
+            if ( n >= 0 ) submit -= n;
+            else if ( errno != EINTR ) break;
+            continue;
+        }
+        cqe = &uring.cqes[head & *uring.cq_mask];
+        i = cqe->user_data;
+        n = cqe->res;
+        __atomic_store_n( uring.cq_head, head + 1, __ATOMIC_SEQ_CST );
+        left--;
+        clock_gettime( CLOCK_MONOTONIC, &after );
+        took[i] = (after.tv_sec - before.tv_sec)*1000 + (after.tv_nsec - before.tv_nsec)/1000000;
+        before = after;
+        if ( n <= 0 ) {
+            status[i] = SENSOR_READ_ERROR;
+            /* sensor may be gone from the bus - open it anew next time */
+            CachedClose( fd[i] );
+            continue;
+        }
+        buf[i][n] = 0;
+        status[i] = ParseW1Slave( buf[i], &temp[i], &sensor_resolution[i] );
     }
+    if ( left ) {
+        /* the ring is in an unknown state - read sensors one by one from now on */
+        log_message(LOG_FILE, "WARNING: io_uring_enter() failed - sensors are read one by one from now on.");
+        close( uring.fd );
+        uring.fd = -2;
+    }
+    return 1;
+}
+#else
+short
+SensorReadBatch( const short *due, short *status, float *temp, long *took ) {
+    return 0;
+}
+#endif
 
-    /* throw the first line away */
-    strncpy(value_str, " ", 48);
+/* Cold start: every sensor is read by a thread of its own while the rest of the start-up goes on,
+and the first ReadSensors() takes these readings. The threads open the files themselves - the
+file cache is for the main thread only. */
+struct prefetch_struct {
+    pthread_t thread;
+    short started;
+    short done;
+    short status;
+    short resolution;
+    float temp;
+    long took;
+};
+
+struct prefetch_struct prefetch[TOTALSENSORS+1];
+
+void *
+PrefetchSensor( void *arg ) {
+    struct prefetch_struct *p = &prefetch[(long)arg];
+    struct timespec before, after;
+    int fd;
 
-    /* read the second line into value_str */
-    if (-1 == read(fd, value_str, 35)) {
-        log_message(LOG_FILE,"Error reading row 2 from sensor file. Continuing.");
-        close(fd);
-        return(temp);
+    clock_gettime( CLOCK_MONOTONIC, &before );
+    fd = open( sensor_paths[(long)arg], O_RDONLY|O_CLOEXEC );
+    if ( fd == -1 ) { p->status = SENSOR_NO_FILE; }
+    else {
+        p->status = sensorReadFd( fd, &p->temp, &p->resolution );
+        close( fd );
     }
+    clock_gettime( CLOCK_MONOTONIC, &after );
+    p->took = (after.tv_sec - before.tv_sec)*1000 + (after.tv_nsec - before.tv_nsec)/1000000;
+    return NULL;
+}
 
-    /* close the file - we are done with it */
-    close(fd);
+void
+StartSensorPrefetch() {
+    long i;
+
+    for (i=1;i<=TOTALSENSORS;i++) {
+        prefetch[i].resolution = sensor_resolution[i];
+        prefetch[i].started = !StartThread( &prefetch[i].thread, PrefetchSensor, (void *)i );
+    }
+}
 
-    /* transform sensor data to float */
-    if((result = strchr((char *)&value_str, '=')) != NULL) {
-        /* increment result to avoid the '=' */
-        ++result;
-        int_temp = atol( result );
-        temp = ((float)int_temp) / 1000;
+/* Wait for the prefetching threads to finish */
+void
+FinishSensorPrefetch() {
+    short i;
+
+    for (i=1;i<=TOTALSENSORS;i++) {
+        if ( !prefetch[i].started ) continue;
+        pthread_join( prefetch[i].thread, NULL );
+        prefetch[i].started = 0;
+        prefetch[i].done = 1;
     }
+}
+
+/* Time a read of a sensor set to resolution bits may take, ms: the conversion (750 ms at 12 bit,
+halved for every bit less), plus half of it and 200 ms for the bus and sysfs */
+long
+SensorReadBudget( short resolution ) {
+    long conversion = 750 >> (12 - resolution);
+
+    return conversion + conversion/2 + 200;
+}
+
+/* Sets the resolution of the sensors to the configured one, if it is not that already. Newer w1_therm
+drivers have a "resolution" file next to w1_slave; older ones take the number of bits written to
+w1_slave. Either way the result is read back and logged. */
+void
+SetSensorResolutions() {
+    char path[MAXLEN+12];
+    char buf[8];
+    char msg[200];
+    float t;
+    short current, i;
+    int fd, n;
+    char *slash;
 
-    /* return the read temperature */
-    return(temp);
+    for (i=1;i<=TOTALSENSORS;i++) {
+        snprintf( path, sizeof path, "%s", sensor_paths[i] );
+        slash = strrchr( path, '/' );
+        if ( !slash ) continue;
+        strcpy( slash+1, "resolution" );
+        current = 0;
+        fd = open( path, O_RDONLY );
+        if ( fd != -1 ) {
+            n = read( fd, buf, sizeof(buf)-1 );
+            close( fd );
+            if ( n > 0 ) { buf[n] = 0; current = atoi( buf ); }
+        }
+        else {
+            /* no "resolution" file - get it from the scratchpad */
+            path[0] = 0;
+            if ( sensorRead( sensor_paths[i], &t, &current ) != SENSOR_OK ) continue;
+        }
+        sensor_resolution[i] = current;
+        if ( current == *sensor_resolutions[i] ) continue;
+
+        n = snprintf( buf, sizeof buf, "%d\n", *sensor_resolutions[i] );
+        fd = open( path[0] ? path : sensor_paths[i], O_WRONLY );
+        if ( (fd == -1) || (write( fd, buf, n ) != n) ) {
+            sprintf( msg, "WARNING: Cannot set resolution of sensor %d to %d bit (%.60s).", i,
+            *sensor_resolutions[i], strerror( errno ) );
+            log_message(LOG_FILE, msg);
+            if ( fd != -1 ) close( fd );
+            continue;
+        }
+        close( fd );
+        /* read it back */
+        if ( path[0] && ((fd = open( path, O_RDONLY )) != -1) ) {
+            n = read( fd, buf, sizeof(buf)-1 );
+            close( fd );
+            current = ( n > 0 ) ? (buf[n] = 0, atoi( buf )) : 0;
+        }
+        else if ( sensorRead( sensor_paths[i], &t, &current ) != SENSOR_OK ) current = 0;
+        if ( current ) sensor_resolution[i] = current;
+        if ( current == *sensor_resolutions[i] ) {
+            sprintf( msg, "INFO: Sensor %d resolution set to %d bit, reads take up to %ld ms.", i, current,
+            SensorReadBudget( current ) );
+        }
+        else if ( current ) {
+            sprintf( msg, "WARNING: Sensor %d resolution set to %d bit, but it reads back as %d.", i,
+            *sensor_resolutions[i], current );
+        }
+        else {
+            sprintf( msg, "WARNING: Sensor %d resolution set to %d bit, but it cannot be read back.", i,
+            *sensor_resolutions[i] );
+        }
+        log_message(LOG_FILE, msg);
+    }
 }
 
 void
 signal_handler(int sig)
 {
+    in_signal_handler = 1;
     switch(sig) {
         case SIGUSR1:
         log_message(LOG_FILE, "INFO: Signal SIGUSR1 caught. Will re-read config file soon.");
         need_to_read_cfg = 1;
         break;
         case SIGUSR2:
-        log_message(LOG_FILE, "INFO: Signal SIGUSR2 caught. Not implemented. Continuing.");
+        log_message(LOG_FILE, "INFO: Signal SIGUSR2 caught. Will hand over to "SOLARD_EXE" at end of cycle.");
+        need_to_reexec = 1;
         break;
         case SIGHUP:
         log_message(LOG_FILE, "INFO: Signal SIGHUP caught. Not implemented. Continuing.");
         break;
         case SIGTERM:
+        FlushOutputs();
         log_message(LOG_FILE, "INFO: Terminate signal caught. Stopping.");
+        LogEvent( EV_INFO, EV_STOP, 0, 0, 0, 0 );
+        ArchiveDataNow();
         WritePersistentPower();
+        WriteState( 1 );
         if ( ! DisableGPIOpins() ) {
             log_message(LOG_FILE, "WARNING: Errors disabling GPIO pins! Quitting anyway.");
             exit(14);
@@ -829,6 +2924,38 @@ signal_handler(int sig)
         exit(0);
         break;
     }
+    in_signal_handler = 0;
+}
+
+/* Dump the flight recorder, then die of sig as without the handler */
+void
+FatalSignal(int sig)
+{
+    char reason[30];
+
+    in_signal_handler = 1;
+    signal( sig, SIG_DFL );
+    snprintf( reason, sizeof reason, "fatal signal %d", sig );
+    FlightDump( reason );
+    raise( sig );
+}
+
+void
+SetSignalHandlers()
+{
+    signal(SIGCHLD,SIG_IGN); /* ignore child */
+    signal(SIGTSTP,SIG_IGN); /* ignore tty signals */
+    signal(SIGTTOU,SIG_IGN);
+    signal(SIGTTIN,SIG_IGN);
+    signal(SIGUSR1,signal_handler); /* catch signal USR1 */
+    signal(SIGUSR2,signal_handler); /* catch signal USR2 */
+    signal(SIGHUP,signal_handler); /* catch hangup signal */
+    signal(SIGTERM,signal_handler); /* catch kill signal */
+    signal(SIGSEGV,FatalSignal); /* and dump the flight recorder on crashes */
+    signal(SIGBUS,FatalSignal);
+    signal(SIGFPE,FatalSignal);
+    signal(SIGILL,FatalSignal);
+    signal(SIGABRT,FatalSignal);
 }
 
 void
@@ -853,14 +2980,120 @@ daemonize()
     /* first instance continues */
     sprintf(str,"%d\n",getpid());
     write(lfp,str,strlen(str)); /* record pid to lockfile */
-    signal(SIGCHLD,SIG_IGN); /* ignore child */
-    signal(SIGTSTP,SIG_IGN); /* ignore tty signals */
-    signal(SIGTTOU,SIG_IGN);
-    signal(SIGTTIN,SIG_IGN);
-    signal(SIGUSR1,signal_handler); /* catch signal USR1 */
-    signal(SIGUSR2,signal_handler); /* catch signal USR2 */
-    signal(SIGHUP,signal_handler); /* catch hangup signal */
-    signal(SIGTERM,signal_handler); /* catch kill signal */
+    /* lfp stays open - it holds the lock, also over an executable hand over */
+    SetSignalHandlers();
+}
+
+/* Put the process under SCHED_FIFO with cfg.realtime_priority and lock its memory, or back to
+normal scheduling if it is 0; pin the control loop to cfg.cpu_core and keep the output writer
+off that core */
+void
+ApplyRealtime() {
+    struct sched_param sp;
+    cpu_set_t set;
+    char msg[150];
+    long cpus, c;
+
+    if ( cfg.realtime_priority ) {
+        if ( mlockall( MCL_CURRENT|MCL_FUTURE ) ) {
+            sprintf( msg, "WARNING: Can not lock memory (errno %d). Continuing.", errno );
+            log_message(LOG_FILE, msg);
+        }
+        sp.sched_priority = cfg.realtime_priority;
+        if ( sched_setscheduler( 0, SCHED_FIFO, &sp ) ) {
+            sprintf( msg, "WARNING: Can not switch to SCHED_FIFO priority %d (errno %d). Continuing.",
+            cfg.realtime_priority, errno );
+            log_message(LOG_FILE, msg);
+        }
+        else {
+            sprintf( msg, "INFO: Running under SCHED_FIFO priority %d with locked memory.", cfg.realtime_priority );
+            log_message(LOG_FILE, msg);
+        }
+    }
+    else if ( sched_getscheduler( 0 ) == SCHED_FIFO ) {
+        sp.sched_priority = 0;
+        sched_setscheduler( 0, SCHED_OTHER, &sp );
+        munlockall();
+        log_message(LOG_FILE, "INFO: Back to normal scheduling.");
+    }
+
+    cpus = sysconf( _SC_NPROCESSORS_CONF );
+    if ( (cpus < 1) || (cpus > CPU_SETSIZE) ) cpus = 1;
+    CPU_ZERO( &set );
+    if ( (cfg.cpu_core >= 0) && (cfg.cpu_core < cpus) ) { CPU_SET( cfg.cpu_core, &set ); }
+    else { for (c=0; c<cpus; c++) CPU_SET( c, &set ); }
+    if ( sched_setaffinity( 0, sizeof set, &set ) ) {
+        sprintf( msg, "WARNING: Can not pin to CPU core %d (errno %d). Continuing.", cfg.cpu_core, errno );
+        log_message(LOG_FILE, msg);
+    }
+    /* helper threads stay off the control loop's core */
+    CPU_ZERO( &set );
+    for (c=0; c<cpus; c++) if ( (c != cfg.cpu_core) || (cpus == 1) ) CPU_SET( c, &set );
+    if ( output_thread_running ) pthread_setaffinity_np( output_thread, sizeof set, &set );
+    if ( archiver_running ) pthread_setaffinity_np( archive_thread, sizeof set, &set );
+    if ( sse_running ) pthread_setaffinity_np( sse_thread, sizeof set, &set );
+}
+
+/* ms passed since t (CLOCK_MONOTONIC) */
+long
+MsSince( const struct timespec *t ) {
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (now.tv_sec - t->tv_sec)*1000 + (now.tv_nsec - t->tv_nsec)/1000000;
+}
+
+/* Cycle start jitter: how far from 10 s apart the last CYCLE_JITTER_SAMPLES cycles started, us */
+#define CYCLE_JITTER_SAMPLES    360
+
+long cycle_jitter[CYCLE_JITTER_SAMPLES];
+unsigned short cycle_jitter_count = 0;
+unsigned short cycle_jitter_head = 0;
+
+/* Note the start of a cycle; a zero skip only resets the reference (after a time skew or a long stall) */
+void
+RecordCycleStart( short skip ) {
+    static struct timespec prev;
+    static short have_prev = 0;
+    struct timespec now;
+    long d;
+
+    if ( clock_gettime( CLOCK_MONOTONIC, &now ) ) return;
+    if ( have_prev && !skip ) {
+        d = (now.tv_sec - prev.tv_sec)*1000000L + (now.tv_nsec - prev.tv_nsec)/1000 - 10000000L;
+        cycle_jitter[cycle_jitter_head] = ( d < 0 ) ? -d : d;
+        cycle_jitter_head = (cycle_jitter_head + 1) % CYCLE_JITTER_SAMPLES;
+        if ( cycle_jitter_count < CYCLE_JITTER_SAMPLES ) cycle_jitter_count++;
+    }
+    prev = now;
+    have_prev = 1;
+}
+
+int
+CompareLong( const void *a, const void *b ) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return ( x > y ) - ( x < y );
+}
+
+/* put p50, p99 and max of the recorded cycle jitter in p[0..2] */
+void
+CycleJitterPercentiles( long p[3] ) {
+    static long sorted[CYCLE_JITTER_SAMPLES];
+    unsigned short n = cycle_jitter_count;
+
+    p[0] = p[1] = p[2] = 0;
+    if ( !n ) return;
+    memcpy( sorted, cycle_jitter, n * sizeof sorted[0] );
+    qsort( sorted, n, sizeof sorted[0], CompareLong );
+    p[0] = sorted[(n - 1) / 2];
+    p[1] = sorted[((long)n * 99 - 1) / 100];
+    p[2] = sorted[n - 1];
+}
+
+/* GPIODirection() argument for an output pin to start with its relay on or off */
+int
+OutputLevel( short on ) {
+    return ( cfg.invert_output ? !on : on ) ? OUT_HIGH : OUT_LOW;
 }
 
 /* the following 3 functions RETURN 0 ON ERROR! (its to make the program nice to read) */
@@ -871,74 +3104,370 @@ EnableGPIOpins()
     if (-1 == GPIOExport(cfg.pump2_pin)) return 0;
     if (-1 == GPIOExport(cfg.valve1_pin)) return 0;
     if (-1 == GPIOExport(cfg.el_heater_pin))  return 0;
+    if (cfg.use_heat_pump && (-1 == GPIOExport(cfg.heat_pump_pin))) return 0;
     if (-1 == GPIOExport(cfg.bat_powered_pin)) return 0;
     return -1;
 }
 
+/* output pins start driving what is in controls[] right away */
 short
 SetGPIODirection()
 {
     /* input pins */
     if (-1 == GPIODirection(cfg.bat_powered_pin, IN))  return 0;
     /* output pins */
-    if (-1 == GPIODirection(cfg.pump1_pin, OUT)) return 0;
-    if (-1 == GPIODirection(cfg.pump2_pin, OUT)) return 0;
-    if (-1 == GPIODirection(cfg.valve1_pin, OUT)) return 0;
-    if (-1 == GPIODirection(cfg.el_heater_pin, OUT))  return 0;
+    if (-1 == GPIODirection(cfg.pump1_pin, OutputLevel(CPump1))) return 0;
+    if (-1 == GPIODirection(cfg.pump2_pin, OutputLevel(CPump2))) return 0;
+    if (-1 == GPIODirection(cfg.valve1_pin, OutputLevel(CValve))) return 0;
+    if (-1 == GPIODirection(cfg.el_heater_pin, OutputLevel(CHeater)))  return 0;
+    if (cfg.use_heat_pump && (-1 == GPIODirection(cfg.heat_pump_pin, OutputLevel(CHeatPump)))) return 0;
     return -1;
 }
 
 short
 DisableGPIOpins()
 {
+    CloseCachedFiles();
     if (-1 == GPIOUnexport(cfg.pump1_pin)) return 0;
     if (-1 == GPIOUnexport(cfg.pump2_pin)) return 0;
     if (-1 == GPIOUnexport(cfg.valve1_pin)) return 0;
     if (-1 == GPIOUnexport(cfg.el_heater_pin))  return 0;
+    if (cfg.use_heat_pump && (-1 == GPIOUnexport(cfg.heat_pump_pin))) return 0;
     if (-1 == GPIOUnexport(cfg.bat_powered_pin)) return 0;
     return -1;
 }
 
+/* Adaptive sampling.
+Each sensor keeps a moving average of how fast it changes (rate, C per cycle) and of how much that
+change jumps around (dev, the mean absolute deviation from the rate - a variance without the need
+for libm). A sensor is read again once rate and dev together could have moved it by more than
+SAMPLE_MAX_DRIFT, but at least every cfg.sensor_max_interval cycles. Sensors that feed an active
+decision - running relays, near the wanted or critical temperatures - are read every cycle. */
+#define SAMPLE_MAX_DRIFT      0.25
+
+struct sampler_struct
+{
+    float           rate;           /* change per cycle, C */
+    float           dev;            /* mean absolute deviation of the change from rate, C */
+    float           last;           /* value at last read */
+    unsigned long   last_cycle;     /* ProgramRunCycles of last read */
+    short           interval;       /* cycles from last read to the next one */
+    unsigned long   reads;          /* since start */
+    unsigned long   skips;          /* since start */
+};
+
+struct sampler_struct sampler[TOTALSENSORS+1];
+
+/* Returns non-zero if sensor i feeds a decision that is active now */
+short
+SensorPromoted( short i ) {
+    if ( just_started || AlarmRaised ) return 1;
+    switch (i) {
+        case 1: /* furnace - its pump and the valve, warming up (rules watch it rise), and emergency cooling */
+        return ( CPump1 || CValve || (Tkotel > 20) );
+        case 2: /* solar collector - its pump, and within 2 C of where the rules start it: freeze guard
+        at 7 C, overheat at 68 C, enough heat over the boiler's cold end, and over the furnace */
+        return ( CPump2 || (Tkolektor < 9) || (Tkolektor > 66) || (Tkolektor > TboilerLow + 8) ||
+                 ((Tkolektor > Tkotel) && (Tkolektor < Tkotel + 4)) );
+        case 3: /* boiler - whatever heats it, the wanted temp, and emergency cooling at 71 C */
+        case 4:
+        return ( CPump1 || CPump2 || CHeater || CHeatPump || (TboilerHigh > 66) ||
+                 ((sensors[i] > cfg.wanted_T - 2) && (sensors[i] < cfg.wanted_T + 2)) );
+    }
+    return 1;
+}
+
+short
+SensorDue( short i ) {
+    if ( cfg.sensor_max_interval < 2 ) return 1;
+    if ( (ProgramRunCycles - sampler[i].last_cycle) >= (unsigned long)sampler[i].interval ) return 1;
+    return SensorPromoted( i );
+}
+
+/* Updates rate, dev and the next read interval of sensor i with its new value */
 void
-ReadSensors() {
-    float new_val = 0;
+SensorSampled( short i, float value ) {
+    struct sampler_struct *s = &sampler[i];
+    float change, spread, n;
+
+    if ( s->reads && (ProgramRunCycles > s->last_cycle) ) {
+        change = (value - s->last) / (ProgramRunCycles - s->last_cycle);
+        s->rate += (change - s->rate) / 4;
+        s->dev += (((change > s->rate) ? change - s->rate : s->rate - change) - s->dev) / 4;
+    }
+    s->last = value;
+    s->last_cycle = ProgramRunCycles;
+    s->reads++;
+    spread = ((s->rate < 0) ? -s->rate : s->rate) + 2*s->dev;
+    n = ( spread > 0 ) ? (SAMPLE_MAX_DRIFT / spread) : cfg.sensor_max_interval;
+    if ( n < 1 ) n = 1;
+    if ( n > cfg.sensor_max_interval ) n = cfg.sensor_max_interval;
+    s->interval = (short)n;
+}
+
+/* 1-wire sensor discovery. In config a sensor is a w1_slave file path, a probe's device ID (e.g.
+28-041464764cff), or "auto" - a probe on the bus no other sensor is set to. The probes "auto" sensors
+got are kept in SENSOR_MAP_FILE, so they stay the same over restarts; an "auto" sensor whose probe
+is gone from the bus takes the new one when it shows up, e.g. a replaced probe. The bus is scanned
+when config is (re)read, and then only when the kernel reports a 1-wire device added or removed,
+or an "auto" sensor's file is missing - at most every W1_RESCAN_CYCLES; sensor reads use the paths
+found, with no directory scans. */
+#define W1_MAX_DEVICES       16
+#define W1_ID_LEN            20
+#define W1_RESCAN_CYCLES     3
+
+/* probes "auto" sensors have */
+char sensor_auto_id[TOTALSENSORS+1][W1_ID_LEN];
+short sensor_map_read = 0;
+/* the sensor has a new probe - its next reading is taken as it is */
+short sensor_new[TOTALSENSORS+1];
+int w1_uevent_fd = -1;
+short w1_rescan = 0;
+unsigned long w1_last_scan = 0;
+
+int
+CompareW1Id( const void *a, const void *b ) {
+    return strcmp( (const char *)a, (const char *)b );
+}
+
+/* Put the IDs of the temperature probes (family 28) on the bus in ids, sorted; returns how many */
+short
+ScanW1( char ids[][W1_ID_LEN] ) {
+    struct dirent *e;
+    short n = 0;
+    DIR *d;
+
+    w1_last_scan = ProgramRunCycles;
+    if ( (d = opendir( W1_DEVICES )) == NULL ) return 0;
+    while ( ((e = readdir( d )) != NULL) && (n < W1_MAX_DEVICES) ) {
+        if ( strncmp( e->d_name, "28-", 3 ) || (strlen( e->d_name ) >= W1_ID_LEN) ) continue;
+        strcpy( ids[n++], e->d_name );
+    }
+    closedir( d );
+    qsort( ids, n, W1_ID_LEN, CompareW1Id );
+    return n;
+}
+
+void
+ReadSensorMap() {
+    char line[100], id[W1_ID_LEN];
+    FILE *fp;
     int i;
-    char msg[100];
+
+    sensor_map_read = 1;
+    if ( (fp = fopen( SENSOR_MAP_FILE, "r" )) == NULL ) return;
+    while ( fgets( line, sizeof line, fp ) ) {
+        if ( (sscanf( line, "%d=%19s", &i, id ) == 2) && (i >= 1) && (i <= TOTALSENSORS) ) strcpy( sensor_auto_id[i], id );
+    }
+    fclose( fp );
+}
+
+void
+WriteSensorMap() {
+    char buf[TOTALSENSORS*(W1_ID_LEN+8)];
+    short i;
+    int n = 0;
 
     for (i=1;i<=TOTALSENSORS;i++) {
-        new_val = sensorRead(sensor_paths[i]);
-        if ( new_val != -200 ) {
-            if (sensor_read_errors[i]) sensor_read_errors[i]--;
-            if (just_started) { sensors_prv[i] = new_val; sensors[i] = new_val; }
-            if (new_val < (sensors_prv[i]-(2*MAX_TEMP_DIFF))) {
-                sprintf( msg, "WARNING: Counting %6.3f for sensor %d as BAD and using %6.3f.", new_val, i, sensors_prv[i] );
-                log_message(LOG_FILE, msg);
+        if ( sensor_auto_id[i][0] ) n += sprintf( buf+n, "%d=%s\n", i, sensor_auto_id[i] );
+    }
+    WriteWholeFile( SENSOR_MAP_FILE, O_TRUNC, buf, n );
+}
+
+/* Is probe id what a sensor other than i is set to? */
+short
+W1IdTaken( const char *id, short i ) {
+    short j;
+
+    for (j=1;j<=TOTALSENSORS;j++) {
+        if ( j == i ) continue;
+        /* set by ID, or by a path with the ID in it */
+        if ( strstr( sensor_roles[j], id ) ) return 1;
+        if ( (strcmp( sensor_roles[j], "auto" ) == 0) && (strcmp( sensor_auto_id[j], id ) == 0) ) return 1;
+    }
+    return 0;
+}
+
+/* Work out the file of each sensor - from config, and for "auto" ones from the probes on the bus;
+returns 1 if any changed */
+short
+MapSensors() {
+    static char ids[W1_MAX_DEVICES][W1_ID_LEN];
+    char path[MAXLEN], msg[200];
+    const char *id;
+    short i, k, n = -1, changed = 0, assigned = 0;
+
+    for (i=1;i<=TOTALSENSORS;i++) {
+        id = sensor_roles[i];
+        if ( strcmp( id, "auto" ) == 0 ) {
+            if ( !sensor_map_read ) ReadSensorMap();
+            if ( n < 0 ) n = ScanW1( ids );
+            for (k=0;k<n;k++) if ( strcmp( ids[k], sensor_auto_id[i] ) == 0 ) break;
+            if ( k == n ) {
+                /* its probe is not on the bus - take a free one, if there is one */
+                for (k=0;k<n;k++) if ( !W1IdTaken( ids[k], i ) ) break;
+                if ( k < n ) {
+                    if ( sensor_auto_id[i][0] ) {
+                        sprintf( msg, "WARNING: Sensor %d probe %s is gone - using new probe %s instead.", i,
+                        sensor_auto_id[i], ids[k] );
+                    }
+                    else sprintf( msg, "WARNING: Sensor %d set to probe %s found on the bus - check it is the right one.", i, ids[k] );
+                    log_message(LOG_FILE, msg);
+                    strcpy( sensor_auto_id[i], ids[k] );
+                    sensor_new[i] = 1;
+                    memset( &sampler[i], 0, sizeof sampler[i] );
+                    assigned = 1;
+                }
+            }
+            id = sensor_auto_id[i];
+        }
+        if ( (id[0] == '/') || !id[0] ) snprintf( path, MAXLEN, "%s", id );
+        else snprintf( path, MAXLEN, W1_DEVICES "/%s/w1_slave", id );
+        if ( strcmp( path, sensor_path[i] ) ) {
+            strcpy( sensor_path[i], path );
+            changed = 1;
+        }
+    }
+    if ( assigned ) WriteSensorMap();
+    if ( changed ) CloseCachedFiles();
+    return changed;
+}
+
+/* Listen to the kernel's device add and remove reports (as udev does) to learn of 1-wire probes
+plugged in or out */
+void
+StartW1Hotplug() {
+    struct sockaddr_nl nl;
+    char msg[150];
+    int fd;
+
+    memset( &nl, 0, sizeof nl );
+    nl.nl_family = AF_NETLINK;
+    nl.nl_groups = 1;
+    fd = socket( AF_NETLINK, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT );
+    if ( (fd == -1) || bind( fd, (struct sockaddr *)&nl, sizeof nl ) ) {
+        sprintf( msg, "INFO: No device reports from the kernel (errno %d) - missing \"auto\" sensors are looked for "\
+        "every %d cycles.", errno, W1_RESCAN_CYCLES );
+        log_message(LOG_FILE, msg);
+        if ( fd != -1 ) close( fd );
+        return;
+    }
+    w1_uevent_fd = fd;
+}
+
+/* Take the kernel's device reports, and look for probes if some 1-wire device came or went */
+void
+W1Hotplug() {
+    char buf[512];
+    ssize_t n;
+
+    if ( w1_uevent_fd != -1 ) {
+        while ( (n = recv( w1_uevent_fd, buf, sizeof(buf)-1, MSG_DONTWAIT )) > 0 ) {
+            buf[n] = 0;
+            /* starts with action@devpath, like add@/devices/w1_bus_master1/28-041464764cff */
+            if ( strstr( buf, "/w1_bus_master" ) ) w1_rescan = 1;
+        }
+    }
+    if ( !w1_rescan || (ProgramRunCycles - w1_last_scan < W1_RESCAN_CYCLES) ) return;
+    w1_rescan = 0;
+    if ( MapSensors() ) SetSensorResolutions();
+}
+
+void
+ReadSensors() {
+    float new_val = 0;
+    short status;
+    int i;
+    long took;
+    unsigned long gap;
+    struct timespec before, after;
+    char msg[100];
+    short due[TOTALSENSORS+1], batch[TOTALSENSORS+1], batch_status[TOTALSENSORS+1];
+    float batch_temp[TOTALSENSORS+1];
+    long batch_took[TOTALSENSORS+1];
+    short batched;
+
+    for (i=1;i<=TOTALSENSORS;i++) {
+        due[i] = SensorDue(i);
+        if ( !due[i] ) sampler[i].skips++;
+        batch[i] = due[i] && !prefetch[i].done;
+    }
+    batched = SensorReadBatch( batch, batch_status, batch_temp, batch_took );
+
+    for (i=1;i<=TOTALSENSORS;i++) {
+        if ( !due[i] ) continue;
+        if ( prefetch[i].done ) {
+            prefetch[i].done = 0;
+            status = prefetch[i].status;
+            new_val = prefetch[i].temp;
+            sensor_resolution[i] = prefetch[i].resolution;
+            took = prefetch[i].took;
+        }
+        else if ( batched ) {
+            status = batch_status[i];
+            new_val = batch_temp[i];
+            took = batch_took[i];
+        }
+        else {
+            clock_gettime( CLOCK_MONOTONIC, &before );
+            status = sensorRead(sensor_paths[i], &new_val, &sensor_resolution[i]);
+            clock_gettime( CLOCK_MONOTONIC, &after );
+            took = (after.tv_sec - before.tv_sec)*1000 + (after.tv_nsec - before.tv_nsec)/1000000;
+        }
+        FlightSensor( i, new_val, status, took );
+        if ( took > SensorReadBudget( sensor_resolution[i] ) ) {
+            sensor_slow_reads[i]++;
+            sprintf( msg, "WARNING: Sensor %d read took %ld ms, expected up to %ld ms at %d bit.", i, took,
+            SensorReadBudget( sensor_resolution[i] ), sensor_resolution[i] );
+            log_limited(LOGC_SENSOR_SLOW, i, took, msg);
+        }
+        /* 85 C right after a reading close to it is real, not a sensor which lost power */
+        if ( (status == SENSOR_POWER_ON) && !just_started && (sensors[i] > 83) && (sensors[i] < 87) ) status = SENSOR_OK;
+        if ( status == SENSOR_OK ) {
+            if (sensor_read_errors[i]) sensor_read_errors[i]--;
+            if (just_started || sensor_new[i]) { sensors_prv[i] = new_val; sensors[i] = new_val; sensor_new[i] = 0; }
+            if (new_val < (sensors_prv[i]-(2*MAX_TEMP_DIFF))) {
+                sprintf( msg, "WARNING: Counting %6.3f for sensor %d as BAD and using %6.3f.", new_val, i, sensors_prv[i] );
+                log_limited(LOGC_SENSOR_BAD, i, new_val, msg);
                 new_val = sensors_prv[i];
                 sensor_read_errors[i]++;
             }
             if (new_val > (sensors_prv[i]+(2*MAX_TEMP_DIFF))) {
                 sprintf( msg, "WARNING: Counting %6.3f for sensor %d as BAD and using %6.3f.", new_val, i, sensors_prv[i] );
-                log_message(LOG_FILE, msg);
+                log_limited(LOGC_SENSOR_BAD, i, new_val, msg);
                 new_val = sensors_prv[i];
                 sensor_read_errors[i]++;
             }
             if (new_val < (sensors_prv[i]-MAX_TEMP_DIFF)) {
                 sprintf( msg, "WARNING: Correcting LOW %6.3f for sensor %d with %6.3f.", new_val, i, sensors_prv[i]-MAX_TEMP_DIFF );
-                log_message(LOG_FILE, msg);
+                log_limited(LOGC_SENSOR_LOW, i, new_val, msg);
                 new_val = sensors_prv[i]-MAX_TEMP_DIFF;
             }
             if (new_val > (sensors_prv[i]+MAX_TEMP_DIFF)) {
                 sprintf( msg, "WARNING: Correcting HIGH %6.3f for sensor %d with %6.3f.", new_val, i, sensors_prv[i]+MAX_TEMP_DIFF );
-                log_message(LOG_FILE, msg);
+                log_limited(LOGC_SENSOR_HIGH, i, new_val, msg);
                 new_val = sensors_prv[i]+MAX_TEMP_DIFF;
             }
-            sensors_prv[i] = sensors[i];
+            /* Prev is one cycle back - for a sensor not read for a few cycles, take its last change
+            as spread evenly over them */
+            gap = ProgramRunCycles - sampler[i].last_cycle;
+            if ( sampler[i].reads && (gap > 1) ) sensors_prv[i] = new_val - (new_val - sensors[i]) / gap;
+            else sensors_prv[i] = sensors[i];
             sensors[i] = new_val;
+            SensorSampled( i, new_val );
+            if ( sensor_fault[i] ) {
+                LogEvent( EV_INFO, EV_SENSOR_OK, i, new_val, 0, 0 );
+                sensor_fault[i] = SENSOR_OK;
+            }
         }
         else {
             sensor_read_errors[i]++;
-            sprintf( msg, "WARNING: Sensor %d ReadSensors() errors++. Counter at %d.", i, sensor_read_errors[i] );
-            log_message(LOG_FILE, msg);
+            sensor_errors[i][status]++;
+            if ( (status == SENSOR_NO_FILE) && (strcmp( sensor_roles[i], "auto" ) == 0) ) w1_rescan = 1;
+            if ( !sensor_fault[i] ) LogEvent( EV_WARNING, EV_SENSOR_FAULT, i, status, sensor_read_errors[i], 0 );
+            sensor_fault[i] = status;
+            sprintf( msg, "WARNING: Sensor %d read failed: %s. Counter at %d.", i, sensor_status_names[status], sensor_read_errors[i] );
+            log_limited(LOGC_SENSOR_FAILED, i, 0, msg);
         }
     }
     /* Allow for maximum of 6 consecutive 10 second intervals of missing sensor data
@@ -947,193 +3476,2470 @@ ReadSensors() {
         if (sensor_read_errors[i]>5) {
             /* log the errors, clean up and bail out */
             log_message(LOG_FILE, "ALARM: Too many sensor read errors! Stopping.");
+            LogEvent( EV_ALARM, EV_SENSOR_STOP, i, sensor_read_errors[i], 0, 0 );
             if ( ! DisableGPIOpins() ) {
                 log_message(LOG_FILE, "ALARM: GPIO disable failed on handling sensor read failures.");
+                FlightDump( "sensor read errors, GPIO disable failed" );
                 exit(66);
             }
-            exit(55);
+            FlightDump( "sensor read errors" );
+            exit(55);
+        }
+    }
+}
+
+/* Read cfg.bat_powered_pin into CPowerByBattery which should be 
+set to 1 if the external power is generated by UPS */
+void
+ReadExternalPower() {
+    CPowerByBatteryPrev = CPowerByBattery;
+    CPowerByBattery = GPIORead(cfg.bat_powered_pin);
+}
+
+/* Put cfg.safe_relay_state in controls[] - what the relays start with when there is no state to resume */
+void
+SafeRelayState() {
+    CPump1 = (cfg.safe_relay_state & 1) ? 1 : 0;
+    CPump2 = (cfg.safe_relay_state & 2) ? 1 : 0;
+    CValve = (cfg.safe_relay_state & 4) ? 1 : 0;
+    CHeater = (cfg.safe_relay_state & 8) ? 1 : 0;
+    CHeatPump = ((cfg.safe_relay_state & 16) && cfg.use_heat_pump) ? 1 : 0;
+}
+
+void
+write_log_start() {
+    char start_log_text[80];
+
+    log_message(LOG_FILE,"INFO: solard "PGMVER" now starting up...");
+    log_message(LOG_FILE,"Running in "RUNNING_DIR", config file "CONFIG_FILE", rules file "RULES_FILE );
+    log_message(LOG_FILE,"PID written to "LOCK_FILE", writing CSV data to "DATA_FILE );
+    log_message(LOG_FILE,"Writing table data for collectd to "TABLE_FILE", JSON data to "JSON_FILE );
+    log_message(LOG_FILE,"If enabled, InfluxDB lines to "INFLUX_FILE", collectd PUTVAL lines to "PUTVAL_FILE );
+    log_message(LOG_FILE,"Power used persistence file "POWER_FILE", daily energy ledger "LEDGER_FILE );
+    log_message(LOG_FILE,"Writing relay statistics to "STATS_FILE );
+    sprintf( start_log_text, "Powers: heater=%3.1f W, pump1=%3.1f W, pump2=%3.1f W",
+    HEATERPPC*(6*60)/1000.0, PUMP1PPC*(6*60)/1000.0, PUMP2PPC*(6*60)/1000.0 );
+    log_message(LOG_FILE, start_log_text );
+    sprintf( start_log_text, "Powers: valve=%3.1f W, self=%3.1f W",
+    VALVEPPC*(6*60)/1000.0, SELFPPC*(6*60)/1000.0 );
+    log_message(LOG_FILE, start_log_text );
+}
+
+/* Output schema and serializer.
+Every value solard exports is described once in a field table - its names, type and where it lives.
+WriteOutputs() goes over a table once, formats each value once, and hands it to every enabled
+emitter, each of which appends it in its own format to its own bounded buffer. A new output format
+only needs a new emitter. */
+
+/* field types */
+#define FT_SHORT        0
+#define FT_USHORT       1
+#define FT_INT          2
+#define FT_FLOAT        3       /* with 3 decimals */
+#define FT_MILLI        4       /* unsigned long long thousandths, shown with 3 decimals */
+
+/* field flags */
+#define FF_GROUP        1       /* CSV: starts a group of values (", " before it) */
+#define FF_TEMP         2       /* a temperature (collectd type) */
+
+struct field_struct
+{
+    const char  *key;           /* JSON, InfluxDB and collectd name; NULL - CSV only */
+    const char  *table_key;     /* TABLE_FILE name; NULL - not in TABLE_FILE */
+    short       type;           /* FT_* */
+    const void  *value;
+    short       width;          /* CSV: padded with spaces to this many chars */
+    short       flags;          /* FF_* */
+};
+
+/* bounded output buffer - what does not fit is left out, and over is set */
+struct outbuf_struct
+{
+    char        data[2048];
+    short       len;
+    short       over;
+};
+
+/* output formats */
+#define OUT_CSV         0
+#define OUT_TABLE       1
+#define OUT_JSON        2
+#define OUT_INFLUX      3
+#define OUT_PUTVAL      4
+#define OUT_FORMATS     5
+
+struct emitter_struct
+{
+    /* value is the formatted value, n is the number of the field in the table */
+    void        (*field)( struct outbuf_struct *b, const struct field_struct *f, const char *value, short n );
+    void        (*end)( struct outbuf_struct *b );
+};
+
+/* HeatingMode of the cycle being logged - LogData() gets it as a parameter */
+short logged_heating_mode = 0;
+
+/* every value written to DATA_FILE (in this order), TABLE_FILE, JSON_FILE and the optional
+InfluxDB and collectd files */
+static const struct field_struct data_fields[] = {
+    { NULL,                 NULL,               FT_USHORT,  &current_timer_hour,    2, 0 },
+    { "Tkotel",             "Temp1",            FT_FLOAT,   &Tkotel,                6, FF_GROUP|FF_TEMP },
+    { "Tkolektor",          "Temp2",            FT_FLOAT,   &Tkolektor,             6, FF_TEMP },
+    { "TboilerL",           "Temp4",            FT_FLOAT,   &TboilerLow,            6, FF_TEMP },
+    { "TboilerH",           "Temp3",            FT_FLOAT,   &TboilerHigh,           6, FF_TEMP },
+    { "TempWanted",         "TempWanted",       FT_INT,     &cfg.wanted_T,          2, FF_GROUP|FF_TEMP },
+    { "BoilerTabsMax",      "BoilerTabsMax",    FT_INT,     &cfg.abs_max,           2, FF_TEMP },
+    { NULL,                 NULL,               FT_INT,     &cfg.night_boost,       1, 0 },
+    { NULL,                 NULL,               FT_SHORT,   &logged_heating_mode,   2, 0 },
+    { "PumpFurnace",        "Pump1",            FT_SHORT,   &CPump1,                1, FF_GROUP },
+    { "PumpSolar",          "Pump2",            FT_SHORT,   &CPump2,                1, 0 },
+    { "Valve",              "Valve",            FT_SHORT,   &CValve,                1, 0 },
+    { "Heater",             "Heater",           FT_SHORT,   &CHeater,               1, 0 },
+    { "PoweredByBattery",   "PoweredByBattery", FT_SHORT,   &CPowerByBattery,       1, 0 },
+    { "ElectricityUsed",    "ElectricityUsed",  FT_MILLI,   &TotalEnergyUsed,       5, FF_GROUP },
+    { "ElectricityUsedNT",  "ElectricityUsedNT",FT_MILLI,   &NightlyEnergyUsed,     5, 0 },
+    { "HeatSolarToday",     "HeatSolarToday",   FT_MILLI,   &heat_today[HEAT_SOLAR],   5, FF_GROUP },
+    { "HeatFurnaceToday",   "HeatFurnaceToday", FT_MILLI,   &heat_today[HEAT_FURNACE], 5, 0 },
+    { "HeatHeaterToday",    "HeatHeaterToday",  FT_MILLI,   &heat_today[HEAT_HEATER],  5, 0 },
+    { "HeatSolarMonth",     "HeatSolarMonth",   FT_MILLI,   &heat_month[HEAT_SOLAR],   5, 0 },
+    { "HeatFurnaceMonth",   "HeatFurnaceMonth", FT_MILLI,   &heat_month[HEAT_FURNACE], 5, 0 },
+    { "HeatHeaterMonth",    "HeatHeaterMonth",  FT_MILLI,   &heat_month[HEAT_HEATER],  5, 0 },
+    { "HeatPump",           "HeatPump",         FT_SHORT,   &CHeatPump,             1, FF_GROUP },
+    { "HeatPumpCOP",        "HeatPumpCOP",      FT_FLOAT,   &heat_pump_cop,         6, 0 },
+    { "HeatHeatPumpToday",  "HeatHeatPumpToday",FT_MILLI,   &heat_today[HEAT_HEATPUMP], 5, 0 },
+    { "HeatHeatPumpMonth",  "HeatHeatPumpMonth",FT_MILLI,   &heat_month[HEAT_HEATPUMP], 5, 0 },
+};
+
+/* config values written to CFG_TABLE_FILE */
+static const struct field_struct cfg_fields[] = {
+    { "mode",               "mode",             FT_INT,     &cfg.mode,              0, 0 },
+    { "wanted_T",           "Tboiler_wanted",   FT_INT,     &cfg.wanted_T,          0, 0 },
+    { "use_electric_heater_night", "elh_nt",    FT_INT,     &cfg.use_electric_heater_night, 0, 0 },
+    { "use_electric_heater_day", "elh_dt",      FT_INT,     &cfg.use_electric_heater_day, 0, 0 },
+    { "pump1_always_on",    "p1_always_on",     FT_INT,     &cfg.pump1_always_on,   0, 0 },
+    { "use_pump1",          "use_p1",           FT_INT,     &cfg.use_pump1,         0, 0 },
+    { "use_pump2",          "use_p2",           FT_INT,     &cfg.use_pump2,         0, 0 },
+    { "day_to_reset_Pcounters", "Pcounters_rst_day", FT_INT, &cfg.day_to_reset_Pcounters, 0, 0 },
+    { "night_boost",        "use_night_boost",  FT_INT,     &cfg.night_boost,       0, 0 },
+    { "abs_max",            "Tboiler_absMax",   FT_INT,     &cfg.abs_max,           0, 0 },
+};
+
+#define FIELDS(a)       ((short)(sizeof(a) / sizeof(a[0])))
+
+void
+OutPut( struct outbuf_struct *b, const char *s, short n ) {
+    if ( b->len + n >= (short)sizeof(b->data) ) {
+        b->over = 1;
+        return;
+    }
+    memcpy( b->data + b->len, s, n );
+    b->len += n;
+    b->data[b->len] = 0;
+}
+
+#define OutStr(b,s)     OutPut( (b), (s), strlen(s) )
+
+/* Puts v in s with decimals (0 or 3) digits after the point, rounding halves to even like printf()
+does; returns the length */
+short
+FormatNumber( char *s, long long v, short decimals ) {
+    char digits[24];
+    short n = 0, len = 0;
+    unsigned long long u = ( v < 0 ) ? -(unsigned long long)v : (unsigned long long)v;
+
+    do {
+        digits[n++] = '0' + (u % 10);
+        u /= 10;
+        if ( n == decimals ) digits[n++] = '.';
+    } while ( u || (n <= decimals + (decimals > 0)) );
+    if ( v < 0 ) s[len++] = '-';
+    while ( n ) s[len++] = digits[--n];
+    s[len] = 0;
+    return len;
+}
+
+/* Formats the value of f into s; returns the length */
+short
+FormatField( char *s, const struct field_struct *f ) {
+    double scaled;
+    long long whole;
+
+    switch ( f->type ) {
+        case FT_SHORT:  return FormatNumber( s, *(const short *)f->value, 0 );
+        case FT_USHORT: return FormatNumber( s, *(const unsigned short *)f->value, 0 );
+        case FT_INT:    return FormatNumber( s, *(const int *)f->value, 0 );
+        case FT_MILLI:  return FormatNumber( s, (long long)*(const unsigned long long *)f->value, 3 );
+        case FT_FLOAT:
+        scaled = *(const float *)f->value * 1000.0;
+        whole = (long long)scaled;
+        scaled -= whole;
+        if ( scaled < 0 ) scaled = -scaled;
+        if ( (scaled > 0.5) || ((scaled == 0.5) && (whole & 1)) ) whole += ( *(const float *)f->value < 0 ) ? -1 : 1;
+        return FormatNumber( s, whole, 3 );
+    }
+    s[0] = 0;
+    return 0;
+}
+
+/* DATA_FILE: "19, 52.500,61.250,38.500,44.000, 50,70,0,35, 1,1,0,0,0, 9.434,0.000" */
+void
+EmitCSV( struct outbuf_struct *b, const struct field_struct *f, const char *value, short n ) {
+    static const char spaces[] = "        ";
+    short pad = f->width - strlen( value );
+
+    if ( n ) OutStr( b, (f->flags & FF_GROUP) ? ", " : "," );
+    if ( pad > 0 ) OutPut( b, spaces, (pad < 8) ? pad : 8 );
+    OutStr( b, value );
+}
+
+/* TABLE_FILE (after the timestamp): ",Temp1,52.500\n_,Temp2,61.250..." */
+void
+EmitTable( struct outbuf_struct *b, const struct field_struct *f, const char *value, short n ) {
+    if ( !f->table_key ) return;
+    OutStr( b, b->len ? "\n_," : "," );
+    OutStr( b, f->table_key );
+    OutStr( b, "," );
+    OutStr( b, value );
+}
+
+/* JSON_FILE: {"Tkotel":52.500,"Tkolektor":61.250...} */
+void
+EmitJSON( struct outbuf_struct *b, const struct field_struct *f, const char *value, short n ) {
+    if ( !f->key ) return;
+    OutStr( b, b->len ? ",\"" : "{\"" );
+    OutStr( b, f->key );
+    OutStr( b, "\":" );
+    OutStr( b, value );
+}
+
+void
+EmitJSONEnd( struct outbuf_struct *b ) {
+    OutStr( b, b->len ? "}" : "{}" );
+}
+
+/* InfluxDB line protocol: "solard Tkotel=52.500,...,PumpFurnace=1i,..." - the timestamp is added
+at the end */
+void
+EmitInflux( struct outbuf_struct *b, const struct field_struct *f, const char *value, short n ) {
+    if ( !f->key ) return;
+    OutStr( b, b->len ? "," : "solard " );
+    OutStr( b, f->key );
+    OutStr( b, "=" );
+    OutStr( b, value );
+    if ( (f->type != FT_FLOAT) && (f->type != FT_MILLI) ) OutStr( b, "i" );
+}
+
+void
+EmitInfluxEnd( struct outbuf_struct *b ) {
+    char s[24];
+
+    if ( !b->len ) return;
+    OutStr( b, " " );
+    OutPut( b, s, FormatNumber( s, (long long)time(NULL), 0 ) );
+    OutStr( b, "000000000\n" );
+}
+
+/* collectd exec plugin: 'PUTVAL "host/solard/temperature-Tkotel" interval=10 N:52.500' lines */
+void
+EmitPutval( struct outbuf_struct *b, const struct field_struct *f, const char *value, short n ) {
+    static char host[64] = "";
+
+    if ( !f->key ) return;
+    if ( !host[0] && gethostname( host, sizeof(host)-1 ) ) strcpy( host, "localhost" );
+    OutStr( b, "PUTVAL \"" );
+    OutStr( b, host );
+    OutStr( b, (f->flags & FF_TEMP) ? "/solard/temperature-" : "/solard/gauge-" );
+    OutStr( b, f->key );
+    OutStr( b, "\" interval=10 N:" );
+    OutStr( b, value );
+    OutStr( b, "\n" );
+}
+
+static const struct emitter_struct emitters[OUT_FORMATS] = {
+    { EmitCSV,      NULL },
+    { EmitTable,    NULL },
+    { EmitJSON,     EmitJSONEnd },
+    { EmitInflux,   EmitInfluxEnd },
+    { EmitPutval,   NULL },
+};
+
+/* One pass over fields: every value is formatted once and given to the emitters whose bits are set
+in formats; the results are in out[] */
+void
+WriteOutputs( const struct field_struct *fields, short n_fields, unsigned short formats,
+              struct outbuf_struct *out ) {
+    char value[32];
+    short i, j;
+
+    for (j=0;j<OUT_FORMATS;j++) {
+        out[j].len = 0;
+        out[j].over = 0;
+        out[j].data[0] = 0;
+    }
+    for (i=0;i<n_fields;i++) {
+        FormatField( value, &fields[i] );
+        for (j=0;j<OUT_FORMATS;j++) {
+            if ( formats & (1 << j) ) emitters[j].field( &out[j], &fields[i], value, i );
+        }
+    }
+    for (j=0;j<OUT_FORMATS;j++) {
+        if ( (formats & (1 << j)) && emitters[j].end ) emitters[j].end( &out[j] );
+        if ( out[j].over ) log_message(LOG_FILE, "WARNING: Output line too long - truncated.");
+    }
+}
+
+/* Function to log currently used config in TABLE_FILE format. The idea is that this file will be made
+available to a web app, which will fetch it once in a while to get current working config for solard
+without the need for root access (necessary to read /etc/solard.cfg), so relevant data could be shown.
+This function should be called less often, e.g. once every 5 minutes or something... */
+void
+ReWrite_CFG_TABLE_FILE() {
+    static struct outbuf_struct out[OUT_FORMATS];
+
+    WriteOutputs( cfg_fields, FIELDS(cfg_fields), 1 << OUT_TABLE, out );
+    log_msg_ovr(CFG_TABLE_FILE, out[OUT_TABLE].data);
+}
+
+/* Function to look up this minute in the schedule, building the schedule when the minute is not
+in it; the time of day variables and the seasonal night tariff hours come from the entry */
+void
+ScheduleNow() {
+    char buff[220];
+    char from[12], to[12];
+    time_t t = time(NULL);
+    const struct sched_minute *e = ScheduleAt( &schedule, t );
+    long i, night = 0, away = 0, exercise = 0;
+
+    if ( e == NULL ) {
+        BuildSchedule( &schedule, &sched_cfg, t );
+        e = ScheduleAt( &schedule, t );
+        if ( e == NULL ) e = &schedule.m[0];
+        for (i=0;i<schedule.minutes;i++) {
+            night += schedule.m[i].flags & SCHED_NIGHT;
+            away += (schedule.m[i].flags & SCHED_AWAY) != 0;
+            exercise += (schedule.m[i].flags & SCHED_EXERCISE) != 0;
+        }
+        t = schedule.start;
+        strftime( from, sizeof from, "%F", localtime( &t ) );
+        t = schedule.start + (schedule.minutes-1)*60;
+        strftime( to, sizeof to, "%F", localtime( &t ) );
+        snprintf( buff, sizeof buff, "INFO: Schedule for %s..%s built: night tariff %ld h %ld min, away %ld h, solar pump "\
+        "exercise %ld min.", from, to, night/60, night%60, away/60, exercise );
+        log_message(LOG_FILE, buff);
+    }
+    sched_now = e;
+    current_timer_hour = e->hour;
+    current_month = e->month;
+    now_is_winter = (e->flags & SCHED_WINTER) != 0;
+    if ( (NEstart != e->nestart) || (NEstop != e->nestop) ) {
+        NEstart = e->nestart;
+        NEstop = e->nestop;
+        sprintf( buff, "INFO: Adjusted night energy hours, start %.2hu:00,"\
+        " stop %.2hu:59.", NEstart, NEstop );
+        log_message(LOG_FILE, buff);
+    }
+}
+
+/* Function for the time keeping done every few minutes: the monthly power counters reset and
+the day change */
+void
+GetCurrentTime() {
+    static char buff[80];
+    char msg[200];
+    time_t t;
+    struct tm *t_struct;
+    unsigned short current_day_of_month = 0;
+	
+	ReWrite_CFG_TABLE_FILE();
+	ReWrite_STATS_FILE();
+
+    t = time(NULL);
+    t_struct = localtime( &t );
+
+    /* among other things - manage power used counters; only check one
+    time during the day: at 8'something...*/
+    if ((current_timer_hour == 8) && ((ProgramRunCycles % (6*60)) == 0)) {
+        strftime( buff, sizeof buff, "%e", t_struct );
+        current_day_of_month = atoi( buff );
+        if (current_day_of_month == cfg.day_to_reset_Pcounters) {
+            /*...if it is the correct day of month - log gathered data and reset counters */
+            sprintf( buff, "INFO: Power used last month: nightly: %3.1f Wh, daily: %3.1f Wh;",
+            NightlyPowerUsed, (TotalPowerUsed-NightlyPowerUsed) );
+            log_message(LOG_FILE, buff);
+            sprintf( buff, "INFO: Total: %3.1f Wh. Power counters reset.", TotalPowerUsed );
+            log_message(LOG_FILE, buff);
+            LogEvent( EV_INFO, EV_COUNTERS_RESET, 0, NightlyPowerUsed, TotalPowerUsed, 0 );
+            snprintf( msg, sizeof msg, "INFO: Heat put in the tank last month: solar: %3.1f Wh, furnace: %3.1f Wh, "\
+            "heater: %3.1f Wh, heat pump: %3.1f Wh.", (double)heat_month[HEAT_SOLAR]/1000,
+            (double)heat_month[HEAT_FURNACE]/1000, (double)heat_month[HEAT_HEATER]/1000,
+            (double)heat_month[HEAT_HEATPUMP]/1000 );
+            log_message(LOG_FILE, msg);
+            TotalEnergyUsed = 0;
+            NightlyEnergyUsed = 0;
+            memset( heat_month, 0, sizeof heat_month );
+        }
+    }
+
+    /* once the day is over - put its energy use in the ledger and start counting the new one */
+    strftime( buff, sizeof buff, "%F", t_struct );
+    if ( strcmp( buff, energy_date ) ) {
+        if ( energy_date[0] ) WriteEnergyLedger();
+        ShadowDayEnd();
+        ResetDailyEnergy( buff );
+        WritePersistentPower();
+    }
+}
+
+void
+LogData(short HM) {
+    static struct outbuf_struct out[OUT_FORMATS];
+    unsigned short formats = (1 << OUT_CSV) | (1 << OUT_TABLE) | (1 << OUT_JSON);
+
+    if ( cfg.influx_output ) formats |= 1 << OUT_INFLUX;
+    if ( cfg.collectd_output ) formats |= 1 << OUT_PUTVAL;
+    logged_heating_mode = HM;
+    WriteOutputs( data_fields, FIELDS(data_fields), formats, out );
+    log_message(DATA_FILE, out[OUT_CSV].data);
+    SsePublish( "state", out[OUT_JSON].data );
+    /* the time stamp and new line log_message() adds */
+    data_file_bytes += out[OUT_CSV].len + 21;
+    RollDataFile();
+    log_msg_ovr(TABLE_FILE, out[OUT_TABLE].data);
+    log_msg_cln(JSON_FILE, out[OUT_JSON].data);
+    if ( cfg.influx_output ) log_msg_cln(INFLUX_FILE, out[OUT_INFLUX].data);
+    if ( cfg.collectd_output ) log_msg_cln(PUTVAL_FILE, out[OUT_PUTVAL].data);
+}
+
+/* Return non-zero value on critical condition found based on current data in sensors[] */
+short
+CriticalTempsFound() {
+    return CriticalTemps( Tkotel, TboilerHigh );
+}
+
+short
+BoilerHeatingNeeded() {
+    return BoilerNeedsHeating( TboilerLow, TboilerHigh, TboilerHighPrev, cfg.wanted_T, now_is_winter );
+}
+
+/* the rule table in effect, and how many times rules were (re)loaded */
+struct rule_table rules_live;
+unsigned short rules_loads = 0;
+
+/* Compile the built-in rules into t */
+void
+CompileDefaultRules( struct rule_table *t ) {
+    char buff[300], err[100];
+    short i;
+
+    memset( t, 0, sizeof *t );
+    for (i=0;default_rules[i]!=NULL;i++) {
+        strcpy( buff, default_rules[i] );
+        if ( CompileRuleLine( t, buff, i+1, err ) ) {
+            sprintf( buff, "ALARM: Built-in heating rule %d: %s!", i+1, err );
+            log_message(LOG_FILE, buff);
+        }
+    }
+}
+
+/* Compile rules from filename into t. Returns 0 on success, -1 if the file can not be read,
+and -2 if it has errors (which get logged) */
+short
+CompileRulesFile( struct rule_table *t, const char *filename ) {
+    char buff[300], msg[200], err[100];
+    unsigned short line_no = 0;
+    short result = 0;
+    FILE *fp;
+
+    memset( t, 0, sizeof *t );
+    fp = fopen( filename, "r" );
+    if (fp == NULL) return -1;
+    while (fgets (buff, sizeof buff, fp) != NULL) {
+        line_no++;
+        trim( buff );
+        /* Skip blank lines and comments */
+        if (buff[0] == 0 || buff[0] == '#') continue;
+        if ( CompileRuleLine( t, buff, line_no, err ) ) {
+            sprintf( msg, "WARNING: Heating rules file %.60s line %d: %.60s", filename, line_no, err );
+            log_message(LOG_FILE, msg);
+            result = -2;
+        }
+    }
+    fclose (fp);
+    if ( (result == 0) && (t->n_rules == 0) ) {
+        sprintf( msg, "WARNING: Heating rules file %.60s has no rules.", filename );
+        log_message(LOG_FILE, msg);
+        result = -2;
+    }
+    return result;
+}
+
+/* (Re)load rules_live from RULES_FILE, falling back to the built-in rules */
+void
+LoadRules() {
+    static struct rule_table t;
+    static short have_rules = 0;
+    char buff[150];
+    short r;
+
+    r = CompileRulesFile( &t, RULES_FILE );
+    if ( r == 0 ) {
+        rules_live = t;
+        sprintf( buff, "INFO: Read heating rules file "RULES_FILE": %d rules, %d conditions.",
+        rules_live.n_rules, rules_live.n_conds );
+    }
+    else if ( (r == -2) && have_rules ) {
+        sprintf( buff, "WARNING: Errors in "RULES_FILE" - keeping the heating rules in effect." );
+    }
+    else {
+        CompileDefaultRules( &rules_live );
+        sprintf( buff, "INFO: Using built-in heating rules: %d rules, %d conditions.",
+        rules_live.n_rules, rules_live.n_conds );
+    }
+    have_rules = 1;
+    rules_loads++;
+    log_message(LOG_FILE, buff);
+    if ( r == -2 ) LogEvent( EV_WARNING, EV_RULES_ERROR, 0, 0, 0, 0 );
+    LoadShadowRules();
+}
+
+/* Put current values of all rule operands in ro[] */
+void
+LoadRuleOperands( double *ro ) {
+    ro[RO_ZERO] = 0;
+    ro[RO_TKOTEL] = Tkotel;
+    ro[RO_TKOLEKTOR] = Tkolektor;
+    ro[RO_TBOILERH] = TboilerHigh;
+    ro[RO_TBOILERL] = TboilerLow;
+    ro[RO_TKOTELPRV] = TkotelPrev;
+    ro[RO_TKOLEKTORPRV] = TkolektorPrev;
+    ro[RO_TBOILERHPRV] = TboilerHighPrev;
+    ro[RO_TBOILERLPRV] = TboilerLowPrev;
+    ro[RO_CPUMP1] = CPump1;
+    ro[RO_CPUMP2] = CPump2;
+    ro[RO_CVALVE] = CValve;
+    ro[RO_CHEATER] = CHeater;
+    ro[RO_CHEATPUMP] = CHeatPump;
+    ro[RO_CBATTERY] = CPowerByBattery;
+    ro[RO_SCPUMP1] = SCPump1;
+    ro[RO_SCPUMP2] = SCPump2;
+    ro[RO_SCVALVE] = SCValve;
+    ro[RO_SCHEATER] = SCHeater;
+    ro[RO_SCHEATPUMP] = SCHeatPump;
+    ro[RO_HOUR] = current_timer_hour;
+    ro[RO_MONTH] = current_month;
+    ro[RO_PUMPHOUR] = pump_start_hour_for[current_month];
+    ro[RO_NESTART] = NEstart;
+    ro[RO_NESTOP] = NEstop;
+    ro[RO_WINTER] = now_is_winter;
+    ro[RO_NIGHT] = (sched_now->flags & SCHED_NIGHT) != 0;
+    ro[RO_NIGHTLEFT] = sched_now->night_left;
+    ro[RO_AWAY] = (sched_now->flags & SCHED_AWAY) != 0;
+    ro[RO_EXERCISE] = (sched_now->flags & SCHED_EXERCISE) != 0;
+    ro[RO_HPCOP] = heat_pump_cop;
+    ro[RO_MODE] = cfg.mode;
+    ro[RO_WANTEDT] = cfg.wanted_T;
+    ro[RO_ABSMAX] = cfg.abs_max;
+    ro[RO_NIGHTBOOST] = cfg.night_boost;
+    ro[RO_P1ALWAYSON] = cfg.pump1_always_on;
+    ro[RO_NIGHTTEMP] = nightEnergyTemp;
+}
+
+/* Evaluate rule table t on current data; put HeatingMode bits asked for by "idle" rules in
+modes[RULES_IDLE], and by "heat" rules - in modes[RULES_HEAT]; returns which conditions hold */
+unsigned long long
+EvaluateRules( const struct rule_table *t, unsigned short *modes ) {
+    double ro[RO_COUNT];
+
+    LoadRuleOperands( ro );
+    return EvaluateRuleTable( t, ro, modes );
+}
+
+/* Flight recorder: an always-on ring of the last cfg.flight_cycles cycles in full detail - the
+raw and filtered sensor values with their read status and time, the HeatingMode decided and the
+one left after AdjustHeatingModeForBatteryPower(), relay states and cycles in them, and which
+rule conditions held. It is dumped to FLIGHT_FILE.<date-time> when emergency cooling starts,
+before exit on too many sensor errors, on a fatal signal, and on POST /flight-dump to the live
+stream socket. Which rules set each bit is worked out at dump time from the conditions. */
+struct flight_sensor_struct {
+    float           raw;            /* as read, before corrections */
+    float           value;          /* as used */
+    short           status;         /* SENSOR_*, -1 if not read this cycle */
+    short           took;           /* ms */
+};
+
+struct flight_struct {
+    unsigned long   cycle;
+    time_t          time;
+    struct flight_sensor_struct s[TOTALSENSORS+1];
+    unsigned long long conds;       /* rule conditions which held */
+    unsigned short  rules_loaded;   /* rules_loads when recorded */
+    unsigned char   groups;         /* rule groups evaluated: 1 idle, 2 heat */
+    unsigned char   done;           /* cycle completed */
+    unsigned short  mode;           /* HeatingMode decided */
+    unsigned short  mode_used;      /* after AdjustHeatingModeForBatteryPower() */
+    short           controls[TOTALRELAYS+2];
+    long            states[TOTALRELAYS+1];
+};
+
+struct flight_struct flight[FLIGHT_MAX];
+struct flight_struct *flight_now = NULL;
+unsigned long flight_head = 0;
+unsigned long flight_count = 0;
+unsigned long flight_last_dump = 0;
+short flight_size = 0;
+const char *flight_dump_reason = NULL;
+
+/* Start recording a cycle; the oldest one is dropped */
+void
+FlightBegin() {
+    short i;
+
+    if ( flight_size != cfg.flight_cycles ) {
+        flight_size = cfg.flight_cycles;
+        flight_head = flight_count = 0;
+    }
+    if ( !flight_size ) { flight_now = NULL; return; }
+    flight_now = &flight[flight_head];
+    flight_head = (flight_head + 1) % flight_size;
+    if ( flight_count < flight_size ) flight_count++;
+    flight_now->cycle = ProgramRunCycles;
+    flight_now->time = time( NULL );
+    for (i=1;i<=TOTALSENSORS;i++) flight_now->s[i].status = -1;
+    flight_now->groups = flight_now->done = 0;
+    flight_now->mode = flight_now->mode_used = 0;
+}
+
+void
+FlightSensor( short i, float raw, short status, long took ) {
+    if ( !flight_now ) return;
+    flight_now->s[i].raw = ( (status == SENSOR_OK) || (status == SENSOR_POWER_ON) ) ? raw : 0;
+    flight_now->s[i].status = status;
+    flight_now->s[i].took = ( took > 32767 ) ? 32767 : took;
+}
+
+void
+FlightRules( unsigned long long conds, unsigned char groups ) {
+    if ( !flight_now ) return;
+    flight_now->conds = conds;
+    flight_now->groups = groups;
+    flight_now->rules_loaded = rules_loads;
+}
+
+/* Finish recording the cycle with what it decided and did */
+void
+FlightEnd( unsigned short mode, unsigned short mode_used ) {
+    short i;
+
+    if ( !flight_now ) return;
+    for (i=1;i<=TOTALSENSORS;i++) flight_now->s[i].value = sensors[i];
+    flight_now->mode = mode;
+    flight_now->mode_used = mode_used;
+    for (i=1;i<=TOTALRELAYS+1;i++) flight_now->controls[i] = controls[i];
+    for (i=1;i<=TOTALRELAYS;i++) flight_now->states[i] = ctrlstatecycles[i];
+    flight_now->done = 1;
+}
+
+/* Write which rules of the ones in effect set each HeatingMode bit in f, e.g. "P1:2/5 P2:6" */
+void
+FlightRuleHits( const struct flight_struct *f, char *buf, size_t len ) {
+    static const char *outputs[] = { "P1", "P2", "V", "H" };
+    const struct rule *r;
+    size_t n = 0;
+    short b, i, any;
+
+    buf[0] = 0;
+    if ( !f->groups ) return;
+    if ( f->rules_loaded != rules_loads ) { snprintf( buf, len, "rules reloaded since" ); return; }
+    for (b=0;b<4;b++) {
+        for (i=0, any=0; i<rules_live.n_rules; i++) {
+            r = &rules_live.rules[i];
+            if ( !(r->bits & (1 << b)) || !(f->groups & (1 << r->group)) ) continue;
+            if ( (f->conds & r->need) != r->need ) continue;
+            if ( any ) n += snprintf( buf+n, len-n, "/%d", r->line );
+            else n += snprintf( buf+n, len-n, "%s%s:%d", n ? " " : "", outputs[b], r->line );
+            if ( n >= len ) return;
+            any = 1;
+        }
+    }
+}
+
+/* Write the recorded cycles, oldest first, to a new FLIGHT_FILE.<date-time>. It also runs from the
+fatal signal handler, so lines are formatted with snprintf() into a static buffer (no stdio streams,
+no allocation) and put out with write(); there, where the crash may have come from inside the C
+library with one of its locks held, the file is named by the epoch time instead of localtime_r()
+(which takes the time zone lock), and the INFO line is not logged (log_message() uses localtime()). */
+void
+FlightDump( const char *reason ) {
+    static char buf[8192];
+    char name[sizeof(FLIGHT_FILE) + 20], stamp[20], hits[100], msg[200];
+    const struct flight_struct *f;
+    struct tm tm;
+    time_t now;
+    unsigned long k;
+    size_t n = 0;
+    short i;
+    int fd;
+
+    if ( !flight_count ) return;
+    now = time( NULL );
+    if ( in_signal_handler ) snprintf( stamp, sizeof stamp, "%lld", (long long)now );
+    else {
+        localtime_r( &now, &tm );
+        strftime( stamp, sizeof stamp, "%Y%m%d-%H%M%S", &tm );
+    }
+    snprintf( name, sizeof name, "%s.%s", FLIGHT_FILE, stamp );
+    fd = open( name, O_CREAT|O_WRONLY|O_TRUNC|O_CLOEXEC, 0644 );
+    if ( fd == -1 ) return;
+    n += snprintf( buf+n, sizeof(buf)-n, "# solard "PGMVER" flight recorder, %lu cycles, dumped at %s: %s\n"\
+    "# sensor columns: raw value as read, value used, read status (-1 not read), read ms\n"\
+    "# mode: HeatingMode decided, used: after battery power adjustment, rules: rule lines asking for each output\n"\
+    "cycle,time,done,S1raw,S1,S1st,S1ms,S2raw,S2,S2st,S2ms,S3raw,S3,S3st,S3ms,S4raw,S4,S4st,S4ms,"\
+    "mode,used,CPump1,CPump2,CValve,CHeater,CHeatPump,CPowerByBattery,SCPump1,SCPump2,SCValve,SCHeater,SCHeatPump,"\
+    "conds,rules\n",
+    flight_count, stamp, reason );
+    for (k=0;k<flight_count;k++) {
+        f = &flight[(flight_head + flight_size - flight_count + k) % flight_size];
+        n += snprintf( buf+n, sizeof(buf)-n, "%lu,%lld,%d", f->cycle, (long long)f->time, f->done );
+        for (i=1;i<=TOTALSENSORS;i++) {
+            n += snprintf( buf+n, sizeof(buf)-n, ",%.3f,%.3f,%d,%d", f->s[i].raw, f->s[i].value, f->s[i].status,
+            f->s[i].took );
+        }
+        FlightRuleHits( f, hits, sizeof hits );
+        n += snprintf( buf+n, sizeof(buf)-n, ",%u,%u,%d,%d,%d,%d,%d,%d,%ld,%ld,%ld,%ld,%ld,%llx,%s\n", f->mode,
+        f->mode_used, f->controls[1], f->controls[2], f->controls[3], f->controls[4], f->controls[5], f->controls[6],
+        f->states[1], f->states[2], f->states[3], f->states[4], f->states[5], f->conds, hits );
+        if ( (n > sizeof(buf) - 512) || (k == flight_count-1) ) {
+            write( fd, buf, n );
+            n = 0;
+        }
+    }
+    fsync( fd );
+    close( fd );
+    flight_last_dump = ProgramRunCycles;
+    if ( in_signal_handler ) return;
+    snprintf( msg, sizeof msg, "INFO: Flight recorder: last %lu cycles written to %s (%s).", flight_count, name, reason );
+    log_message(LOG_FILE, msg);
+}
+
+/* Dump the flight recorder at the end of a cycle if that was asked for; requests from outside
+are served at most once a minute */
+void
+FlightDumpIfRequested() {
+    if ( flight_dump_requested && (ProgramRunCycles - flight_last_dump >= 6) ) {
+        flight_dump_requested = 0;
+        if ( !flight_dump_reason ) flight_dump_reason = "asked for";
+    }
+    if ( !flight_dump_reason ) return;
+    FlightDump( flight_dump_reason );
+    flight_dump_reason = NULL;
+}
+
+/* Shadow rules: a candidate rule set from SHADOW_RULES_FILE, if there is one, is evaluated every
+cycle on the same data as the rules in effect, but never switches anything. When the two ask for
+different outputs, the start and the end of the difference are logged, and the cycles each output
+differed in are counted, with the electricity each rule set would have used - and what the heater's
+share of the difference would have made of the tank temperature. Once a day the counts go to
+SHADOW_FILE as one line, so the agreement can be followed over days before the candidate is put
+in effect as RULES_FILE. */
+
+#define SHADOW_OUTPUTS  4
+
+static const char *shadow_output_names[SHADOW_OUTPUTS] = { "P1", "P2", "V", "H" };
+static const unsigned long shadow_output_mwh[SHADOW_OUTPUTS] = { PUMP1PPC, PUMP2PPC, VALVEPPC, HEATERPPC };
+
+struct shadow_count_struct
+{
+    unsigned long       cycles;                     /* cycles decided by the rules */
+    unsigned long       agreed;                     /* ...in which both rule sets asked for the same */
+    unsigned long       differed[SHADOW_OUTPUTS];   /* cycles in which each output differed */
+    unsigned long long  live_mwh;                   /* electricity the outputs asked for would use */
+    unsigned long long  candidate_mwh;
+    long long           heater_mwh;                 /* candidate minus live heater electricity */
+};
+
+struct rule_table rules_shadow;
+short shadow_on = 0;
+
+/* HeatingMode bits the candidate rules ask for this cycle; -1 if rules did not decide the cycle */
+short shadow_mode = -1;
+
+/* outputs which differ now, and since how many cycles */
+unsigned short shadow_differ = 0;
+unsigned long shadow_differ_cycles = 0;
+
+/* counts for today (energy_date) and since start */
+struct shadow_count_struct shadow_day, shadow_all;
+
+/* (Re)load rules_shadow from SHADOW_RULES_FILE - no file, or errors in it, turn shadow rules off */
+void
+LoadShadowRules() {
+    char buff[150];
+    short r;
+
+    r = CompileRulesFile( &rules_shadow, SHADOW_RULES_FILE );
+    shadow_on = (r == 0);
+    shadow_mode = -1;
+    shadow_differ = 0;
+    shadow_differ_cycles = 0;
+    if ( r == -1 ) return;
+    if ( shadow_on ) {
+        sprintf( buff, "INFO: Read candidate heating rules "SHADOW_RULES_FILE": %d rules, %d conditions - "\
+        "evaluated in shadow.", rules_shadow.n_rules, rules_shadow.n_conds );
+    }
+    else sprintf( buff, "WARNING: Errors in "SHADOW_RULES_FILE" - candidate rules not evaluated." );
+    log_message(LOG_FILE, buff);
+}
+
+/* Evaluate the candidate rules of the given groups, as the rules in effect have just been */
+void
+ShadowSelect( unsigned short groups ) {
+    unsigned short modes[2];
+
+    if ( !shadow_on ) return;
+    EvaluateRules( &rules_shadow, modes );
+    shadow_mode = ((groups & (1 << RULES_IDLE)) ? modes[RULES_IDLE] : 0) |
+                  ((groups & (1 << RULES_HEAT)) ? modes[RULES_HEAT] : 0);
+}
+
+/* Which outputs HeatingMode HM asks for, as bits in the order of shadow_output_names[] */
+unsigned short
+ShadowOutputs( unsigned short HM ) {
+    unsigned short heater = (HM & 16) || ((HM & 8) && (ElectricHeatSource() != EH_NONE));
+
+    return (HM & 1) | (HM & 2) | (HM & 4) | (heater << 3);
+}
+
+/* Put the names of outputs in bits o in buf, e.g. "P1+V" */
+void
+ShadowOutputNames( unsigned short o, char *buf ) {
+    short i;
+
+    strcpy( buf, o ? "" : "none" );
+    for (i=0;i<SHADOW_OUTPUTS;i++) {
+        if ( !(o & (1 << i)) ) continue;
+        if ( buf[0] ) strcat( buf, "+" );
+        strcat( buf, shadow_output_names[i] );
+    }
+}
+
+/* Compare what the candidate rules asked for this cycle with HM, decided by the rules in effect */
+void
+ShadowCompare( unsigned short HM ) {
+    struct shadow_count_struct *c[2] = { &shadow_day, &shadow_all };
+    unsigned short live, candidate, differ;
+    unsigned long long live_mwh = 0, candidate_mwh = 0;
+    char buff[150], live_names[20], candidate_names[20];
+    short i, j;
+
+    if ( shadow_mode < 0 ) return;
+    live = ShadowOutputs( HM );
+    candidate = ShadowOutputs( shadow_mode | (HM & 32) );
+    shadow_mode = -1;
+    differ = live ^ candidate;
+    for (i=0;i<SHADOW_OUTPUTS;i++) {
+        if ( live & (1 << i) ) live_mwh += shadow_output_mwh[i];
+        if ( candidate & (1 << i) ) candidate_mwh += shadow_output_mwh[i];
+    }
+    for (j=0;j<2;j++) {
+        c[j]->cycles++;
+        if ( !differ ) c[j]->agreed++;
+        for (i=0;i<SHADOW_OUTPUTS;i++) if ( differ & (1 << i) ) c[j]->differed[i]++;
+        c[j]->live_mwh += live_mwh;
+        c[j]->candidate_mwh += candidate_mwh;
+        c[j]->heater_mwh += (long long)((candidate >> 3) & 1) * HEATERPPC - (long long)((live >> 3) & 1) * HEATERPPC;
+    }
+    if ( differ == shadow_differ ) {
+        if ( differ ) shadow_differ_cycles++;
+        return;
+    }
+    if ( differ ) {
+        ShadowOutputNames( live, live_names );
+        ShadowOutputNames( candidate, candidate_names );
+        sprintf( buff, "INFO: Candidate rules differ: rules in effect ask for %s, candidate for %s.",
+        live_names, candidate_names );
+    }
+    else sprintf( buff, "INFO: Candidate rules agree again after %lu cycles.", shadow_differ_cycles );
+    log_message(LOG_FILE, buff);
+    shadow_differ = differ;
+    shadow_differ_cycles = 1;
+}
+
+/* Append the shadow counts of energy_date to SHADOW_FILE and start counting anew */
+void
+ShadowDayEnd() {
+    struct shadow_count_struct *c = &shadow_day;
+    char line[300], dt[20] = "";
+    struct stat st;
+    short n = 0;
+    int fd;
+
+    if ( !c->cycles ) return;
+    if ( cfg.tank_liters ) sprintf( dt, "%.2f", (double)c->heater_mwh / (cfg.tank_liters * 1162.8) );
+    sprintf( line, "INFO: Candidate rules agreed in %.1f%% of %lu cycles on %s, would have used %.1f Wh "\
+    "instead of %.1f Wh.", 100.0 * c->agreed / c->cycles, c->cycles, energy_date, (double)c->candidate_mwh / 1000,
+    (double)c->live_mwh / 1000 );
+    log_message(LOG_FILE, line);
+    fd = open( SHADOW_FILE, O_WRONLY|O_APPEND|O_CREAT, 0644 );
+    if (-1 == fd) {
+        log_message(LOG_FILE, "WARNING: Failed to open "SHADOW_FILE" for appending!");
+    }
+    else {
+        if ( (fstat( fd, &st ) == 0) && (st.st_size == 0) ) {
+            n += snprintf( line+n, sizeof(line)-n, "# date,cycles,agreed,p1_differed,p2_differed,valve_differed,"\
+            "heater_differed,live_mwh,candidate_mwh,heater_tank_dt\n" );
+        }
+        n += snprintf( line+n, sizeof(line)-n, "%s,%lu,%lu,%lu,%lu,%lu,%lu,%llu,%llu,%s\n", energy_date, c->cycles,
+        c->agreed, c->differed[0], c->differed[1], c->differed[2], c->differed[3], c->live_mwh, c->candidate_mwh, dt );
+        if ( write( fd, line, n ) != n ) {
+            log_message(LOG_FILE, "WARNING: Failed to append day data to "SHADOW_FILE"!");
+        }
+        close( fd );
+    }
+    memset( c, 0, sizeof *c );
+}
+
+short
+SelectIdleMode() {
+    unsigned short modes[2];
+
+    FlightRules( EvaluateRules( &rules_live, modes ), 1 << RULES_IDLE );
+    ShadowSelect( 1 << RULES_IDLE );
+    return modes[RULES_IDLE];
+}
+
+short
+SelectHeatingMode() {
+    unsigned short modes[2];
+
+    /* idle rules always apply, and heat rules add to them */
+    FlightRules( EvaluateRules( &rules_live, modes ), (1 << RULES_IDLE) | (1 << RULES_HEAT) );
+    ShadowSelect( (1 << RULES_IDLE) | (1 << RULES_HEAT) );
+    return (modes[RULES_IDLE] | modes[RULES_HEAT]);
+}
+
+/* Relay actuation scheduler.
+Heating decisions only request a state for each relay - ScheduleRelays() owns all output changes.
+A request waits while the relay has not yet been in its current state for its minimum on or off
+time, while switching on would go over its toggles per hour budget (switching off never waits for
+the budget), or while an interlock holds it; the reason is logged once per waiting request.
+Relays switching off change first, and relays switching on are started at least relay_stagger_ms
+apart, so their inrush currents do not add up with each other or with the heater: a start makes
+the other relays wait that long, rounded up to whole cycles, and a relay asked to switch on
+meanwhile is deferred to the cycle it may start in - the loop never sleeps for it. */
+
+#define RELAY_HOLD           -1
+
+#define DEFER_NONE            0
+#define DEFER_MIN_ON          1
+#define DEFER_MIN_OFF         2
+#define DEFER_BUDGET          3
+#define DEFER_DISABLED        4
+#define DEFER_INTERLOCK       5
+#define DEFER_STAGGER         6
+
+static const char *defer_reasons[] = { "", "min on time", "min off time", "toggles per hour budget",
+                                       "disabled by config", "valve still open", "another relay starting" };
+
+/* furnace pump keeps running until the valve has been closed for this many cycles */
+#define PUMP1_VALVE_CLOSED_CYCLES 6
+
+struct relay_struct
+{
+    const char      *name;
+    const char      *key;           /* name in STATS_FILE */
+    int             *pin;
+    int             *min_on;        /* seconds */
+    int             *min_off;       /* seconds */
+    int             *max_toggles;   /* per hour, 0 - no limit */
+    int             *enabled;       /* NULL - always enabled */
+    short           request;        /* 1 - on, 0 - off, RELAY_HOLD - keep as is */
+    short           deferred;       /* DEFER_* reason the request waits for */
+    short           deferral_logged;    /* the deferral's start is in the log - so will be its end */
+    unsigned long   deferred_at;    /* ProgramRunCycles the deferral started */
+    unsigned long   toggles;        /* state changes since start */
+    unsigned long   deferrals;      /* requests that had to wait since start */
+    unsigned long   toggled_at[MAX_TOGGLES_PER_HOUR];   /* ProgramRunCycles of last toggles */
+    unsigned short  toggled_head;
+    unsigned long   start_at;       /* ProgramRunCycles it may start at, after another relay's start */
+};
+
+/* what every relay starts with, from request on */
+#define RELAY_START     RELAY_HOLD, DEFER_NONE, 0, 0, 0, 0, { 0 }, 0, 0
+
+struct relay_struct relays[TOTALRELAYS+1] = {
+    { "", "", NULL, NULL, NULL, NULL, NULL, RELAY_START },
+    { "furnace pump", "Pump1", &cfg.pump1_pin, &cfg.pump1_min_on, &cfg.pump1_min_off,
+      &cfg.pump1_max_toggles, &cfg.use_pump1, RELAY_START },
+    { "solar pump", "Pump2", &cfg.pump2_pin, &cfg.pump2_min_on, &cfg.pump2_min_off,
+      &cfg.pump2_max_toggles, &cfg.use_pump2, RELAY_START },
+    { "valve", "Valve", &cfg.valve1_pin, &cfg.valve_min_on, &cfg.valve_min_off,
+      &cfg.valve_max_toggles, NULL, RELAY_START },
+    { "electric heater", "Heater", &cfg.el_heater_pin, &cfg.heater_min_on, &cfg.heater_min_off,
+      &cfg.heater_max_toggles, NULL, RELAY_START },
+    { "heat pump", "HeatPump", &cfg.heat_pump_pin, &cfg.heat_pump_min_on, &cfg.heat_pump_min_off,
+      &cfg.heat_pump_max_toggles, &cfg.use_heat_pump, RELAY_START }
+};
+
+/* number of whole cycles a relay has to stay in a state for the given seconds */
+long
+RelayCycles( int seconds ) {
+    return ((seconds + 9) / 10);
+}
+
+short
+RelayTogglesLastHour( short i ) {
+    short n, count = 0;
+    short total = (relays[i].toggles < MAX_TOGGLES_PER_HOUR) ? relays[i].toggles : MAX_TOGGLES_PER_HOUR;
+
+    for (n=0;n<total;n++) {
+        if ( (ProgramRunCycles - relays[i].toggled_at[n]) < (6*60) ) count++;
+    }
+    return count;
+}
+
+void
+RelayToGPIO( short i ) {
+    /* pin 0 - the relay is not there */
+    if ( *relays[i].pin == 0 ) return;
+    GPIOWrite( *relays[i].pin, cfg.invert_output ? !controls[i] : controls[i] );
+}
+
+void TurnPump1Off()  { relays[1].request = 0; }
+void TurnPump1On()   { relays[1].request = 1; }
+void TurnPump2Off()  { relays[2].request = 0; }
+void TurnPump2On()   { relays[2].request = 1; }
+void TurnValveOff()  { relays[3].request = 0; }
+void TurnValveOn()   { relays[3].request = 1; }
+void TurnHeaterOff() { relays[4].request = 0; }
+void TurnHeaterOn()  { relays[4].request = 1; }
+void TurnHeatPumpOff() { relays[5].request = 0; }
+void TurnHeatPumpOn()  { relays[5].request = 1; }
+
+/* End relay r's deferral, logging how it ended (done - the relay switched) if its start was logged */
+void
+RelayDeferralEnd( struct relay_struct *r, short done ) {
+    char msg[150];
+
+    if ( r->deferral_logged ) {
+        sprintf( msg, "Switching %s %s %s after %lu s deferred.", r->name,
+        (controls[r - relays] == done) ? "ON" : "OFF",
+        done ? "done" : "no longer asked for", (ProgramRunCycles - r->deferred_at) * 10 );
+        log_message(LOG_FILE, msg);
+    }
+    r->deferred = DEFER_NONE;
+    r->deferral_logged = 0;
+}
+
+/* Apply relay requests made this cycle, as the relays timings allow; requests are cleared after.
+A request which has to wait is logged when it starts waiting, and when it is done or withdrawn */
+void
+ScheduleRelays() {
+    short i, reason;
+    short switch_on[TOTALRELAYS+1];
+    short j;
+    char msg[150];
+    struct relay_struct *r;
+
+    for (i=1;i<=TOTALRELAYS;i++) {
+        r = &relays[i];
+        switch_on[i] = 0;
+        if ( (r->request == RELAY_HOLD) || (r->request == controls[i]) ) {
+            if ( r->deferred ) RelayDeferralEnd( r, 0 );
+            r->request = RELAY_HOLD;
+            continue;
+        }
+        reason = DEFER_NONE;
+        if ( r->request ) {
+            if ( (r->enabled != NULL) && !(*r->enabled) ) reason = DEFER_DISABLED;
+            else if ( ctrlstatecycles[i] < RelayCycles( *r->min_off ) ) reason = DEFER_MIN_OFF;
+            else if ( *r->max_toggles && (RelayTogglesLastHour( i ) >= *r->max_toggles) ) reason = DEFER_BUDGET;
+            else if ( ProgramRunCycles < r->start_at ) reason = DEFER_STAGGER;
+        }
+        else {
+            if ( ctrlstatecycles[i] < RelayCycles( *r->min_on ) ) reason = DEFER_MIN_ON;
+            else if ( (i == 1) && (CValve || (SCValve < PUMP1_VALVE_CLOSED_CYCLES)) ) reason = DEFER_INTERLOCK;
+        }
+        r->request = RELAY_HOLD;
+        if ( reason ) {
+            if ( !r->deferred ) {
+                r->deferrals++;
+                r->deferred_at = ProgramRunCycles;
+            }
+            /* no need to repeat in the log what the config says */
+            if ( !r->deferral_logged && (reason != DEFER_DISABLED) ) {
+                sprintf( msg, "Switching %s %s deferred: %s.", r->name, controls[i] ? "OFF" : "ON",
+                defer_reasons[reason] );
+                log_message(LOG_FILE, msg);
+                r->deferral_logged = 1;
+            }
+            r->deferred = reason;
+            continue;
+        }
+        controls[i] = !controls[i];
+        if ( r->deferred ) RelayDeferralEnd( r, 1 );
+        ctrlstatecycles[i] = 0;
+        r->toggled_at[r->toggled_head] = ProgramRunCycles;
+        r->toggled_head = (r->toggled_head + 1) % MAX_TOGGLES_PER_HOUR;
+        r->toggles++;
+        if ( controls[i] ) {
+            switch_on[i] = 1;
+            /* the others start relay_stagger_ms later, in whole cycles */
+            if ( cfg.relay_stagger_ms ) {
+                for (j=1;j<=TOTALRELAYS;j++) {
+                    if ( j != i ) relays[j].start_at = ProgramRunCycles + (cfg.relay_stagger_ms + 9999) / 10000;
+                }
+            }
+        }
+        else {
+            RelayToGPIO( i );
+        }
+        if ( sse_running ) {
+            sprintf( msg, "{\"relay\":\"%s\",\"on\":%d,\"cycle\":%lu}", r->key, controls[i], ProgramRunCycles );
+            SsePublish( "relay", msg );
+        }
+    }
+    /* relays switching off are done - now start the ones switching on */
+    for (i=1;i<=TOTALRELAYS;i++) {
+        if ( switch_on[i] ) RelayToGPIO( i );
+    }
+}
+
+/* Pump and flow anomaly detection.
+A relay switching on should move some temperature within minutes: the solar pump cools the
+collector and warms the boiler bottom, the furnace pump and valve cool the furnace. For each such
+response the change cfg.anomaly_minutes after switch on - relative to the temperature difference
+driving it at switch on - is learned as an exponentially weighted mean and mean absolute deviation
+(as the adaptive sampling does, no libm), O(1) per switch on, kept in RESPONSE_FILE over restarts.
+Once RESPONSE_LEARN samples are in, the score of a response is how many deviations weaker than
+usual it is: at cfg.anomaly_warn or more
+a WARNING, at cfg.anomaly_alarm, or RESPONSE_ALARM_RUN weak responses in a row, an ALARM - a
+stuck pump or an air locked loop. Weak responses are not learned from. */
+#define RESPONSE_LEARN        20
+#define RESPONSE_WEIGHT       (1.0/32)
+#define RESPONSE_MIN_DRIVE    2.0     /* C - a smaller difference drives no clear response */
+#define RESPONSE_MIN_DEV      0.02    /* floor of the deviation, so a steady response is no alarm */
+#define RESPONSE_ALARM_RUN    3
+#define RESPONSES             4
+
+struct response_struct
+{
+    const char      *key;           /* name in STATS_FILE and RESPONSE_FILE */
+    const char      *what;          /* for log messages */
+    short           relay;          /* relay switching on */
+    short           sensor;         /* its temperature should change */
+    short           hot, cold;      /* sensors whose difference drives the change */
+    float           start;          /* sensor at switch on */
+    float           drive;          /* hot - cold at switch on, 0 if not measuring */
+    unsigned long   samples;
+    float           mean;           /* of change / drive */
+    float           dev;            /* mean absolute deviation from mean */
+    float           score;          /* of the last response */
+    short           weak_run;       /* weak responses in a row */
+    unsigned long   anomalies;
+};
+
+struct response_struct responses[RESPONSES] = {
+    { "Pump2Collector", "solar pump: collector temp", 2, 2, 2, 4, 0, 0, 0, 0, 0, 0, 0, 0 },
+    { "Pump2BoilerLow", "solar pump: boiler low temp", 2, 4, 2, 4, 0, 0, 0, 0, 0, 0, 0, 0 },
+    { "Pump1Furnace",   "furnace pump: furnace temp", 1, 1, 1, 4, 0, 0, 0, 0, 0, 0, 0, 0 },
+    { "ValveFurnace",   "valve: furnace temp", 3, 1, 1, 4, 0, 0, 0, 0, 0, 0, 0, 0 }
+};
+short responses_read = 0;
+
+void
+ReadResponses() {
+    char line[100], key[40];
+    float mean, dev;
+    unsigned long n;
+    FILE *fp;
+    short i;
+
+    responses_read = 1;
+    if ( (fp = fopen( RESPONSE_FILE, "r" )) == NULL ) return;
+    while ( fgets( line, sizeof line, fp ) ) {
+        if ( sscanf( line, "%39[^=]=%lu,%f,%f", key, &n, &mean, &dev ) != 4 ) continue;
+        for (i=0;i<RESPONSES;i++) {
+            if ( strcmp( key, responses[i].key ) ) continue;
+            responses[i].samples = n;
+            responses[i].mean = mean;
+            responses[i].dev = dev;
+        }
+    }
+    fclose( fp );
+}
+
+void
+WriteResponses() {
+    char buf[RESPONSES*80];
+    short i;
+    int n = 0;
+
+    for (i=0;i<RESPONSES;i++) {
+        n += sprintf( buf+n, "%s=%lu,%.5f,%.5f\n", responses[i].key, responses[i].samples, responses[i].mean,
+        responses[i].dev );
+    }
+    WriteWholeFile( RESPONSE_FILE, O_TRUNC, buf, n );
+}
+
+/* Score response r which changed by change, and learn from it if it is not weak */
+void
+ScoreResponse( struct response_struct *r, float change ) {
+    float x = change / r->drive, dev, d;
+    short n = ( r->samples < RESPONSE_LEARN ) ? r->samples + 1 : 0;
+    short alarm;
+    char msg[200];
+
+    /* a response lost in its own noise is not scored */
+    if ( (r->samples >= RESPONSE_LEARN) && ((r->mean > 2*r->dev) || (r->mean < -2*r->dev)) ) {
+        dev = ( r->dev < RESPONSE_MIN_DEV ) ? RESPONSE_MIN_DEV : r->dev;
+        /* positive when weaker than usual, whichever way the temperature goes */
+        r->score = ( r->mean < 0 ) ? (x - r->mean) / dev : (r->mean - x) / dev;
+        if ( cfg.anomaly_warn && (r->score >= cfg.anomaly_warn) ) {
+            r->weak_run++;
+            r->anomalies++;
+            alarm = ( (r->score >= cfg.anomaly_alarm) || (r->weak_run >= RESPONSE_ALARM_RUN) );
+            sprintf( msg, "%s: Weak response of %s - changed %.2f C in %d min, usually %.2f C; score %.1f. "\
+            "Pump stuck or flow blocked?", alarm ? "ALARM" : "WARNING", r->what, change, cfg.anomaly_minutes,
+            r->mean * r->drive, r->score );
+            log_message(LOG_FILE, msg);
+            LogEvent( alarm ? EV_ALARM : EV_WARNING, EV_ANOMALY, r - responses, change, r->mean * r->drive, r->score );
+            if ( alarm ) flight_dump_reason = "weak pump or flow response";
+            return;
+        }
+    }
+    r->weak_run = 0;
+    /* plain averages until there are enough samples for the weights */
+    r->mean += (x - r->mean) * ( n ? 1.0/n : RESPONSE_WEIGHT );
+    d = ( x > r->mean ) ? x - r->mean : r->mean - x;
+    r->dev += (d - r->dev) * ( n ? 1.0/n : RESPONSE_WEIGHT );
+    r->samples++;
+    WriteResponses();
+}
+
+/* Check the responses to relays which switched on - called each cycle after the relays are set */
+void
+CheckResponses() {
+    struct response_struct *r;
+    long on_for;
+    short i;
+
+    if ( !responses_read ) ReadResponses();
+    for (i=0;i<RESPONSES;i++) {
+        r = &responses[i];
+        on_for = controls[r->relay] ? ctrlstatecycles[r->relay] : 0;
+        if ( on_for == 1 ) {
+            /* just switched on - sensors are as before it */
+            r->start = sensors[r->sensor];
+            r->drive = sensors[r->hot] - sensors[r->cold];
+            if ( r->drive < RESPONSE_MIN_DRIVE ) r->drive = 0;
+        }
+        else if ( !on_for ) r->drive = 0;
+        else if ( r->drive && (on_for == cfg.anomaly_minutes*6 + 1) ) {
+            ScoreResponse( r, sensors[r->sensor] - r->start );
+            r->drive = 0;
+        }
+    }
+}
+
+/* Function to write relay statistics in TABLE_FILE format: toggles since start, toggles in the
+last hour and requests that had to wait since start, for each relay. Called with ReWrite_CFG_TABLE_FILE() */
+void
+ReWrite_STATS_FILE() {
+    static char data[3000];
+    short i, j, n = 0;
+    long jitter[3];
+
+    for (i=1;i<=TOTALRELAYS;i++) {
+        n += snprintf( data+n, sizeof(data)-n, "%s%sToggles,%lu\n_,%sTogglesHour,%d\n_,%sDeferred,%lu",
+        (i==1) ? "," : "\n_,", relays[i].key, relays[i].toggles, relays[i].key, RelayTogglesLastHour(i),
+        relays[i].key, relays[i].deferrals );
+        if ( n >= (short)sizeof(data) ) break;
+    }
+    for (i=1;i<=TOTALSENSORS;i++) {
+        for (j=1;j<SENSOR_STATUSES;j++) {
+            if ( n < (short)sizeof(data) ) n += snprintf( data+n, sizeof(data)-n, "\n_,Temp%d%sErrors,%lu",
+            i, sensor_status_keys[j], sensor_errors[i][j] );
+        }
+        if ( n < (short)sizeof(data) ) n += snprintf( data+n, sizeof(data)-n, "\n_,Temp%dSlowReads,%lu\n_,Temp%dBits,%d"\
+        "\n_,Temp%dReads,%lu\n_,Temp%dSkips,%lu\n_,Temp%dInterval,%d", i, sensor_slow_reads[i], i, sensor_resolution[i],
+        i, sampler[i].reads, i, sampler[i].skips, i, sampler[i].interval );
+    }
+    for (i=0;i<RESPONSES;i++) {
+        if ( n < (short)sizeof(data) ) n += snprintf( data+n, sizeof(data)-n, "\n_,%sScore,%.2f\n_,%sSamples,%lu"\
+        "\n_,%sAnomalies,%lu", responses[i].key, responses[i].score, responses[i].key, responses[i].samples,
+        responses[i].key, responses[i].anomalies );
+    }
+    if ( n < (short)sizeof(data) ) n += snprintf( data+n, sizeof(data)-n, "\n_,ShadowCycles,%lu\n_,ShadowAgreed,%lu"\
+    "\n_,ShadowLiveWh,%.3f\n_,ShadowCandidateWh,%.3f", shadow_all.cycles, shadow_all.agreed,
+    (double)shadow_all.live_mwh / 1000, (double)shadow_all.candidate_mwh / 1000 );
+    CycleJitterPercentiles( jitter );
+    if ( n < (short)sizeof(data) ) n += snprintf( data+n, sizeof(data)-n, "\n_,CycleJitterP50,%ld"\
+    "\n_,CycleJitterP99,%ld\n_,CycleJitterMax,%ld\n_,OutputJobsDropped,%lu\n_,LogLinesHeld,%lu"\
+    "\n_,DataSegmentsArchived,%lu\n_,DataArchiveErrors,%lu", jitter[0], jitter[1], jitter[2], output_jobs_dropped,
+    log_lines_held, data_segments_archived, data_archive_errors );
+    log_msg_ovr(STATS_FILE, data);
+}
+
+/* Return 1 during night tariff hours, 0 otherwise */
+short
+NightTariffNow() {
+    return ( sched_now->flags & SCHED_NIGHT );
+}
+
+/* Add mwh milli-Wh used by device dev to the energy counters */
+void
+AccountEnergy( short dev, unsigned long mwh ) {
+    short night = NightTariffNow();
+
+    energy_hour[dev][current_timer_hour] += mwh;
+    energy_tariff[dev][night] += mwh;
+    TotalEnergyUsed += mwh;
+    if ( night ) NightlyEnergyUsed += mwh;
+}
+
+/* Estimate the heat put in the tank since the last cycle from the change of its mean temperature
+(1.163 Wh per litre and degree) and add it to the counters of the sources that were running: the
+solar pump, the furnace valve, the heater and the heat pump - shared equally if more than one ran. Hot water drawn
+while a source runs lowers the tank temperature too, so losses are kept as a debt of the source,
+paid back by its next gains before they are counted, and only up to a quarter degree of the tank,
+so a long draw does not hide a whole day of heating; a source which stops has its debt forgiven. */
+void
+AccountHeat() {
+    static float tank_prev = -1;
+    static double pending[HEAT_SOURCES];
+    short on[HEAT_SOURCES], running, i;
+    unsigned long long mwh;
+    double gain, floor_mwh;
+    float tank;
+
+    tank = (TboilerHigh + TboilerLow) / 2;
+    if ( !cfg.tank_liters || just_started || (tank_prev < 0) ) {
+        tank_prev = tank;
+        return;
+    }
+    on[HEAT_SOLAR] = CPump2;
+    on[HEAT_FURNACE] = CValve;
+    on[HEAT_HEATER] = CHeater;
+    on[HEAT_HEATPUMP] = CHeatPump;
+    running = on[HEAT_SOLAR] + on[HEAT_FURNACE] + on[HEAT_HEATER] + on[HEAT_HEATPUMP];
+    gain = running ? (double)cfg.tank_liters * 1162.8 * (tank - tank_prev) / running : 0;
+    floor_mwh = -(double)cfg.tank_liters * 1162.8 / 4;
+    tank_prev = tank;
+    for (i=0;i<HEAT_SOURCES;i++) {
+        if ( !on[i] ) { pending[i] = 0; continue; }
+        pending[i] += gain;
+        if ( pending[i] < floor_mwh ) pending[i] = floor_mwh;
+        if ( pending[i] < 1 ) continue;
+        mwh = (unsigned long long)pending[i];
+        pending[i] -= mwh;
+        heat_today[i] += mwh;
+        heat_month[i] += mwh;
+    }
+}
+
+/* Return 1 if config allows the electric heater now */
+short
+ElectricHeatAllowed() {
+    /* Do the check with config to see if its OK to use electric heater,
+    for example: if its on "night tariff" - switch it on */
+    /* nobody is home - keep the heater off */
+    if ( sched_now->flags & SCHED_AWAY ) return 0;
+    /* Determine current time: */
+    if ( NightTariffNow() ) {
+            /* NIGHT TARIFF TIME */
+            return (cfg.use_electric_heater_night != 0);
+    }
+    else {
+            /* DAY TIME */
+            return (cfg.use_electric_heater_day != 0);
+    }
+}
+
+/* Price of a kWh at night or by day; with no prices in the config every kWh costs the same */
+float
+TariffPrice( const short night ) {
+    if ( (cfg.day_price == 0) && (cfg.night_price == 0) ) return 1;
+    return night ? cfg.night_price : cfg.day_price;
+}
+
+/* Estimate the heat pump's COP now as cfg.heat_pump_efficiency percent of the ideal (Carnot) one,
+between water a few degrees above the top of the tank and the air it takes heat from. There is no
+outdoor sensor, so the collector, a few degrees colder than itself, stands in for the air - but not
+above the bottom of the tank: a collector in the sun is far warmer than the air */
+float
+EstimateHeatPumpCOP() {
+    float hot, cold, cop;
+
+    hot = TboilerHigh + 5 + 273.15;
+    cold = ( (Tkolektor < TboilerLow) ? Tkolektor : TboilerLow ) - 5 + 273.15;
+    if ( hot - cold < 1 ) return 6;
+    cop = (float)cfg.heat_pump_efficiency / 100 * hot / (hot - cold);
+    if ( cop < 1 ) cop = 1;
+    if ( cop > 6 ) cop = 6;
+    return cop;
+}
+
+/* Return 1 if the heat pump can take over heating now */
+short
+HeatPumpAvailable() {
+    if ( !cfg.use_heat_pump || CPowerByBattery || (sched_now->flags & SCHED_AWAY) ) return 0;
+    /* one resting after a run would only defer - leave the heat to the heater meanwhile */
+    return ( CHeatPump || (SCHeatPump >= RelayCycles(cfg.heat_pump_min_off)) );
+}
+
+/* Which electric source should heat the tank now: the one whose delivered kWh costs less, the
+heater's at the current price and the heat pump's at the price divided by its COP; the heater wins
+a tie, as it heats faster. By day, a heater allowed only at night is the option to wait for the night
+tariff, and is taken - nothing runs now - if its kWh costs less still */
+short
+ElectricHeatSource() {
+    short night, source = EH_NONE;
+    float cost, best = 0;
+
+    night = NightTariffNow();
+    if ( ElectricHeatAllowed() ) {
+        best = TariffPrice( night );
+        source = EH_HEATER;
+    }
+    if ( HeatPumpAvailable() ) {
+        cost = TariffPrice( night ) / heat_pump_cop;
+        if ( (source == EH_NONE) || (cost < best) ) {
+            best = cost;
+            source = EH_HEATPUMP;
+        }
+    }
+    if ( (source != EH_NONE) && !night && !cfg.use_electric_heater_day && cfg.use_electric_heater_night &&
+        !(sched_now->flags & SCHED_AWAY) && (TariffPrice( 1 ) < best) ) source = EH_NONE;
+    return source;
+}
+
+void
+RequestElectricHeat() {
+    /* Turn on the source ElectricHeatSource() picks, and the other one off */
+    switch ( ElectricHeatSource() ) {
+        case EH_HEATPUMP:
+        TurnHeatPumpOn();
+        TurnHeaterOff();
+        break;
+        case EH_HEATER:
+        TurnHeaterOn();
+        TurnHeatPumpOff();
+        break;
+        default:
+        TurnHeatPumpOff();
+        TurnHeaterOff();
+        break;
+    }
+}
+
+void
+ActivateHeatingMode(const short HeatMode) {
+    /* request changes as needed */
+    /* HeatMode's bits describe the peripherals desired state:
+        bit 0  (1) - pump 1
+        bit 1  (2) - pump 2
+        bit 2  (4) - valve
+        bit 3  (8) - electric heat wanted - heater or heat pump, whichever is cheaper
+    bit 4 (16) - heater forced */
+    /* the relays are still as they were since the last cycle - count the heat they brought first */
+    AccountHeat();
+    if (HeatMode & 1)  { TurnPump1On(); } else { TurnPump1Off(); }
+    if (HeatMode & 2)  { TurnPump2On(); } else { TurnPump2Off(); }
+    if (HeatMode & 4)  { TurnValveOn(); } else { TurnValveOff(); }
+    if (HeatMode & 8)  { RequestElectricHeat(); }
+    if (HeatMode & 16) { TurnHeaterOn(); }
+    if ( !(HeatMode & 24) ) { TurnHeaterOff(); }
+    if ( !(HeatMode & 8) ) { TurnHeatPumpOff(); }
+    /* and make the ones relays timings allow */
+    ScheduleRelays();
+    SCPump1++;
+    SCPump2++;
+    SCValve++;
+    SCHeater++;
+    SCHeatPump++;
+
+    /* Calculate total and night tariff electrical energy used here: */
+    if ( CHeater ) AccountEnergy( DEV_HEATER, HEATERPPC );
+    if ( CHeatPump ) AccountEnergy( DEV_HEATPUMP, heat_pump_ppc );
+    if ( CPump1 ) AccountEnergy( DEV_PUMP1, PUMP1PPC );
+    if ( CPump2 ) AccountEnergy( DEV_PUMP2, PUMP2PPC );
+    if ( CValve ) AccountEnergy( DEV_VALVE, VALVEPPC );
+    AccountEnergy( DEV_SELF, SELFPPC );
+}
+
+unsigned short
+AdjustHeatingModeForBatteryPower(unsigned short HM) {
+    /* Check for power source switch */
+    if ( CPowerByBattery != CPowerByBatteryPrev ) {
+        /* If we just switched to battery.. */
+        if ( CPowerByBattery ) {
+            log_message(LOG_FILE,"WARNING: Switch to BATTERY POWER detected.");
+            LogEvent( EV_WARNING, EV_BATTERY, 0, 0, 0, 0 );
+        }
+        else {
+            log_message(LOG_FILE,"INFO: Powered by GRID now.");
+            LogEvent( EV_INFO, EV_GRID, 0, 0, 0, 0 );
+        }
+    }
+    if ( CPowerByBattery ) {
+        /* When battery powered - electric heater does not work; do not try it (bit 3: electric heat
+        wanted, bit 4: heater forced - see ActivateHeatingMode()); the idle bit stays */
+        HM &= ~(1 << 3);
+        HM &= ~(1 << 4);
+        /* enable quick heater turn off - in about a minute */
+        if (CHeater && (SCHeater < (RelayCycles(cfg.heater_min_on) - 6))) {
+            SCHeater = RelayCycles(cfg.heater_min_on) - 6;
+        }
+        /* same for the heat pump - HeatPumpAvailable() does not pick it on battery */
+        if (CHeatPump && (SCHeatPump < (RelayCycles(cfg.heat_pump_min_on) - 6))) {
+            SCHeatPump = RelayCycles(cfg.heat_pump_min_on) - 6;
+        }
+    }
+    return HM;
+}
+
+/* Function to decide this cycle's HeatingMode from cfg.mode and current data */
+unsigned short
+DecideHeatingMode() {
+    unsigned short HeatingMode = 0;
+
+    heat_pump_cop = EstimateHeatPumpCOP();
+
+    /* do what "mode" from CFG files says - watch the LOG file to see used values */
+    switch (cfg.mode) {
+        default:
+        case 0: /* 0=ALL OFF */
+        HeatingMode = 0;
+        break;
+        case 1: /* 1=AUTO - tries to reach desired water temp efficiently */
+        case 2: /* 2=AUTO+HEAT HOUSE BY SOLAR - mode taken into account by SelectIdle() */
+        if ( CriticalTempsFound() ) {
+            /* ActivateEmergencyHeatTransfer(); */
+            /* Set HeatingMode bits for both pumps and valve */
+            HeatingMode = 7;
+            if ( !AlarmRaised ) {
+                log_message(LOG_FILE,"ALARM: Activating emergency cooling!");
+                LogEvent( EV_ALARM, EV_EMERGENCY, 0, Tkotel, Tkolektor, TboilerHigh );
+                flight_dump_reason = "emergency cooling";
+                AlarmRaised = 1;
+            }
+        }
+        else {
+            if ( AlarmRaised ) {
+                log_message(LOG_FILE,"INFO: Critical condition resolved. Running normally.");
+                LogEvent( EV_INFO, EV_EMERGENCY_OVER, 0, Tkotel, Tkolektor, TboilerHigh );
+                AlarmRaised = 0;
+            }
+            if (BoilerHeatingNeeded()) {
+                HeatingMode = SelectHeatingMode();
+                } else {
+                /* No heating needed - decide how to idle */
+                HeatingMode = SelectIdleMode();
+                HeatingMode |= 32;
+            }
+        }
+        break;
+        case 3: /* 3=MANUAL PUMP1 ONLY - only furnace pump ON */
+        HeatingMode = 1;
+        break;
+        case 4: /* 4=MANUAL PUMP2 ONLY - only solar pump ON */
+        HeatingMode = 2;
+        break;
+        case 5: /* 5=MANUAL HEATER ONLY - set THERMOSTAT CORRECTLY!!! */
+        HeatingMode = 16;
+        break;
+        case 6: /* 6=MANAUL PUMP1+HEATER - furnace pump and heater power ON */
+        HeatingMode = 17;
+        break;
+        case 7: /* 7=AUTO ELECTICAL HEATER ONLY - this one obeys start/stop hours */
+        if (BoilerHeatingNeeded()) {
+            HeatingMode = 8;
+            } else {
+            HeatingMode = 32;
+        }
+        break;
+        case 8: /* 8=AUTO ELECTICAL HEATER ONLY, DOES NOT CARE ABOUT SCHEDULE !!! */
+        if (BoilerHeatingNeeded()) {
+            HeatingMode = 16;
+            } else {
+            HeatingMode = 32;
+        }
+        break;
+    }
+    return HeatingMode;
+}
+
+/* Runtime state checkpoint.
+STATE_FILE holds two slots, each with a header (sequence number and CRC32 of the data) and a copy of
+the runtime state. The state goes to the older slot with a single pwrite() and the file is synced
+after it - in the cycle a relay switches, the alarm changes or the day changes, and otherwise every
+cfg.state_sync_cycles cycles, so the SD card is not written every cycle; energy counted since the
+last checkpoint is lost on a crash. A crash or power loss in the middle of a write can only damage
+the slot being written - the other one still holds a complete checkpoint.
+On start-up the newest valid slot is restored: energy counters always, and control state (relays,
+their state cycles, sensor history and alarm) only if the checkpoint is fresher than cfg.state_max_age.
+Slots (and hand over data) carry the version and length of the state they hold. From version 2 on,
+fields are only ever added at the end of struct state_struct: a shorter state written by an older
+executable is read as far as it goes and the fields it lacks are left zero, a longer one written by
+a newer executable is read up to the fields this one knows. Version 1 had one relay and one device
+less, so it is converted field by field. */
+
+#define STATE_MAGIC     0x44524c53  /* "SLRD" */
+#define STATE_VERSION   2
+#define STATE_MAX_LENGTH 65536      /* longest state a slot may claim to hold */
+
+struct state_struct
+{
+    time_t              saved_at;
+    unsigned long       ProgramRunCycles;
+    short               controls[TOTALRELAYS+3];
+    long                ctrlstatecycles[TOTALRELAYS+1];
+    float               sensors[TOTALSENSORS+1];
+    float               sensors_prv[TOTALSENSORS+1];
+    unsigned short      sensor_read_errors[TOTALSENSORS+1];
+    unsigned short      AlarmRaised;
+    unsigned long long  TotalEnergyUsed;
+    unsigned long long  NightlyEnergyUsed;
+    unsigned long       energy_hour[TOTALDEVICES][24];
+    unsigned long       energy_tariff[TOTALDEVICES][2];
+    char                energy_date[12];
+    unsigned long       relay_toggles[TOTALRELAYS+1];
+    unsigned long       relay_deferrals[TOTALRELAYS+1];
+    unsigned long       relay_toggled_at[TOTALRELAYS+1][MAX_TOGGLES_PER_HOUR];
+    unsigned short      relay_toggled_head[TOTALRELAYS+1];
+};
+
+/* version 1 layout - before the heat pump relay and device */
+struct state_struct_v1
+{
+    time_t              saved_at;
+    unsigned long       ProgramRunCycles;
+    short               controls[7];
+    long                ctrlstatecycles[5];
+    float               sensors[TOTALSENSORS+1];
+    float               sensors_prv[TOTALSENSORS+1];
+    unsigned short      sensor_read_errors[TOTALSENSORS+1];
+    unsigned short      AlarmRaised;
+    unsigned long long  TotalEnergyUsed;
+    unsigned long long  NightlyEnergyUsed;
+    unsigned long       energy_hour[5][24];
+    unsigned long       energy_tariff[5][2];
+    char                energy_date[12];
+    unsigned long       relay_toggles[5];
+    unsigned long       relay_deferrals[5];
+    unsigned long       relay_toggled_at[5][MAX_TOGGLES_PER_HOUR];
+    unsigned short      relay_toggled_head[5];
+};
+
+struct state_slot
+{
+    unsigned int        magic;
+    unsigned int        version;
+    unsigned int        seq;
+    unsigned int        length;     /* of state */
+    unsigned int        crc;        /* of state */
+    struct state_struct state;
+};
+
+#define STATE_SLOT_HEAD     offsetof(struct state_slot, state)
+
+int state_fd = -1;
+unsigned int state_seq = 0;
+
+/* CRC32 (IEEE 802.3) of len bytes at data */
+unsigned int
+crc32_of( const void *data, size_t len ) {
+    static unsigned int table[256];
+    static short table_ready = 0;
+    const unsigned char *p = data;
+    unsigned int c;
+    short i, k;
+
+    if ( !table_ready ) {
+        for (i=0;i<256;i++) {
+            c = i;
+            for (k=0;k<8;k++) c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+            table[i] = c;
+        }
+        table_ready = 1;
+    }
+    c = 0xFFFFFFFF;
+    while (len--) c = table[(c ^ *p++) & 0xFF] ^ (c >> 8);
+    return (c ^ 0xFFFFFFFF);
+}
+
+/* copy runtime state into st */
+void
+SaveStateTo( struct state_struct *st ) {
+    short i;
+
+    memset( st, 0, sizeof *st );
+    st->saved_at = time(NULL);
+    st->ProgramRunCycles = ProgramRunCycles;
+    memcpy( st->controls, controls, sizeof st->controls );
+    memcpy( st->ctrlstatecycles, ctrlstatecycles, sizeof st->ctrlstatecycles );
+    memcpy( st->sensors, sensors, sizeof st->sensors );
+    memcpy( st->sensors_prv, sensors_prv, sizeof st->sensors_prv );
+    memcpy( st->sensor_read_errors, sensor_read_errors, sizeof st->sensor_read_errors );
+    st->AlarmRaised = AlarmRaised;
+    st->TotalEnergyUsed = TotalEnergyUsed;
+    st->NightlyEnergyUsed = NightlyEnergyUsed;
+    memcpy( st->energy_hour, energy_hour, sizeof st->energy_hour );
+    memcpy( st->energy_tariff, energy_tariff, sizeof st->energy_tariff );
+    memcpy( st->energy_date, energy_date, sizeof st->energy_date );
+    for (i=1;i<=TOTALRELAYS;i++) {
+        st->relay_toggles[i] = relays[i].toggles;
+        st->relay_deferrals[i] = relays[i].deferrals;
+        memcpy( st->relay_toggled_at[i], relays[i].toggled_at, sizeof st->relay_toggled_at[i] );
+        st->relay_toggled_head[i] = relays[i].toggled_head;
+    }
+}
+
+/* Write runtime state to the older STATE_FILE slot and sync the file if the control state or the
+day changed since the last write, if cfg.state_sync_cycles calls went by without one, or if
+must_sync is non-zero - then it waits for the sync to finish. The SIGTERM handler builds its slot in a buffer of its
+own, as it may have stopped the main loop half way through filling the other one; its slot
+has the next seq, so it goes to the file slot the main loop was not writing */
+void
+WriteState( short must_sync ) {
+    static struct state_slot main_slot, signal_slot;
+    static unsigned short unwritten = 0;
+    struct state_slot *slot = in_signal_handler ? &signal_slot : &main_slot;
+
+    if ( state_fd == -1 ) return;
+    if ( !must_sync && (++unwritten < cfg.state_sync_cycles) &&
+         !memcmp( main_slot.state.controls, controls, sizeof main_slot.state.controls ) &&
+         (main_slot.state.AlarmRaised == AlarmRaised) &&
+         !strncmp( main_slot.state.energy_date, energy_date, sizeof main_slot.state.energy_date ) ) return;
+    unwritten = 0;
+    SaveStateTo( &slot->state );
+    state_seq++;
+    slot->magic = STATE_MAGIC;
+    slot->version = STATE_VERSION;
+    slot->seq = state_seq;
+    slot->length = sizeof slot->state;
+    slot->crc = crc32_of( &slot->state, sizeof slot->state );
+    if ( pwrite( state_fd, slot, sizeof *slot, (state_seq & 1) * sizeof *slot ) != sizeof *slot ) {
+        log_message(LOG_FILE, "WARNING: Failed to write "STATE_FILE"!");
+        return;
+    }
+    if ( must_sync ) fdatasync( state_fd );
+    else SyncInBackground( state_fd );
+}
+
+/* Put runtime state from st in effect: energy counters always, and if with_controls is non-zero -
+also control state, counting elapsed cycles the daemon did not run towards the state cycles */
+void
+LoadStateFrom( const struct state_struct *st, short with_controls, long elapsed ) {
+    short i;
+
+    TotalEnergyUsed = st->TotalEnergyUsed;
+    NightlyEnergyUsed = st->NightlyEnergyUsed;
+    memcpy( energy_hour, st->energy_hour, sizeof energy_hour );
+    memcpy( energy_tariff, st->energy_tariff, sizeof energy_tariff );
+    memcpy( energy_date, st->energy_date, sizeof energy_date );
+    energy_date[sizeof(energy_date)-1] = 0;
+    if ( !with_controls ) return;
+
+    ProgramRunCycles = st->ProgramRunCycles + elapsed;
+    memcpy( controls, st->controls, sizeof controls );
+    memcpy( ctrlstatecycles, st->ctrlstatecycles, sizeof ctrlstatecycles );
+    for (i=1;i<=TOTALRELAYS;i++) ctrlstatecycles[i] += elapsed;
+    /* the heat pump may have been taken out of the config since */
+    if ( !cfg.use_heat_pump ) CHeatPump = 0;
+    memcpy( sensors, st->sensors, sizeof sensors );
+    memcpy( sensors_prv, st->sensors_prv, sizeof sensors_prv );
+    memcpy( sensor_read_errors, st->sensor_read_errors, sizeof sensor_read_errors );
+    AlarmRaised = st->AlarmRaised;
+    for (i=1;i<=TOTALRELAYS;i++) {
+        relays[i].toggles = st->relay_toggles[i];
+        relays[i].deferrals = st->relay_deferrals[i];
+        memcpy( relays[i].toggled_at, st->relay_toggled_at[i], sizeof relays[i].toggled_at );
+        relays[i].toggled_head = st->relay_toggled_head[i] % MAX_TOGGLES_PER_HOUR;
+    }
+}
+
+/* Fill st from len bytes of state data of the given version; fields the data does not have are
+left zero. Returns 0 if the data can not be a state of that version. */
+short
+StateFromData( struct state_struct *st, unsigned int version, const void *data, size_t len ) {
+    const struct state_struct_v1 *v1 = data;
+    short i;
+
+    memset( st, 0, sizeof *st );
+    if ( version == 1 ) {
+        if ( len != sizeof *v1 ) return 0;
+        st->saved_at = v1->saved_at;
+        st->ProgramRunCycles = v1->ProgramRunCycles;
+        /* relays 1-4 kept their indexes; battery power and its previous value moved up by one */
+        memcpy( st->controls, v1->controls, 5 * sizeof st->controls[0] );
+        st->controls[6] = v1->controls[5];
+        st->controls[7] = v1->controls[6];
+        memcpy( st->ctrlstatecycles, v1->ctrlstatecycles, sizeof v1->ctrlstatecycles );
+        memcpy( st->sensors, v1->sensors, sizeof st->sensors );
+        memcpy( st->sensors_prv, v1->sensors_prv, sizeof st->sensors_prv );
+        memcpy( st->sensor_read_errors, v1->sensor_read_errors, sizeof st->sensor_read_errors );
+        st->AlarmRaised = v1->AlarmRaised;
+        st->TotalEnergyUsed = v1->TotalEnergyUsed;
+        st->NightlyEnergyUsed = v1->NightlyEnergyUsed;
+        memcpy( st->energy_hour, v1->energy_hour, sizeof v1->energy_hour );
+        memcpy( st->energy_tariff, v1->energy_tariff, sizeof v1->energy_tariff );
+        memcpy( st->energy_date, v1->energy_date, sizeof st->energy_date );
+        for (i=1;i<5;i++) {
+            st->relay_toggles[i] = v1->relay_toggles[i];
+            st->relay_deferrals[i] = v1->relay_deferrals[i];
+            memcpy( st->relay_toggled_at[i], v1->relay_toggled_at[i], sizeof st->relay_toggled_at[i] );
+            st->relay_toggled_head[i] = v1->relay_toggled_head[i];
+        }
+        return 1;
+    }
+    if ( version < 2 ) return 0;
+    memcpy( st, data, (len < sizeof *st) ? len : sizeof *st );
+    return 1;
+}
+
+/* Read the STATE_FILE slot at offset into slot, converting its state to the current version.
+Returns the size of the slot in the file, or 0 if there is no valid slot there. */
+size_t
+ReadStateSlot( off_t offset, struct state_slot *slot ) {
+    static union {
+        struct state_slot   slot;
+        char                bytes[STATE_SLOT_HEAD + STATE_MAX_LENGTH];
+    } raw;
+
+    if ( pread( state_fd, &raw, STATE_SLOT_HEAD, offset ) != (ssize_t)STATE_SLOT_HEAD ) return 0;
+    if ( (raw.slot.magic != STATE_MAGIC) || (raw.slot.length > STATE_MAX_LENGTH) ) return 0;
+    if ( pread( state_fd, raw.bytes + STATE_SLOT_HEAD, raw.slot.length, offset + STATE_SLOT_HEAD ) !=
+         (ssize_t)raw.slot.length ) return 0;
+    if ( raw.slot.crc != crc32_of( raw.bytes + STATE_SLOT_HEAD, raw.slot.length ) ) return 0;
+    if ( !StateFromData( &slot->state, raw.slot.version, raw.bytes + STATE_SLOT_HEAD, raw.slot.length ) )
+        return 0;
+    slot->magic = raw.slot.magic;
+    slot->version = raw.slot.version;
+    slot->seq = raw.slot.seq;
+    slot->length = raw.slot.length;
+    slot->crc = raw.slot.crc;
+    return STATE_SLOT_HEAD + raw.slot.length;
+}
+
+/* Open STATE_FILE and restore runtime state from its newest valid slot.
+Returns 1 if control state was restored, 0 otherwise. */
+short
+RestoreState() {
+    static struct state_slot slot[3];
+    struct state_struct *st = NULL;
+    char msg[200];
+    long age;
+    size_t first;
+    short i, n, newest = -1;
+
+    if ( state_fd == -1 ) state_fd = open( STATE_FILE, O_RDWR|O_CREAT, 0644 );
+    if ( state_fd == -1 ) {
+        log_message(LOG_FILE, "WARNING: Failed to open "STATE_FILE"! Runtime state will not be kept.");
+        return 0;
+    }
+    /* the second slot is where this executable writes it; if the first one was written by an
+    executable with another state length, the second one it wrote follows right after it */
+    first = ReadStateSlot( 0, &slot[0] );
+    n = ( ReadStateSlot( sizeof slot[0], &slot[1] ) != 0 );
+    if ( first && (first != sizeof slot[0]) ) n += ( ReadStateSlot( first, &slot[1+n] ) != 0 );
+    if ( first ) newest = 0;
+    for (i=1;i<=n;i++) {
+        if ( (newest == -1) || ((int)(slot[i].seq - slot[newest].seq) > 0) ) newest = i;
+    }
+    if ( newest == -1 ) {
+        log_message(LOG_FILE, "INFO: No valid runtime state checkpoint in "STATE_FILE" - starting afresh.");
+        return 0;
+    }
+    st = &slot[newest].state;
+    state_seq = slot[newest].seq;
+    if ( slot[newest].version != STATE_VERSION ) {
+        sprintf( msg, "INFO: Runtime state checkpoint in "STATE_FILE" is of version %u - converted to %d.",
+        slot[newest].version, STATE_VERSION );
+        log_message(LOG_FILE, msg);
+    }
+
+    /* energy counters in the checkpoint are never older than those in POWER_FILE */
+    age = time(NULL) - st->saved_at;
+    if ( (age < 0) || (age > cfg.state_max_age) ) {
+        LoadStateFrom( st, 0, 0 );
+        sprintf( msg, "INFO: Restored energy counters from "STATE_FILE"; control state is %ld s old - not resumed.", age );
+        log_message(LOG_FILE, msg);
+        return 0;
+    }
+    LoadStateFrom( st, 1, age / 10 );
+    sprintf( msg, "INFO: Resumed runtime state saved %ld s ago: pump1=%d, pump2=%d, valve=%d, heater=%d, "\
+    "heat pump=%d, alarm=%d.", age, CPump1, CPump2, CValve, CHeater, CHeatPump, AlarmRaised );
+    log_message(LOG_FILE, msg);
+    return 1;
+}
+
+/* Executable hand over (upgrade without stopping).
+On SIGUSR2, at the end of a cycle, solard puts its full runtime state, its main loop counters and
+the time the next cycle is due in a pipe, and exec()s SOLARD_EXE (which by then should be the new
+executable) with "--resume-fd=N". The process keeps its PID, the PID file lock and the STATE_FILE
+descriptor; GPIO pins stay exported and keep their values, so relays do not change. The new executable
+takes the state over instead of starting afresh, and runs its first cycle when the next one is due.
+If the exec() fails, the running executable just goes on. */
+
+#define HANDOVER_MAGIC  0x48524c53  /* "SLRH" */
+
+/* what follows the state in hand over data; it has not changed with state versions */
+struct handover_loop
+{
+    struct timeval      next_cycle;
+    int                 state_fd;
+    unsigned int        state_seq;
+    unsigned short      iter;
+    unsigned short      iter_P;
+    short               just_started;
+    unsigned short      NEstart;
+    unsigned short      NEstop;
+    unsigned short      current_timer_hour;
+    unsigned short      current_month;
+    unsigned short      now_is_winter;
+};
+
+struct handover_struct
+{
+    unsigned int        magic;
+    unsigned int        version;
+    unsigned int        length;     /* of all, header included */
+    unsigned int        crc;        /* of all below */
+    struct state_struct state;
+    struct handover_loop loop;
+};
+
+#define HANDOVER_DATA_OFFSET    offsetof(struct handover_struct, state)
+
+/* Hand over to SOLARD_EXE; returns only if that fails */
+void
+HandOver( unsigned short iter, unsigned short iter_P, const struct timeval *cycle_start ) {
+    static struct handover_struct h;
+    char fd_arg[30];
+    char msg[150];
+    int pipefd[2];
+
+    need_to_reexec = 0;
+    if ( access( SOLARD_EXE, X_OK ) ) {
+        log_message(LOG_FILE, "WARNING: "SOLARD_EXE" is not executable - not handing over. Continuing.");
+        return;
+    }
+    WritePersistentPower();
+    WriteState( 1 );
+
+    memset( &h, 0, sizeof h );
+    SaveStateTo( &h.state );
+    h.loop.next_cycle = *cycle_start;
+    h.loop.next_cycle.tv_sec += 10;
+    h.loop.state_fd = state_fd;
+    h.loop.state_seq = state_seq;
+    h.loop.iter = iter;
+    h.loop.iter_P = iter_P;
+    h.loop.just_started = just_started;
+    h.loop.NEstart = NEstart;
+    h.loop.NEstop = NEstop;
+    h.loop.current_timer_hour = current_timer_hour;
+    h.loop.current_month = current_month;
+    h.loop.now_is_winter = now_is_winter;
+    h.magic = HANDOVER_MAGIC;
+    h.version = STATE_VERSION;
+    h.length = sizeof h;
+    h.crc = crc32_of( (char *)&h + HANDOVER_DATA_OFFSET, sizeof h - HANDOVER_DATA_OFFSET );
+
+    /* the whole struct fits in the pipe buffer, so no reader is needed yet */
+    if ( pipe( pipefd ) ) {
+        log_message(LOG_FILE, "WARNING: Can not create hand over pipe - not handing over. Continuing.");
+        return;
+    }
+    if ( write( pipefd[1], &h, sizeof h ) != sizeof h ) {
+        log_message(LOG_FILE, "WARNING: Can not write hand over data - not handing over. Continuing.");
+        close( pipefd[0] );
+        close( pipefd[1] );
+        return;
+    }
+    close( pipefd[1] );
+    sprintf( fd_arg, "--resume-fd=%d", pipefd[0] );
+    log_message(LOG_FILE, "INFO: Handing over to "SOLARD_EXE". Relays stay as they are.");
+    LogEvent( EV_INFO, EV_HANDOVER, 0, 0, 0, 0 );
+    FlushOutputs();
+    execl( SOLARD_EXE, "solard", fd_arg, (char *)NULL );
+    /* still here - exec failed */
+    sprintf( msg, "WARNING: Hand over to "SOLARD_EXE" failed (errno %d). Continuing.", errno );
+    log_message(LOG_FILE, msg);
+    close( pipefd[0] );
+}
+
+/* Take over from the previous executable through fd. Returns 1 on success, 0 if its data is not usable.
+The previous executable may have had another state version; its state is whatever lies between
+the header and the loop counters. */
+short
+TakeOver( int fd, unsigned short *iter, unsigned short *iter_P, struct timeval *next_cycle ) {
+    static union {
+        struct handover_struct  h;
+        char                    bytes[HANDOVER_DATA_OFFSET + STATE_MAX_LENGTH + sizeof(struct handover_loop)];
+    } raw;
+    static struct handover_struct h;
+    ssize_t n, got = 0;
+
+    while ( got < (ssize_t)sizeof raw ) {
+        n = read( fd, raw.bytes + got, sizeof raw - got );
+        if ( n <= 0 ) break;
+        got += n;
+    }
+    close( fd );
+    if ( (got < (ssize_t)HANDOVER_DATA_OFFSET) || (raw.h.magic != HANDOVER_MAGIC) || ((ssize_t)raw.h.length != got) ||
+         (raw.h.length < HANDOVER_DATA_OFFSET + sizeof h.loop) ||
+         (raw.h.crc != crc32_of( raw.bytes + HANDOVER_DATA_OFFSET, raw.h.length - HANDOVER_DATA_OFFSET )) ||
+         !StateFromData( &h.state, raw.h.version, raw.bytes + HANDOVER_DATA_OFFSET,
+                         raw.h.length - HANDOVER_DATA_OFFSET - sizeof h.loop ) ) {
+        log_message(LOG_FILE, "WARNING: Hand over data from previous executable not usable - starting afresh.");
+        return 0;
+    }
+    memcpy( &h.loop, raw.bytes + raw.h.length - sizeof h.loop, sizeof h.loop );
+    LoadStateFrom( &h.state, 1, 0 );
+    if ( fcntl( h.loop.state_fd, F_GETFD ) != -1 ) state_fd = h.loop.state_fd;
+    state_seq = h.loop.state_seq;
+    *iter = h.loop.iter;
+    *iter_P = h.loop.iter_P;
+    *next_cycle = h.loop.next_cycle;
+    just_started = h.loop.just_started;
+    NEstart = h.loop.NEstart;
+    NEstop = h.loop.NEstop;
+    current_timer_hour = h.loop.current_timer_hour;
+    current_month = h.loop.current_month;
+    now_is_winter = h.loop.now_is_winter;
+    log_message(LOG_FILE, "INFO: Took over from previous executable - state resumed, relays untouched.");
+    return 1;
+}
+
+#ifndef BENCHMARK
+int
+main(int argc, char *argv[])
+{
+    /* set iter to its max value - makes sure we get a clock reading upon start */
+    unsigned short iter = 30;
+    unsigned short iter_P = 0;
+    unsigned short HeatingMode = 0, DecidedMode;
+    short state_resumed = 0;
+    short taken_over = 0;
+    short skewed = 0;
+    short first_decision = 1;
+    int resume_fd = -1;
+    struct timeval tvalBefore, tvalAfter, next_cycle;
+    struct timespec started_at;
+    long wait_us;
+    char msg[150];
+
+    clock_gettime( CLOCK_MONOTONIC, &started_at );
+
+    /* started by a running solard handing over to this executable? */
+    if ( (argc > 1) && (strncmp( argv[1], "--resume-fd=", 12 ) == 0) ) resume_fd = atoi( argv[1]+12 );
+
+    SetDefaultCfg();
+
+    /* before main work starts - try to open the log files to write a new line
+    ...and SCREAM if there is trouble! */
+    if (log_message(LOG_FILE,"***")) {
+        printf("Cannot open the mandatory "LOG_FILE" file needed for operation!\n");
+        exit(3);
+    }
+    if (log_message(DATA_FILE,"***")) {
+        printf("Cannot open the mandatory "DATA_FILE" file needed for operation!\n");
+        exit(4);
+    }
+    if (log_message(TABLE_FILE,"***")) {
+        printf("Cannot open the mandatory "TABLE_FILE" file needed for operation!\n");
+        exit(5);
+    }
+    if (log_message(JSON_FILE,"***")) {
+        printf("Cannot open the mandatory "JSON_FILE" file needed for operation!\n");
+        exit(6);
+    }
+    if (log_message(CFG_TABLE_FILE,"***")) {
+        printf("Cannot open the mandatory "CFG_TABLE_FILE" file needed for operation!\n");
+        exit(7);
+    }
+
+    /* when taking over, this process already is the daemon */
+    if ( resume_fd == -1 ) { daemonize(); } else { SetSignalHandlers(); }
+
+    StartOutputThread();
+
+    StartArchiver();
+
+    write_log_start();
+
+    OpenEvents();
+
+    just_started = 3;
+    TotalEnergyUsed = 0;
+    NightlyEnergyUsed = 0;
+
+    parse_config();
+
+    StartSse();
+
+    StartW1Hotplug();
+
+    ApplyRealtime();
+
+    ReadPersistentPower();
+
+    if ( resume_fd != -1 ) taken_over = TakeOver( resume_fd, &iter, &iter_P, &next_cycle );
+
+    if ( !taken_over ) {
+        state_resumed = RestoreState();
+        if ( state_resumed ) {
+            /* state is known - one cycle to get the time and new sensor readings is enough */
+            just_started = 1;
+        }
+        else {
+            SafeRelayState();
+        }
+
+        /* Enable GPIO pins */
+        if ( ! EnableGPIOpins() ) {
+            log_message(LOG_FILE,"ALARM: Cannot enable GPIO! Aborting run.");
+            LogEvent( EV_ALARM, EV_GPIO_FAIL, 0, 0, 0, 0 );
+            exit(11);
+        }
+
+        /* Set GPIO directions - relays get the resumed or safe state right with it */
+        if ( ! SetGPIODirection() ) {
+            log_message(LOG_FILE,"ALARM: Cannot set GPIO direction! Aborting run.");
+            LogEvent( EV_ALARM, EV_GPIO_FAIL, 0, 0, 0, 0 );
+            exit(12);
+        }
+        sprintf( msg, "INFO: Relays in %s state %ld ms after start: pump1=%d, pump2=%d, valve=%d, heater=%d, "\
+        "heat pump=%d.", state_resumed ? "resumed" : "safe", MsSince( &started_at ), CPump1, CPump2, CValve,
+        CHeater, CHeatPump );
+        log_message(LOG_FILE, msg);
+
+        StartSensorPrefetch();
+    }
+
+    SetSensorResolutions();
+
+    LoadRules();
+
+    LogEvent( EV_INFO, EV_START, taken_over ? 2 : state_resumed, 0, 0, 0 );
+
+    if ( taken_over ) {
+        /* GPIO pins are exported and set up already - leave them be, and start when the
+        previous executable would have started its next cycle */
+        if ( !gettimeofday( &tvalAfter, NULL ) ) {
+            wait_us = (next_cycle.tv_sec - tvalAfter.tv_sec)*1000000L + (next_cycle.tv_usec - tvalAfter.tv_usec);
+            if ( (wait_us > 0) && (wait_us <= 10000000) ) usleep( wait_us );
+        }
+    }
+    else {
+        FinishSensorPrefetch();
+    }
+
+    do {
+        /* Do all the important stuff... */
+        if ( gettimeofday( &tvalBefore, NULL ) ) {
+            log_message(LOG_FILE,"WARNING: error getting tvalBefore...");
+        }
+        RecordCycleStart( skewed );
+        skewed = 0;
+        FlightBegin();
+        ScheduleNow();
+        /* every 5 minutes: monthly power counters and the day change */
+        if ( iter == 30 ) {
+            iter = 0;
+            GetCurrentTime();
+            /* and increase counter controlling writing out persistent power use data */
+            iter_P++;
+            if ( iter_P == 2) {
+                iter_P = 0;
+                WritePersistentPower();
+            }
+        }
+        iter++;
+        W1Hotplug();
+        ReadSensors();
+        ReadExternalPower();
+        DecidedMode = DecideHeatingMode();
+        HeatingMode = AdjustHeatingModeForBatteryPower(DecidedMode);
+        ShadowCompare( DecidedMode );
+        ActivateHeatingMode(HeatingMode);
+        CheckResponses();
+        FlightEnd( DecidedMode, HeatingMode );
+        if ( first_decision ) {
+            first_decision = 0;
+            sprintf( msg, "INFO: First heating decision %ld ms after start.", MsSince( &started_at ) );
+            log_message(LOG_FILE, msg);
+        }
+        LogData(HeatingMode);
+        LogSummaries();
+        FlightDumpIfRequested();
+        WriteState( 0 );
+        ProgramRunCycles++;
+        if ( just_started ) { just_started--; }
+        if ( need_to_read_cfg ) {
+            need_to_read_cfg = 0;
+            just_started = 1;
+            CloseCachedFiles();
+            parse_config();
+            ApplyRealtime();
+            SetSensorResolutions();
+            LoadRules();
+            LogEvent( EV_INFO, EV_CONFIG, 0, cfg.mode, cfg.wanted_T, 0 );
+        }
+        if ( need_to_reexec ) HandOver( iter, iter_P, &tvalBefore );
+        if ( gettimeofday( &tvalAfter, NULL ) ) {
+            log_message(LOG_FILE,"WARNING: error getting tvalAfter...");
+            sleep( 7 );
+            skewed = 1;
+        }
+        else {
+            /* use hardcoded sleep() if time is skewed (for eg. daylight saving, ntp adjustments, etc.) */
+            if ((tvalAfter.tv_sec - tvalBefore.tv_sec) > 12) {
+                sleep( 7 );
+                skewed = 1;
+            }
+            else {
+                /* otherwise we have valid time data - so calculate exact sleep time
+                so period between active operations is bang on 10 seconds */
+                usleep(10000000 - (((tvalAfter.tv_sec - tvalBefore.tv_sec)*1000000L \
+                + tvalAfter.tv_usec) - tvalBefore.tv_usec));
+            }
         }
+    } while (1);
+
+    /* Disable GPIO pins */
+    if ( ! DisableGPIOpins() ) {
+        log_message(LOG_FILE,"ALARM: Cannot disable GPIO on UNREACHABLE exit!");
+        return(222);
     }
-}
 
-/* Read cfg.bat_powered_pin into CPowerByBattery which should be 
-set to 1 if the external power is generated by UPS */
-void
-ReadExternalPower() {
-    CPowerByBatteryPrev = CPowerByBattery;
-    CPowerByBattery = GPIORead(cfg.bat_powered_pin);
-}
+    log_message(LOG_FILE,"ALARM: Something wierd happened. Reached an UNREACHABLE part of the program!");
 
-/* Function to make GPIO state represent what is in controls[] */
-void
-ControlStateToGPIO() {
-    /* put state on GPIO pins */
-    if (cfg.invert_output) {
-            GPIOWrite( cfg.pump1_pin, !CPump1 );
-            GPIOWrite( cfg.pump2_pin, !CPump2 );
-            GPIOWrite( cfg.valve1_pin, !CValve );
-            GPIOWrite( cfg.el_heater_pin,  !CHeater );
-        }
-    else {
-            GPIOWrite( cfg.pump1_pin, CPump1 );
-            GPIOWrite( cfg.pump2_pin, CPump2 );
-            GPIOWrite( cfg.valve1_pin, CValve );
-            GPIOWrite( cfg.el_heater_pin,  CHeater );
-        }
+    return(225);
 }
 
-void
-write_log_start() {
-    char start_log_text[80];
+#endif
 
-    log_message(LOG_FILE,"INFO: solard "PGMVER" now starting up...");
-    log_message(LOG_FILE,"Running in "RUNNING_DIR", config file "CONFIG_FILE );
-    log_message(LOG_FILE,"PID written to "LOCK_FILE", writing CSV data to "DATA_FILE );
-    log_message(LOG_FILE,"Writing table data for collectd to "TABLE_FILE );
-    log_message(LOG_FILE,"Power used persistence file "POWER_FILE );
-    sprintf( start_log_text, "Powers: heater=%3.1f W, pump1=%3.1f W, pump2=%3.1f W",
-    HEATERPPC*(6*60), PUMP1PPC*(6*60), PUMP2PPC*(6*60) );
-    log_message(LOG_FILE, start_log_text );
-    sprintf( start_log_text, "Powers: valve=%3.1f W, self=%3.1f W",
-    VALVEPPC*(6*60), SELFPPC*(6*60) );
-    log_message(LOG_FILE, start_log_text );
-}
+#ifdef BENCHMARK
+/* Benchmark build (./build.sh bench): runs the real control cycle and the parsers and formatters against
+a fake w1 and GPIO tree under SOLARD_ROOT (which should be on tmpfs), and prints per operation wall and
+CPU time, read and write syscalls, bytes read and written, context switches and heap allocations as
+JSON, so results of different versions can be compared. Syscall and byte counters come from
+/proc/self/io, allocations are counted by wrapping the C library allocator. With --count-syscalls
+the benchmark runs traced by a parent process which counts all syscalls (open, close, fstat, ...
+too) - that makes it a lot slower, so take times from a run without it. */
+
+extern void *__libc_malloc( size_t size );
+extern void *__libc_calloc( size_t n, size_t size );
+extern void *__libc_realloc( void *ptr, size_t size );
+extern void __libc_free( void *ptr );
+
+unsigned long long bench_allocs = 0;
+unsigned long long bench_alloc_bytes = 0;
+
+void *malloc( size_t size ) { bench_allocs++; bench_alloc_bytes += size; return __libc_malloc( size ); }
+void *calloc( size_t n, size_t size ) { bench_allocs++; bench_alloc_bytes += n*size; return __libc_calloc( n, size ); }
+void *realloc( void *ptr, size_t size ) { bench_allocs++; bench_alloc_bytes += size; return __libc_realloc( ptr, size ); }
+void free( void *ptr ) { __libc_free( ptr ); }
+
+struct bench_counters {
+    double              wall_us;
+    unsigned long long  syscalls;
+    double              cpu_us;
+    unsigned long long  syscr;
+    unsigned long long  syscw;
+    unsigned long long  rchar;
+    unsigned long long  wchar;
+    unsigned long long  ctxsw;
+    unsigned long long  allocs;
+    unsigned long long  alloc_bytes;
+};
+
+short bench_results = 0;
+
+/* incremented by the tracing parent on every syscall, if counting them */
+volatile unsigned long long *bench_syscalls = NULL;
+/* syscalls BenchCounters() makes itself */
+unsigned long long bench_syscalls_own = 0;
 
-/* Function to log currently used config in TABLE_FILE format. The idea is that this file will be made
-available to a web app, which will fetch it once in a while to get current working config for solard
-without the need for root access (necessary to read /etc/solard.cfg), so relevant data could be shown.
-This function should be called less often, e.g. once every 5 minutes or something... */
-void
-ReWrite_CFG_TABLE_FILE() {
-    static char data[280];
-    /* Log data like so:
-    Time(by log function),mode,wanted_T,use_electric_heater_night,use_electric_heater_day,
-	pump1_always_on,use_pump1,use_pump2,day_to_reset_Pcounters,night_boost,abs_max;
-	on seperate lines */
-    sprintf( data, ",mode,%d\n_,Tboiler_wanted,%d\n_,elh_nt,%d\n_,elh_dt,%d\n"\
-    "_,p1_always_on,%d\n_,use_p1,%d\n_,use_p2,%d\n_,Pcounters_rst_day,%d\n"\
-	"_,use_night_boost,%d\n_,Tboiler_absMax,%d",
-    cfg.mode, cfg.wanted_T, cfg.use_electric_heater_night, cfg.use_electric_heater_day,
-	cfg.pump1_always_on, cfg.use_pump1, cfg.use_pump2, cfg.day_to_reset_Pcounters,
-	cfg.night_boost, cfg.abs_max);
-    log_msg_ovr(CFG_TABLE_FILE, data);
-}
-
-/* Function to get current time and put the hour in current_timer_hour */
 void
-GetCurrentTime() {
-    static char buff[80];
-    time_t t;
-    struct tm *t_struct;
-    short adjusted = 0;
-    short must_check = 0;
-    unsigned short current_day_of_month = 0;
-	
-	ReWrite_CFG_TABLE_FILE();
-
-    t = time(NULL);
-    t_struct = localtime( &t );
-    strftime( buff, sizeof buff, "%H", t_struct );
-
-    current_timer_hour = atoi( buff );
-
-    if ((current_timer_hour == 8) && ((ProgramRunCycles % (6*60)) == 0)) must_check = 1;
-
-    /* adjust night tariff start and stop hours at program start and
-    every day sometime between 8:00 and 9:00 */
-    if (( just_started ) || ( must_check )) {
-        strftime( buff, sizeof buff, "%m", t_struct );
-        current_month = atoi( buff );
-        if ((current_month >= 4)&&(current_month <= 10)) {
-            /* April through October - use NE from 23:00 till 6:59 */
-            if (NEstart != 23) {
-                adjusted = 1;
-                NEstart = 23;
-                NEstop  = 6;
-            }
-            now_is_winter = 0;
-        }
-        else {
-            /* November through March - use NE from 22:00 till 5:59 */
-            if (NEstart != 22) {
-                adjusted = 1;
-                NEstart = 22;
-                NEstop  = 5;
-            }
-            now_is_winter = 1;
-        }
-        if (adjusted) {
-            sprintf( buff, "INFO: Adjusted night energy hours, start %.2hu:00,"\
-            " stop %.2hu:59.", NEstart, NEstop );
-            log_message(LOG_FILE, buff);
-        }
-        /* among other things - manage power used counters; only check one
-        time during the day: at 8'something...*/
-        if (must_check) {
-            strftime( buff, sizeof buff, "%e", t_struct );
-            current_day_of_month = atoi( buff );
-            if (current_day_of_month == cfg.day_to_reset_Pcounters) {
-                /*...if it is the correct day of month - log gathered data and reset counters */
-                sprintf( buff, "INFO: Power used last month: nightly: %3.1f Wh, daily: %3.1f Wh;",
-                NightlyPowerUsed, (TotalPowerUsed-NightlyPowerUsed) );
-                log_message(LOG_FILE, buff);
-                sprintf( buff, "INFO: Total: %3.1f Wh. Power counters reset.", TotalPowerUsed );
-                log_message(LOG_FILE, buff);
-                TotalPowerUsed = 0;
-                NightlyPowerUsed = 0;
-            }
+BenchCounters( struct bench_counters *c ) {
+    char line[80];
+    unsigned long long v;
+    struct timespec ts;
+    struct rusage ru;
+    FILE *f;
+
+    c->syscalls = bench_syscalls ? *bench_syscalls : 0;
+    c->allocs = bench_allocs;
+    c->alloc_bytes = bench_alloc_bytes;
+    f = fopen( "/proc/self/io", "r" );
+    if ( f ) {
+        while ( fgets( line, sizeof line, f ) ) {
+            v = strtoull( strchr( line, ':' ) ? strchr( line, ':' )+1 : line, NULL, 10 );
+            if ( strncmp( line, "syscr:", 6 ) == 0 ) c->syscr = v;
+            else if ( strncmp( line, "syscw:", 6 ) == 0 ) c->syscw = v;
+            else if ( strncmp( line, "rchar:", 6 ) == 0 ) c->rchar = v;
+            else if ( strncmp( line, "wchar:", 6 ) == 0 ) c->wchar = v;
         }
+        fclose( f );
     }
+    getrusage( RUSAGE_SELF, &ru );
+    c->cpu_us = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec)*1e6 + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+    c->ctxsw = ru.ru_nvcsw + ru.ru_nivcsw;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    c->wall_us = ts.tv_sec*1e6 + ts.tv_nsec/1e3;
+    /* do not count the allocations of reading the counters themselves */
+    bench_allocs = c->allocs;
+    bench_alloc_bytes = c->alloc_bytes;
 }
 
 void
-LogData(short HM) {
-    static char data[280];
-    /* Log data like so:
-        Time(by log function) HOUR, TKOTEL,TSOLAR,TBOILERL,TBOILERH, BOILERTEMPWANTED,BOILERABSMAX,NIGHTBOOST,HM,
-    PUMP1,PUMP2,VALVE,EL_HEATER,POWERBYBATTERY, WATTSUSED,WATTSUSEDNIGHTTARIFF */
-    sprintf( data, "%2d, %6.3f,%6.3f,%6.3f,%6.3f, %2d,%2d,%d,%2d, %d,%d,%d,%d,%d, %5.3f,%5.3f",\
-    current_timer_hour, Tkotel, Tkolektor, TboilerLow, TboilerHigh, cfg.wanted_T, cfg.abs_max, \
-    cfg.night_boost, HM, CPump1, CPump2, CValve, CHeater, CPowerByBattery, \
-    TotalPowerUsed, NightlyPowerUsed );
-    log_message(DATA_FILE, data);
-
-    sprintf( data, ",Temp1,%5.3f\n_,Temp2,%5.3f\n_,Temp3,%5.3f\n_,Temp4,%5.3f\n"\
-    "_,Pump1,%d\n_,Pump2,%d\n_,Valve,%d\n_,Heater,%d\n_,PoweredByBattery,%d\n"\
-    "_,TempWanted,%d\n_,BoilerTabsMax,%d\n_,ElectricityUsed,%5.3f\n_,ElectricityUsedNT,%5.3f",\
-    Tkotel, Tkolektor, TboilerHigh, TboilerLow, CPump1, CPump2,\
-    CValve, CHeater, CPowerByBattery, cfg.wanted_T, cfg.abs_max,\
-    TotalPowerUsed, NightlyPowerUsed );
-    log_msg_ovr(TABLE_FILE, data);
-
-    sprintf( data, "{Tkotel:%5.3f,Tkolektor:%5.3f,TboilerH:%5.3f,TboilerL:%5.3f,"\
-    "PumpFurnace:%d,PumpSolar:%d,Valve:%d,Heater:%d,PoweredByBattery:%d,"\
-    "TempWanted:%d,BoilerTabsMax:%d,ElectricityUsed:%5.3f,ElectricityUsedNT:%5.3f}",\
-    Tkotel, Tkolektor, TboilerHigh, TboilerLow, CPump1, CPump2,\
-    CValve, CHeater, CPowerByBattery, cfg.wanted_T, cfg.abs_max,\
-    TotalPowerUsed, NightlyPowerUsed );
-    log_msg_cln(JSON_FILE, data);
+BenchReport( const char *name, long n, const struct bench_counters *a, const struct bench_counters *b ) {
+    printf( "%s\n    {\"name\":\"%s\",\"ops\":%ld,\"wall_us\":%.3f,\"cpu_us\":%.3f,", bench_results++ ? "," : "",
+    name, n, (b->wall_us - a->wall_us)/n, (b->cpu_us - a->cpu_us)/n );
+    if ( bench_syscalls ) printf( "\"syscalls\":%.2f,", (double)(b->syscalls - a->syscalls - bench_syscalls_own)/n );
+    printf( "\"syscalls_read\":%.2f,\"syscalls_write\":%.2f,\"bytes_read\":%.1f,\"bytes_written\":%.1f,"
+    "\"context_switches\":%.3f,\"allocs\":%.2f,\"alloc_bytes\":%.1f}",
+    (double)(b->syscr - a->syscr)/n, (double)(b->syscw - a->syscw)/n,
+    (double)(b->rchar - a->rchar)/n, (double)(b->wchar - a->wchar)/n,
+    (double)(b->ctxsw - a->ctxsw)/n, (double)(b->allocs - a->allocs)/n,
+    (double)(b->alloc_bytes - a->alloc_bytes)/n );
 }
 
-/* Return non-zero value on critical condition found based on current data in sensors[] */
+/* mkdir -p */
 short
-CriticalTempsFound() {
-    if (Tkotel > 68) return 1;
-    if (TboilerHigh > 71) return 2;
+BenchMakeDir( const char *dir ) {
+    char path[MAXLEN];
+    char *p;
+
+    snprintf( path, sizeof path, "%s", dir );
+    for ( p = path+1; *p; p++ ) {
+        if ( *p != '/' ) continue;
+        *p = 0;
+        if ( mkdir( path, 0755 ) && (errno != EEXIST) ) return -1;
+        *p = '/';
+    }
+    if ( mkdir( path, 0755 ) && (errno != EEXIST) ) return -1;
     return 0;
 }
 
 short
-BoilerHeatingNeeded() {
-    if ( TboilerLow < ((float)cfg.wanted_T - (now_is_winter==1 ? 7:14)) ) return 1;
-    if ( TboilerLow > ((float)cfg.wanted_T) ) return 0;
-    if ( TboilerHigh < ((float)cfg.wanted_T - 1) ) return 1;
-    if ( (TboilerHigh < TboilerHighPrev) && (TboilerHighPrev < (float)cfg.wanted_T) ) return 1;
+BenchWriteFile( const char *name, const char *content ) {
+    FILE *f;
+
+    f = fopen( name, "w" );
+    if ( !f ) return -1;
+    fputs( content, f );
+    fclose( f );
     return 0;
 }
 
+/* Creates the fake tree: GPIO pins (as if exported already), 4 DS18B20 sensors and a config file
+pointing at them; and removes what a previous run has left behind */
 short
-SelectIdleMode() {
+BenchSetupTree() {
+    static const float temps[TOTALSENSORS+1] = { 0, 52.5, 61.25, 44.0, 38.5 };
+    static const int pins[] = { 17, 18, 22, 25, 27 };
+    unsigned char sp[9] = { 0, 0, 0x4b, 0x46, 0x7f, 0xff, 0x0c, 0x10, 0 };
+    char path[MAXLEN];
+    char line[30];
+    char data[600];
+    short raw;
+    int i;
+    FILE *f;
+
+    if ( BenchMakeDir( SOLARD_ROOT "/etc" ) || BenchMakeDir( SOLARD_ROOT "/var/log" ) ||
+         BenchMakeDir( SOLARD_ROOT "/run/shm" ) || BenchMakeDir( GPIO_DIR ) ) return -1;
+    if ( BenchWriteFile( GPIO_DIR "/export", "" ) || BenchWriteFile( GPIO_DIR "/unexport", "" ) ) return -1;
+    for ( i = 0; i < (int)(sizeof pins / sizeof pins[0]); i++ ) {
+        snprintf( path, sizeof path, GPIO_DIR "/gpio%d", pins[i] );
+        if ( BenchMakeDir( path ) ) return -1;
+        snprintf( path, sizeof path, GPIO_DIR "/gpio%d/direction", pins[i] );
+        if ( BenchWriteFile( path, "out\n" ) ) return -1;
+        snprintf( path, sizeof path, GPIO_DIR "/gpio%d/value", pins[i] );
+        if ( BenchWriteFile( path, "0\n" ) ) return -1;
+    }
+    for ( i = 1; i <= TOTALSENSORS; i++ ) {
+        snprintf( path, sizeof path, SOLARD_ROOT "/sys/bus/w1/devices/28-00000000000%d", i );
+        if ( BenchMakeDir( path ) ) return -1;
+        snprintf( path, sizeof path, SOLARD_ROOT "/sys/bus/w1/devices/28-00000000000%d/w1_slave", i );
+        raw = temps[i]*16;
+        sp[0] = raw & 0xff;
+        sp[1] = (raw >> 8) & 0xff;
+        sp[8] = DS18B20Crc8( sp, 8 );
+        snprintf( line, sizeof line, "%02x %02x %02x %02x %02x %02x %02x %02x %02x",
+        sp[0], sp[1], sp[2], sp[3], sp[4], sp[5], sp[6], sp[7], sp[8] );
+        snprintf( data, sizeof data, "%s : crc=%02x YES\n%s t=%ld\n", line, sp[8], line, (raw*1000L)/16 );
+        if ( BenchWriteFile( path, data ) ) return -1;
+        snprintf( path, sizeof path, SOLARD_ROOT "/sys/bus/w1/devices/28-00000000000%d/resolution", i );
+        if ( BenchWriteFile( path, "12\n" ) ) return -1;
+    }
+    snprintf( data, sizeof data, "mode=1\nwanted_T=50\nuse_electric_heater_night=1\nuse_electric_heater_day=1\n"
+    "use_pump1=1\nuse_pump2=1\nabs_max=70\nday_to_reset_Pcounters=4\n"
+    "tkotel_sensor=%s/sys/bus/w1/devices/28-000000000001/w1_slave\n"
+    "tkolektor_sensor=%s/sys/bus/w1/devices/28-000000000002/w1_slave\n"
+    "tboilerh_sensor=%s/sys/bus/w1/devices/28-000000000003/w1_slave\n"
+    "tboilerl_sensor=%s/sys/bus/w1/devices/28-000000000004/w1_slave\n",
+    SOLARD_ROOT, SOLARD_ROOT, SOLARD_ROOT, SOLARD_ROOT );
+    if ( BenchWriteFile( CONFIG_FILE, data ) ) return -1;
+    /* the built-in rules as candidate rules too, so cycles include evaluating them in shadow */
+    f = fopen( SHADOW_RULES_FILE, "w" );
+    if ( !f ) return -1;
+    for (i=0;default_rules[i]!=NULL;i++) fprintf( f, "%s\n", default_rules[i] );
+    fclose( f );
+    unlink( LOG_FILE );
+    unlink( DATA_FILE );
+    unlink( POWER_FILE );
+    unlink( LEDGER_FILE );
+    unlink( STATE_FILE );
+    unlink( RULES_FILE );
+    return 0;
+}
+
+/* Forks; the child returns and runs the benchmark traced, the parent counts its syscalls into
+shared memory and exits with the child's exit code */
+void
+BenchTraceSyscalls() {
+    pid_t child;
+    int status, sig;
+    short in_syscall = 0;
+
+    bench_syscalls = mmap( NULL, sizeof *bench_syscalls, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0 );
+    if ( bench_syscalls == MAP_FAILED ) { bench_syscalls = NULL; return; }
+    fflush( stdout );
+    child = fork();
+    if ( child == -1 ) { bench_syscalls = NULL; return; }
+    if ( child == 0 ) {
+        ptrace( PTRACE_TRACEME, 0, NULL, NULL );
+        raise( SIGSTOP );
+        return;
+    }
+    waitpid( child, &status, 0 );
+    ptrace( PTRACE_SETOPTIONS, child, NULL, PTRACE_O_TRACESYSGOOD|PTRACE_O_EXITKILL );
+    ptrace( PTRACE_SYSCALL, child, NULL, NULL );
+    while ( waitpid( child, &status, 0 ) == child ) {
+        if ( WIFEXITED( status ) ) exit( WEXITSTATUS( status ) );
+        if ( WIFSIGNALED( status ) ) exit( 128 + WTERMSIG( status ) );
+        sig = 0;
+        if ( WSTOPSIG( status ) == (SIGTRAP|0x80) ) {
+            /* stops come in pairs - on entry and on exit */
+            if ( !in_syscall ) (*bench_syscalls)++;
+            in_syscall = !in_syscall;
+        }
+        else sig = WSTOPSIG( status );
+        ptrace( PTRACE_SYSCALL, child, NULL, sig );
+    }
+    exit( 4 );
+}
+
+/* The heating decisions as they were before the rules table took them - SelectIdleMode() and
+SelectHeatingMode() exactly as they were, working on the globals, with the night tariff hours
+set from the month the way GetCurrentTime() did then. BenchCheckRules() holds the built-in rules
+to what these give. */
+short
+BenchOldSelectIdleMode() {
     short ModeSelected = 0;
     short wantP1on = 0;
     short wantP2on = 0;
@@ -1227,7 +6033,7 @@ SelectIdleMode() {
 }
 
 short
-SelectHeatingMode() {
+BenchOldSelectHeatingMode() {
     short ModeSelected = 0;
     short wantP1on = 0;
     short wantP2on = 0;
@@ -1235,7 +6041,7 @@ SelectHeatingMode() {
     short wantHon = 0;
 
     /* First get what the idle routine would do: */
-    ModeSelected = SelectIdleMode();
+    ModeSelected = BenchOldSelectIdleMode();
 
     /* Then add to it main Select()'s stuff: */
     if ((Tkolektor > (TboilerLow + 10))&&(Tkolektor > Tkotel)) {
@@ -1265,287 +6071,271 @@ SelectHeatingMode() {
     return ModeSelected;
 }
 
-void TurnPump1Off()  { if (CPump1 && !CValve && (SCPump1 > 5) && (SCValve > 5))
-{ CPump1 = 0; SCPump1 = 0; } }
-void TurnPump1On()   { if (cfg.use_pump1 && (!CPump1) && (SCPump1 > 2)) { CPump1 = 1; SCPump1 = 0; } }
-void TurnPump2Off()  { if (CPump2 && (SCPump2 > 5)) { CPump2  = 0; SCPump2 = 0; } }
-void TurnPump2On()   { if (cfg.use_pump2 && (!CPump2) && (SCPump2 > 2)) { CPump2  = 1; SCPump2 = 0; } }
-void TurnValveOff()  { if (CValve && (SCValve > 17)) { CValve  = 0; SCValve = 0; } }
-void TurnValveOn()   { if (!CValve && (SCValve > 5)) { CValve  = 1; SCValve = 0; } }
-void TurnHeaterOff() { if (CHeater && (SCHeater > 17)) { CHeater = 0; SCHeater = 0; } }
-void TurnHeaterOn()  { if ((!CHeater) && (SCHeater > 29)) { CHeater = 1; SCHeater = 0; } }
-
+/* the seasonal night tariff hours as GetCurrentTime() set them before the schedule */
 void
-RequestElectricHeat() {
-    /* Do the check with config to see if its OK to use electric heater,
-    for example: if its on "night tariff" - switch it on */
-    /* Determine current time: */
-    if ( (current_timer_hour <= NEstop) || (current_timer_hour >= NEstart) ) {
-            /* NIGHT TARIFF TIME */
-            /* If heater use is allowed by config - turn it on */
-            if (cfg.use_electric_heater_night) TurnHeaterOn();
+BenchOldNightHours( unsigned short month ) {
+    if ((month >= 4)&&(month <= 10)) {
+        /* April through October - use NE from 23:00 till 6:59 */
+        NEstart = 23;
+        NEstop  = 6;
     }
     else {
-            /* DAY TIME */
-            /* If heater use is allowed by config - turn it on */
-            if (cfg.use_electric_heater_day) TurnHeaterOn();
+        /* November through March - use NE from 22:00 till 5:59 */
+        NEstart = 22;
+        NEstop  = 5;
     }
 }
 
-void
-ActivateHeatingMode(const short HeatMode) {
-    char current_state = 0;
-    char new_state = 0;
-
-    /* calculate current state */
-    if ( CPump1 ) current_state |= 1;
-    if ( CPump2 ) current_state |= 2;
-    if ( CValve ) current_state |= 4;
-    if ( CHeater ) current_state |= 8;
-    /* make changes as needed */
-    /* HeatMode's bits describe the peripherals desired state:
-        bit 0  (1) - pump 1
-        bit 1  (2) - pump 2
-        bit 2  (4) - valve
-        bit 3  (8) - heater wanted
-    bit 4 (16) - heater forced */
-    if (HeatMode & 1)  { TurnPump1On(); } else { TurnPump1Off(); }
-    if (HeatMode & 2)  { TurnPump2On(); } else { TurnPump2Off(); }
-    if (HeatMode & 4)  { TurnValveOn(); } else { TurnValveOff(); }
-    if (HeatMode & 8)  { RequestElectricHeat(); }
-    if (HeatMode & 16) { TurnHeaterOn(); }
-    if ( !(HeatMode & 24) ) { TurnHeaterOff(); }
-    SCPump1++;
-    SCPump2++;
-    SCValve++;
-    SCHeater++;
+/* A temperature for BenchCheckRules(): a random one in DS18B20 steps, or one next to a threshold
+the rules compare it with - off another temperature by a rule's constant, give or take a step */
+float
+BenchTemp( unsigned int *seed, float other ) {
+    static const float offsets[] = { 2, -2, 3, 4, 8, 9, 10, 12, -12, -10, -9, -8, -4, -3 };
 
-    /* Calculate total and night tariff electrical power used here: */
-    if ( CHeater ) {
-        TotalPowerUsed += HEATERPPC;
-        if ( (current_timer_hour <= NEstop) || (current_timer_hour >= NEstart) ) { NightlyPowerUsed += HEATERPPC; }
-    }
-    if ( CPump1 ) {
-        TotalPowerUsed += PUMP1PPC;
-        if ( (current_timer_hour <= NEstop) || (current_timer_hour >= NEstart) ) { NightlyPowerUsed += PUMP1PPC; }
-    }
-    if ( CPump2 ) {
-        TotalPowerUsed += PUMP2PPC;
-        if ( (current_timer_hour <= NEstop) || (current_timer_hour >= NEstart) ) { NightlyPowerUsed += PUMP2PPC; }
-    }
-    if ( CValve ) {
-        TotalPowerUsed += VALVEPPC;
-        if ( (current_timer_hour <= NEstop) || (current_timer_hour >= NEstart) ) { NightlyPowerUsed += VALVEPPC; }
-    }
-    TotalPowerUsed += SELFPPC;
-    if ( (current_timer_hour <= NEstop) || (current_timer_hour >= NEstart) ) { NightlyPowerUsed += SELFPPC; }
+    if ( rand_r( seed ) & 1 ) return (float)((rand_r( seed ) % 1920) - 320) / 16;
+    return other + offsets[rand_r( seed ) % 14] + (float)((rand_r( seed ) % 3) - 1) / 16;
+}
 
-    /* calculate desired new state */
-    if ( CPump1 ) new_state |= 1;
-    if ( CPump2 ) new_state |= 2;
-    if ( CValve ) new_state |= 4;
-    if ( CHeater ) new_state |= 8;
-    /* if current state and new state are different... */
-    if ( current_state != new_state ) {
-        /* then put state on GPIO pins - this prevents lots of toggling at every 10s decision */
-        ControlStateToGPIO();
-    }
+/* A relay cycles counter for BenchCheckRules(): random, or next to a count the rules compare with */
+long
+BenchCycles( unsigned int *seed ) {
+    static const long marks[] = { 6, 8, 11, 13, 15, 60, 90, 1440, 34560 };
+
+    if ( rand_r( seed ) & 1 ) return rand_r( seed ) % 40000;
+    return marks[rand_r( seed ) % 9] + (rand_r( seed ) % 3) - 1;
 }
 
-void
-AdjustHeatingModeForBatteryPower(unsigned short HM) {
-    /* Check for power source switch */
-    if ( CPowerByBattery != CPowerByBatteryPrev ) {
-        /* If we just switched to battery.. */
-        if ( CPowerByBattery ) {
-            log_message(LOG_FILE,"WARNING: Switch to BATTERY POWER detected.");
-        }
-        else {
-            log_message(LOG_FILE,"INFO: Powered by GRID now.");
-        }
+/* Compare the built-in rules with BenchOldSelectIdleMode() and BenchOldSelectHeatingMode() on n
+sets of random values made to fall on and next to the thresholds, at random minutes of schedules
+built with the default night tariff hours for a week from the 25th of each month; prints the
+first mismatches and returns how many there were. It sets the globals the decisions read, so
+main() exits after it. */
+long
+BenchCheckRules( long n ) {
+    static struct rule_table t;
+    static struct schedule weeks[12];
+    struct schedule_cfg c;
+    struct tm tm;
+    const struct sched_minute *e;
+    unsigned short modes[2], old[2];
+    unsigned int seed = 1;
+    long i, bad = 0;
+    short m;
+
+    CompileDefaultRules( &t );
+    memset( &c, 0, sizeof c );
+    c.nt_summer_start = 23;
+    c.nt_summer_stop = 6;
+    c.nt_winter_start = 22;
+    c.nt_winter_stop = 5;
+    c.summer_first_month = 4;
+    c.summer_last_month = 10;
+    for (m=0;m<12;m++) {
+        memset( &tm, 0, sizeof tm );
+        tm.tm_year = 2026 - 1900;
+        tm.tm_mon = m;
+        tm.tm_mday = 25;
+        tm.tm_hour = 12;
+        tm.tm_isdst = -1;
+        BuildSchedule( &weeks[m], &c, mktime( &tm ) );
     }
-    if ( CPowerByBattery ) {
-        /* When battery powered - electric heater does not work; do not try it */
-        HM &= ~(1 << 4);
-        HM &= ~(1 << 5);
-        /* enable quick heater turn off */
-        if (CHeater && (SCHeater < 12)) { SCHeater = 12; }
+    for ( i = 0; i < n; i++ ) {
+        Tkotel = BenchTemp( &seed, 30 );
+        Tkolektor = BenchTemp( &seed, Tkotel );
+        TboilerLow = BenchTemp( &seed, (rand_r( &seed ) & 1) ? Tkotel : Tkolektor );
+        TboilerHigh = BenchTemp( &seed, TboilerLow );
+        TkotelPrev = Tkotel - (float)(rand_r( &seed ) % 5) / 16;
+        CPump1 = rand_r( &seed ) & 1;
+        CPump2 = rand_r( &seed ) & 1;
+        CValve = rand_r( &seed ) & 1;
+        SCPump1 = BenchCycles( &seed );
+        SCPump2 = BenchCycles( &seed );
+        SCValve = BenchCycles( &seed );
+        cfg.mode = 1 + (rand_r( &seed ) & 1);
+        cfg.wanted_T = 35 + rand_r( &seed ) % 30;
+        cfg.abs_max = 40 + rand_r( &seed ) % 40;
+        /* temperatures next to the settings too */
+        if ( rand_r( &seed ) % 3 == 0 ) TboilerHigh = BenchTemp( &seed, cfg.abs_max );
+        if ( rand_r( &seed ) % 3 == 0 ) TboilerLow = BenchTemp( &seed, cfg.wanted_T );
+        cfg.night_boost = rand_r( &seed ) & 1;
+        cfg.pump1_always_on = (rand_r( &seed ) % 4) == 0;
+        nightEnergyTemp = ((float)cfg.wanted_T + 12);
+        if (nightEnergyTemp > (float)cfg.abs_max) { nightEnergyTemp = (float)cfg.abs_max; }
+        /* what ScheduleNow() sets for a minute of the week */
+        m = rand_r( &seed ) % 12;
+        e = &weeks[m].m[rand_r( &seed ) % weeks[m].minutes];
+        sched_now = e;
+        current_timer_hour = e->hour;
+        current_month = e->month;
+        now_is_winter = (e->flags & SCHED_WINTER) != 0;
+        NEstart = e->nestart;
+        NEstop = e->nestop;
+        EvaluateRules( &t, modes );
+        modes[RULES_HEAT] |= modes[RULES_IDLE];
+        BenchOldNightHours( current_month );
+        old[RULES_IDLE] = BenchOldSelectIdleMode();
+        old[RULES_HEAT] = BenchOldSelectHeatingMode();
+        if ( (modes[RULES_IDLE] == old[RULES_IDLE]) && (modes[RULES_HEAT] == old[RULES_HEAT]) ) continue;
+        if ( bad++ < 10 ) {
+            fprintf( stderr, "rules mismatch: Tkotel=%g Tkolektor=%g TboilerH=%g TboilerL=%g TkotelPrev=%g "
+            "P1=%d P2=%d V=%d SC=%ld,%ld,%ld mode=%d wanted=%d abs_max=%d boost=%d hour=%hu month=%hu "
+            "night_left=%hu: rules %u/%u, old %u/%u\n", Tkotel, Tkolektor, TboilerHigh, TboilerLow, TkotelPrev,
+            CPump1, CPump2, CValve, SCPump1, SCPump2, SCValve, cfg.mode, cfg.wanted_T, cfg.abs_max,
+            cfg.night_boost, current_timer_hour, current_month, e->night_left, modes[RULES_IDLE],
+            modes[RULES_HEAT], old[RULES_IDLE], old[RULES_HEAT] );
+        }
     }
+    return bad;
+}
+
+void
+BenchCycle() {
+    unsigned short HeatingMode, DecidedMode;
+
+    FlightBegin();
+    ScheduleNow();
+    W1Hotplug();
+    ReadSensors();
+    ReadExternalPower();
+    DecidedMode = DecideHeatingMode();
+    HeatingMode = AdjustHeatingModeForBatteryPower(DecidedMode);
+    ShadowCompare( DecidedMode );
+    ActivateHeatingMode(HeatingMode);
+    CheckResponses();
+    FlightEnd( DecidedMode, HeatingMode );
+    LogData(HeatingMode);
+    LogSummaries();
+    FlightDumpIfRequested();
+    ReWrite_CFG_TABLE_FILE();
+    WriteState( 0 );
+    ProgramRunCycles++;
+    if ( just_started ) { just_started--; }
 }
 
 int
 main(int argc, char *argv[])
 {
-    /* set iter to its max value - makes sure we get a clock reading upon start */
-    unsigned short iter = 30;
-    unsigned short iter_P = 0;
-    unsigned short AlarmRaised = 0;
-    unsigned short HeatingMode = 0;
-    struct timeval tvalBefore, tvalAfter;
-
-    SetDefaultCfg();
-
-    /* before main work starts - try to open the log files to write a new line
-    ...and SCREAM if there is trouble! */
-    if (log_message(LOG_FILE,"***")) {
-        printf("Cannot open the mandatory "LOG_FILE" file needed for operation!\n");
-        exit(3);
-    }
-    if (log_message(DATA_FILE,"***")) {
-        printf("Cannot open the mandatory "DATA_FILE" file needed for operation!\n");
-        exit(4);
-    }
-    if (log_message(TABLE_FILE,"***")) {
-        printf("Cannot open the mandatory "TABLE_FILE" file needed for operation!\n");
-        exit(5);
-    }
-    if (log_message(JSON_FILE,"***")) {
-        printf("Cannot open the mandatory "JSON_FILE" file needed for operation!\n");
-        exit(6);
-    }
-    if (log_message(CFG_TABLE_FILE,"***")) {
-        printf("Cannot open the mandatory "CFG_TABLE_FILE" file needed for operation!\n");
-        exit(7);
+    struct bench_counters a, b;
+    long cycles = 200;
+    long ops = 2000;
+    long w1_latency = 0;
+    long gpio_latency = 0;
+    long check_rules = 0;
+    short count_syscalls = 0;
+    short no_uring = 0;
+    long i, bad;
+    float t = 0;
+    volatile short status = SENSOR_OK;
+    unsigned short modes[2];
+    volatile unsigned long long cond_bits = 0;
+
+    for ( i = 1; i < argc; i++ ) {
+        if ( strncmp( argv[i], "--cycles=", 9 ) == 0 ) cycles = atol( argv[i]+9 );
+        else if ( strncmp( argv[i], "--ops=", 6 ) == 0 ) ops = atol( argv[i]+6 );
+        else if ( strncmp( argv[i], "--w1-latency-us=", 16 ) == 0 ) w1_latency = atol( argv[i]+16 );
+        else if ( strncmp( argv[i], "--gpio-latency-us=", 18 ) == 0 ) gpio_latency = atol( argv[i]+18 );
+        else if ( strcmp( argv[i], "--count-syscalls" ) == 0 ) count_syscalls = 1;
+        else if ( strcmp( argv[i], "--no-uring" ) == 0 ) no_uring = 1;
+        else if ( strncmp( argv[i], "--check-rules=", 14 ) == 0 ) check_rules = atol( argv[i]+14 );
+        else {
+            fprintf( stderr, "Usage: %s [--cycles=N] [--ops=N] [--w1-latency-us=N] [--gpio-latency-us=N] "
+            "[--count-syscalls] [--no-uring] [--check-rules=N]\n", argv[0] );
+            return 1;
+        }
     }
+    if ( (cycles < 1) || (ops < 1) ) cycles = ops = 1;
 
-    daemonize();
-
-    write_log_start();
-
-    just_started = 3;
-    TotalPowerUsed = 0;
-    NightlyPowerUsed = 0;
-
-    parse_config();
-
-    ReadPersistentPower();
-
-    /* Enable GPIO pins */
-    if ( ! EnableGPIOpins() ) {
-        log_message(LOG_FILE,"ALARM: Cannot enable GPIO! Aborting run.");
-        exit(11);
+    if ( SOLARD_ROOT[0] == 0 ) {
+        fprintf( stderr, "Benchmark build needs SOLARD_ROOT - it will not run against the real system files!\n" );
+        return 2;
     }
-
-    /* Set GPIO directions */
-    if ( ! SetGPIODirection() ) {
-        log_message(LOG_FILE,"ALARM: Cannot set GPIO direction! Aborting run.");
-        exit(12);
+    if ( BenchSetupTree() ) {
+        fprintf( stderr, "Cannot create the fake tree under "SOLARD_ROOT"!\n" );
+        return 3;
     }
 
-    do {
-        /* Do all the important stuff... */
-        if ( gettimeofday( &tvalBefore, NULL ) ) {
-            log_message(LOG_FILE,"WARNING: error getting tvalBefore...");
-        }
-        /* get the current hour every 5 minutes for electric heater schedule */
-        if ( iter == 30 ) {
-            iter = 0;
-            GetCurrentTime();
-            /* and increase counter controlling writing out persistent power use data */
-            iter_P++;
-            if ( iter_P == 2) {
-                iter_P = 0;
-                WritePersistentPower();
-            }
-        }
-        iter++;
-        ReadSensors();
-        ReadExternalPower();
-        /* do what "mode" from CFG files says - watch the LOG file to see used values */
-        switch (cfg.mode) {
-            default:
-            case 0: /* 0=ALL OFF */
-            HeatingMode = 0;
-            break;
-            case 1: /* 1=AUTO - tries to reach desired water temp efficiently */
-            case 2: /* 2=AUTO+HEAT HOUSE BY SOLAR - mode taken into account by SelectIdle() */
-            if ( CriticalTempsFound() ) {
-                /* ActivateEmergencyHeatTransfer(); */
-                /* Set HeatingMode bits for both pumps and valve */
-                HeatingMode = 7;
-                if ( !AlarmRaised ) {
-                    log_message(LOG_FILE,"ALARM: Activating emergency cooling!");
-                    AlarmRaised = 1;
-                }
-            }
-            else {
-                if ( AlarmRaised ) {
-                    log_message(LOG_FILE,"INFO: Critical condition resolved. Running normally.");
-                    AlarmRaised = 0;
-                }
-                if (BoilerHeatingNeeded()) {
-                    HeatingMode = SelectHeatingMode();
-                    } else {
-                    /* No heating needed - decide how to idle */
-                    HeatingMode = SelectIdleMode();
-                    HeatingMode |= 32;
-                }
-            }
-            break;
-            case 3: /* 3=MANUAL PUMP1 ONLY - only furnace pump ON */
-            HeatingMode = 1;
-            break;
-            case 4: /* 4=MANUAL PUMP2 ONLY - only solar pump ON */
-            HeatingMode = 2;
-            break;
-            case 5: /* 5=MANUAL HEATER ONLY - set THERMOSTAT CORRECTLY!!! */
-            HeatingMode = 16;
-            break;
-            case 6: /* 6=MANAUL PUMP1+HEATER - furnace pump and heater power ON */
-            HeatingMode = 17;
-            break;
-            case 7: /* 7=AUTO ELECTICAL HEATER ONLY - this one obeys start/stop hours */
-            if (BoilerHeatingNeeded()) {
-                HeatingMode = 8;
-                } else {
-                HeatingMode = 32;
-            }
-            break;
-            case 8: /* 8=AUTO ELECTICAL HEATER ONLY, DOES NOT CARE ABOUT SCHEDULE !!! */
-            if (BoilerHeatingNeeded()) {
-                HeatingMode = 16;
-                } else {
-                HeatingMode = 32;
-            }
-            break;
-        }
-        AdjustHeatingModeForBatteryPower(HeatingMode);
-        ActivateHeatingMode(HeatingMode);
-        LogData(HeatingMode);
-        ProgramRunCycles++;
-        if ( just_started ) { just_started--; }
-        if ( need_to_read_cfg ) {
-            need_to_read_cfg = 0;
-            just_started = 1;
-            parse_config();
-        }
-        if ( gettimeofday( &tvalAfter, NULL ) ) {
-            log_message(LOG_FILE,"WARNING: error getting tvalAfter...");
-            sleep( 7 );
-        }
-        else {
-            /* use hardcoded sleep() if time is skewed (for eg. daylight saving, ntp adjustments, etc.) */
-            if ((tvalAfter.tv_sec - tvalBefore.tv_sec) > 12) {
-                sleep( 7 );
-            }
-            else {
-                /* otherwise we have valid time data - so calculate exact sleep time
-                so period between active operations is bang on 10 seconds */
-                usleep(10000000 - (((tvalAfter.tv_sec - tvalBefore.tv_sec)*1000000L \
-                + tvalAfter.tv_usec) - tvalBefore.tv_usec));
-            }
-        }
-    } while (1);
-
-    /* Disable GPIO pins */
-    if ( ! DisableGPIOpins() ) {
-        log_message(LOG_FILE,"ALARM: Cannot disable GPIO on UNREACHABLE exit!");
-        return(222);
+    if ( check_rules > 0 ) {
+        bad = BenchCheckRules( check_rules );
+        printf( "{\"version\":\"%s\",\"rules_checked\":%ld,\"rules_mismatches\":%ld}\n", PGMVER, check_rules, bad );
+        return bad ? 5 : 0;
     }
 
-    log_message(LOG_FILE,"ALARM: Something wierd happened. Reached an UNREACHABLE part of the program!");
+    if ( count_syscalls ) BenchTraceSyscalls();
+#ifdef IORING_OFF_SQ_RING
+    if ( no_uring ) uring.fd = -2;
+#else
+    if ( no_uring ) fprintf( stderr, "Built without io_uring - sensors are read one by one anyway.\n" );
+#endif
 
-    return(225);
+    SetDefaultCfg();
+    parse_config();
+    SetSensorResolutions();
+    LoadRules();
+    RestoreState();
+    EnableGPIOpins();
+    SetGPIODirection();
+    just_started = 3;
+    ScheduleNow();
+    GetCurrentTime();
+    /* the first cycles after start are different - get them out of the way */
+    for ( i = 0; i < 3; i++ ) BenchCycle();
+
+    printf( "{\"version\":\"%s\",\"root\":\"%s\",\"w1_latency_us\":%ld,\"gpio_latency_us\":%ld,\"results\":[",
+    PGMVER, SOLARD_ROOT, w1_latency, gpio_latency );
+
+    BenchCounters( &a );
+    BenchCounters( &b );
+    bench_syscalls_own = b.syscalls - a.syscalls;
+
+    bench_w1_latency_us = w1_latency;
+    bench_gpio_latency_us = gpio_latency;
+    BenchCounters( &a );
+    for ( i = 0; i < cycles; i++ ) BenchCycle();
+    BenchCounters( &b );
+    BenchReport( "cycle", cycles, &a, &b );
+
+    /* micro benchmarks measure solard's own work - no injected latency */
+    bench_w1_latency_us = 0;
+    bench_gpio_latency_us = 0;
+    BenchCounters( &a );
+    for ( i = 0; i < ops; i++ ) status = sensorRead( sensor_paths[1], &t, NULL );
+    BenchCounters( &b );
+    BenchReport( "sensorRead", ops, &a, &b );
+
+    BenchCounters( &a );
+    for ( i = 0; i < ops; i++ ) cond_bits += EvaluateRules( &rules_live, modes );
+    BenchCounters( &b );
+    BenchReport( "EvaluateRules", ops, &a, &b );
+
+    BenchCounters( &a );
+    for ( i = 0; i < ops; i++ ) parse_config();
+    BenchCounters( &b );
+    BenchReport( "parse_config", ops, &a, &b );
+
+    BenchCounters( &a );
+    for ( i = 0; i < ops; i++ ) LogData( 35 );
+    BenchCounters( &b );
+    BenchReport( "LogData", ops, &a, &b );
+
+    BenchCounters( &a );
+    for ( i = 0; i < ops; i++ ) ReWrite_CFG_TABLE_FILE();
+    BenchCounters( &b );
+    BenchReport( "ReWrite_CFG_TABLE_FILE", ops, &a, &b );
+
+    BenchCounters( &a );
+    for ( i = 0; i < ops; i++ ) ReWrite_STATS_FILE();
+    BenchCounters( &b );
+    BenchReport( "ReWrite_STATS_FILE", ops, &a, &b );
+
+    BenchCounters( &a );
+    for ( i = 0; i < ops; i++ ) WritePersistentPower();
+    BenchCounters( &b );
+    BenchReport( "WritePersistentPower", ops, &a, &b );
+
+    printf( "\n]}\n" );
+    if ( status != SENSOR_OK ) fprintf( stderr, "WARNING: sensorRead() failed on the fake sensor: %s!\n", sensor_status_names[status] );
+    return 0;
 }
+#endif
 
 /* EOF */
@@ -0,0 +1,665 @@
+/*
+* solard_control.h
+*
+* Heating control logic shared by solard and solard-tune: the power each device uses,
+* the heating rules engine, the boiler checks the decisions start from and the weekly
+* schedule. solard runs it on live data every cycle; solard-tune replays the data
+* history through it.
+*
+* Rule operands are passed in as an array of values, so the same rule table can be
+* evaluated on live data or on a replayed cycle.
+*/
+
+#ifndef SOLARD_CONTROL_H
+#define SOLARD_CONTROL_H
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* constants of milli-Watt-hours of electricity used per 10 secs */
+#define   HEATERPPC         8340
+#define   PUMP1PPC          135
+#define   PUMP2PPC          21
+#define   VALVEPPC          6
+#define   SELFPPC           22
+/* my boiler uses 3kW per hour, so this is 0,00834 kWh per 10 seconds */
+/* this in Wh per 10 seconds is 8.34 W */
+/* pump 1 (furnace) runs at 48 W setting, pump 2 (solar) - 7 W */
+
+/* array storing the hour at wich to make the solar pump daily run for each month */
+static const unsigned short pump_start_hour_for[13] = { 11, 14, 13, 12, 11, 10, 9, 9, 10, 11, 12, 13, 14 };
+
+/* Return non-zero value on critical condition found: 1 - furnace, 2 - boiler too hot */
+static short
+CriticalTemps( float furnace, float boiler_high ) {
+    if (furnace > 68) return 1;
+    if (boiler_high > 71) return 2;
+    return 0;
+}
+
+/* Return 1 if the boiler needs heating to get to wanted degrees */
+static short
+BoilerNeedsHeating( float low, float high, float high_prev, int wanted, short winter ) {
+    if ( low < ((float)wanted - (winter==1 ? 7:14)) ) return 1;
+    if ( low > ((float)wanted) ) return 0;
+    if ( high < ((float)wanted - 1) ) return 1;
+    if ( (high < high_prev) && (high_prev < (float)wanted) ) return 1;
+    return 0;
+}
+
+/* Heating decisions are described by rules, which are read from RULES_FILE (or taken from the
+built-in set below, if that file is missing or has errors) and compiled into a flat table.
+A rule is a line with a group name ("idle" - always checked, or "heat" - checked only when the
+boiler needs heating), one or more conditions joined by "&&", and the outputs it asks for:
+    idle: Tkotel > 20 && Tkotel > TkotelPrev + 0.12 => P1
+A condition compares an operand with another operand or a number, optionally plus or minus a
+number. An "else" branch is written as the opposite condition, and an "or" - as two rules
+asking for the same outputs. Every distinct condition gets one bit; each cycle all conditions
+are evaluated once into a bitmask, and a rule fires when all of its condition bits are set. */
+
+#define MAX_RULE_CONDS  64
+#define MAX_RULES       96
+#define RULE_NAME_MAX   40
+
+#define RULES_IDLE      0
+#define RULES_HEAT      1
+
+/* condition compare operations as bits: less, equal, greater */
+#define RC_LT           1
+#define RC_EQ           2
+#define RC_GT           4
+
+/* operands rule conditions can use - names are in rule_operand_names[] in the same order */
+enum {
+    RO_ZERO = 0,
+    RO_TKOTEL, RO_TKOLEKTOR, RO_TBOILERH, RO_TBOILERL,
+    RO_TKOTELPRV, RO_TKOLEKTORPRV, RO_TBOILERHPRV, RO_TBOILERLPRV,
+    RO_CPUMP1, RO_CPUMP2, RO_CVALVE, RO_CHEATER, RO_CHEATPUMP, RO_CBATTERY,
+    RO_SCPUMP1, RO_SCPUMP2, RO_SCVALVE, RO_SCHEATER, RO_SCHEATPUMP,
+    RO_HOUR, RO_MONTH, RO_PUMPHOUR, RO_NESTART, RO_NESTOP, RO_WINTER,
+    RO_NIGHT, RO_NIGHTLEFT, RO_AWAY, RO_EXERCISE, RO_HPCOP,
+    RO_MODE, RO_WANTEDT, RO_ABSMAX, RO_NIGHTBOOST, RO_P1ALWAYSON, RO_NIGHTTEMP,
+    RO_COUNT
+};
+
+static const char *rule_operand_names[RO_COUNT] = {
+    "0",
+    "Tkotel", "Tkolektor", "TboilerHigh", "TboilerLow",
+    "TkotelPrev", "TkolektorPrev", "TboilerHighPrev", "TboilerLowPrev",
+    "CPump1", "CPump2", "CValve", "CHeater", "CHeatPump", "CPowerByBattery",
+    "SCPump1", "SCPump2", "SCValve", "SCHeater", "SCHeatPump",
+    "hour", "month", "pump_start_hour", "NEstart", "NEstop", "winter",
+    "night", "night_left", "away", "pump_exercise", "heat_pump_cop",
+    "mode", "wanted_T", "abs_max", "night_boost", "pump1_always_on", "nightEnergyTemp"
+};
+
+struct rule_cond
+{
+    unsigned char   a;      /* left side operand */
+    unsigned char   b;      /* right side operand */
+    unsigned char   op;     /* RC_* bits for which the condition holds */
+    unsigned char   fp32;   /* add k in float, like C does when adding an int to a float */
+    double          k;      /* number added to the right side operand */
+};
+
+struct rule
+{
+    unsigned long long  need;   /* condition bits that must all be set */
+    unsigned short      group;  /* RULES_IDLE or RULES_HEAT */
+    unsigned short      bits;   /* HeatingMode bits this rule asks for */
+    unsigned short      line;   /* rule line number - for log messages */
+};
+
+struct rule_table
+{
+    struct rule_cond    conds[MAX_RULE_CONDS];
+    struct rule         rules[MAX_RULES];
+    unsigned short      n_conds;
+    unsigned short      n_rules;
+};
+
+/* built-in rules - these do what solard did before rules were configurable */
+static const char *default_rules[] = {
+    /* If collector is below 7 C and solar pump has NOT run in the last 15 mins -
+    turn pump on to prevent freezing */
+    "idle: Tkolektor < 7 && CPump2 == 0 && SCPump2 > 90 => P2",
+    /* Furnace is above 38 C - at these temps always run the pump */
+    "idle: Tkotel > 38 => P1",
+    /* below 38 C - if it is cold (solar pump ran in the last 4 hours), run furnace pump
+    at least once every 10 minutes */
+    "idle: Tkotel <= 38 && Tkolektor < 33 && SCPump2 < 1440 && CPump1 == 0 && SCPump1 > 60 => P1",
+    /* Furnace is above 20 C and rising slowly - turn pump on */
+    "idle: Tkotel > 20 && Tkotel > TkotelPrev + 0.12 => P1",
+    /* Furnace temp is rising QUICKLY - turn pump on to limit furnace thermal shock */
+    "idle: Tkotel > TkotelPrev + 0.18 => P1",
+    /* If boiler is allowed to take heat in (TboilerHigh < abs_max, or TboilerLow < abs_max - 2)
+    and ETCs have heat in excess - build up boiler temp so expensive sources stay idle */
+    "idle: TboilerHigh < abs_max && Tkolektor > Tkotel + 2 && Tkolektor > TboilerLow + 12 && Tkolektor > TboilerHigh - 2 => P2",
+    "idle: TboilerLow < abs_max - 2 && Tkolektor > Tkotel + 2 && Tkolektor > TboilerLow + 12 && Tkolektor > TboilerHigh - 2 => P2",
+    /* Keep solar pump on while solar fluid is more than 5 C hotter than boiler lower end */
+    "idle: TboilerHigh < abs_max && Tkolektor > Tkotel + 2 && CPump2 != 0 && Tkolektor > TboilerLow + 4 => P2",
+    "idle: TboilerLow < abs_max - 2 && Tkolektor > Tkotel + 2 && CPump2 != 0 && Tkolektor > TboilerLow + 4 => P2",
+    /* Furnace has heat in excess - open the valve so boiler can build up heat now... */
+    "idle: TboilerHigh < abs_max && Tkolektor <= Tkotel + 2 && Tkotel > TboilerHigh + 3 => V",
+    "idle: TboilerHigh < abs_max && Tkolektor <= Tkotel + 2 && Tkotel > TboilerLow + 9 => V",
+    "idle: TboilerLow < abs_max - 2 && Tkolektor <= Tkotel + 2 && Tkotel > TboilerHigh + 3 => V",
+    "idle: TboilerLow < abs_max - 2 && Tkolektor <= Tkotel + 2 && Tkotel > TboilerLow + 9 => V",
+    /* ...and if valve has been open for 90 seconds - turn furnace pump on */
+    "idle: TboilerHigh < abs_max && Tkolektor <= Tkotel + 2 && Tkotel > TboilerHigh + 3 && CValve != 0 && SCValve > 8 => P1",
+    "idle: TboilerHigh < abs_max && Tkolektor <= Tkotel + 2 && Tkotel > TboilerLow + 9 && CValve != 0 && SCValve > 8 => P1",
+    "idle: TboilerLow < abs_max - 2 && Tkolektor <= Tkotel + 2 && Tkotel > TboilerHigh + 3 && CValve != 0 && SCValve > 8 => P1",
+    "idle: TboilerLow < abs_max - 2 && Tkolektor <= Tkotel + 2 && Tkotel > TboilerLow + 9 && CValve != 0 && SCValve > 8 => P1",
+    /* Keep valve open while there is still heat to exploit */
+    "idle: TboilerHigh < abs_max && Tkolektor <= Tkotel + 2 && CValve != 0 && Tkotel > TboilerLow + 4 => V",
+    "idle: TboilerLow < abs_max - 2 && Tkolektor <= Tkotel + 2 && CValve != 0 && Tkotel > TboilerLow + 4 => V",
+    /* Mode 2: heat the house by taking heat from boiler but leave at least 2 C extra on
+    top of the wanted temp - first open the valve, then after 1 minute turn furnace pump on */
+    "idle: mode == 2 && TboilerHigh > wanted_T + 2 && TboilerLow > Tkotel + 8 => V",
+    "idle: mode == 2 && TboilerHigh > wanted_T + 2 && TboilerLow > Tkotel + 8 && CValve != 0 && SCValve > 6 => P1",
+    /* Run solar pump once every day at the pump exercise time (by default the predefined
+    hour for current month) if it stayed off the past 4 hours */
+    "idle: pump_exercise != 0 && CPump2 == 0 && SCPump2 > 1440 => P2",
+    /* Furnace pump always on, or else turn it on every 4 days */
+    "idle: pump1_always_on != 0 => P1",
+    "idle: pump1_always_on == 0 && CPump1 == 0 && SCPump1 > 34560 => P1",
+    /* Prevent ETC from boiling its work fluid away: open the valve, after ~1.5 minutes
+    turn furnace pump on, and after 2 minutes - solar pump too */
+    "idle: Tkolektor > 68 => V",
+    "idle: Tkolektor > 68 && CValve != 0 && SCValve > 8 => P1",
+    "idle: Tkolektor > 68 && CValve != 0 && SCValve > 11 => P2",
+    /* During night tariff hours, try to keep boiler lower end near wanted temp */
+    "idle: night != 0 && CPump2 == 0 && TboilerLow < wanted_T - 1.1 => H",
+    /* In the last 2 hours of night energy tariff heat up boiler to nightEnergyTemp */
+    "idle: night_boost != 0 && night != 0 && night_left <= 120 && TboilerLow < nightEnergyTemp => H",
+    /* To enable solar heating, ETC temp must be at least 10 C higher than boiler cold end */
+    "heat: Tkolektor > TboilerLow + 10 && Tkolektor > Tkotel => P2",
+    /* Not enough heat in the solar collector - if the furnace is hot enough, use it: open
+    the valve, and after 2 minutes turn furnace pump on */
+    "heat: Tkolektor <= TboilerLow + 10 && Tkotel > TboilerLow + 9 => V",
+    "heat: Tkolektor <= Tkotel && Tkotel > TboilerLow + 9 => V",
+    "heat: Tkolektor <= TboilerLow + 10 && Tkotel > TboilerLow + 9 && CValve != 0 && SCValve > 13 => P1",
+    "heat: Tkolektor <= Tkotel && Tkotel > TboilerLow + 9 && CValve != 0 && SCValve > 13 => P1",
+    /* All is cold - use electric heater if valve is fully closed and ETC pump is NOT running */
+    "heat: Tkolektor <= TboilerLow + 10 && Tkotel <= TboilerLow + 9 && CValve == 0 && SCValve > 15 && CPump2 == 0 => H",
+    "heat: Tkolektor <= Tkotel && Tkotel <= TboilerLow + 9 && CValve == 0 && SCValve > 15 && CPump2 == 0 => H",
+    NULL
+};
+
+/* skip spaces; return pointer to first non-space char */
+static char *
+rule_skip_spaces( char *s )
+{
+    while ( isspace( *s ) ) s++;
+    return s;
+}
+
+/* read an identifier at s into name; return pointer after it, or NULL if there is none */
+static char *
+rule_read_name( char *s, char *name )
+{
+    short n = 0;
+    s = rule_skip_spaces( s );
+    while ( (isalnum( *s ) || (*s == '_')) && (n < (RULE_NAME_MAX-1)) ) name[n++] = *s++;
+    name[n] = 0;
+    if ( (n == 0) || isdigit( name[0] ) ) return NULL;
+    return s;
+}
+
+static short
+rule_find_operand( const char *name )
+{
+    short i;
+    for (i=1;i<RO_COUNT;i++) {
+        if (strcmp(name, rule_operand_names[i])==0) return i;
+    }
+    return -1;
+}
+
+/* Compile one rules line into table t. Returns 0 on success, -1 on error with reason in err. */
+static short
+CompileRuleLine( struct rule_table *t, char *line, unsigned short line_no, char *err )
+{
+    char name[RULE_NAME_MAX];
+    char *s, *e;
+    struct rule r;
+    struct rule_cond c;
+    short i, o;
+
+    memset( &r, 0, sizeof r );
+    r.line = line_no;
+
+    /* group */
+    if ( (s = rule_read_name( line, name )) == NULL ) { strcpy( err, "missing group" ); return -1; }
+    if (strcmp(name, "idle")==0) r.group = RULES_IDLE;
+    else if (strcmp(name, "heat")==0) r.group = RULES_HEAT;
+    else { sprintf( err, "unknown group \"%.20s\"", name ); return -1; }
+    s = rule_skip_spaces( s );
+    if ( *s != ':' ) { strcpy( err, "expected \":\" after group" ); return -1; }
+    s++;
+
+    /* conditions */
+    do {
+        memset( &c, 0, sizeof c );
+        if ( (s = rule_read_name( s, name )) == NULL ) { strcpy( err, "expected operand" ); return -1; }
+        if ( (o = rule_find_operand( name )) < 0 ) { sprintf( err, "unknown operand \"%.20s\"", name ); return -1; }
+        c.a = o;
+        s = rule_skip_spaces( s );
+        if ( (s[0] == '<') && (s[1] == '=') ) { c.op = RC_LT|RC_EQ; s += 2; }
+        else if ( (s[0] == '>') && (s[1] == '=') ) { c.op = RC_GT|RC_EQ; s += 2; }
+        else if ( (s[0] == '=') && (s[1] == '=') ) { c.op = RC_EQ; s += 2; }
+        else if ( (s[0] == '!') && (s[1] == '=') ) { c.op = RC_LT|RC_GT; s += 2; }
+        else if ( s[0] == '<' ) { c.op = RC_LT; s++; }
+        else if ( s[0] == '>' ) { c.op = RC_GT; s++; }
+        else { sprintf( err, "expected compare operation after \"%.20s\"", name ); return -1; }
+        s = rule_skip_spaces( s );
+        if ( isalpha( *s ) || (*s == '_') ) {
+            s = rule_read_name( s, name );
+            if ( (o = rule_find_operand( name )) < 0 ) { sprintf( err, "unknown operand \"%.20s\"", name ); return -1; }
+            c.b = o;
+            s = rule_skip_spaces( s );
+            if ( ((s[0] == '+') || (s[0] == '-')) && (s[1] != '>') ) {
+                c.k = strtod( s+1, &e );
+                if ( e == (s+1) ) { strcpy( err, "expected number after + or -" ); return -1; }
+                if ( s[0] == '-' ) c.k = -c.k;
+                s = e;
+            }
+        }
+        else {
+            c.b = RO_ZERO;
+            c.k = strtod( s, &e );
+            if ( e == s ) { strcpy( err, "expected operand or number" ); return -1; }
+            s = e;
+        }
+        /* C adds integer constants to float values in float, and fractional ones in double */
+        c.fp32 = ( c.k == (double)((long)c.k) );
+        /* reuse an equal condition if the table already has one */
+        for (i=0;i<t->n_conds;i++) {
+            if ( (t->conds[i].a == c.a) && (t->conds[i].b == c.b) && (t->conds[i].op == c.op) &&
+                 (t->conds[i].k == c.k) ) break;
+        }
+        if ( i == t->n_conds ) {
+            if ( t->n_conds >= MAX_RULE_CONDS ) { strcpy( err, "too many distinct conditions" ); return -1; }
+            t->conds[t->n_conds++] = c;
+        }
+        r.need |= (1ULL << i);
+        s = rule_skip_spaces( s );
+        if ( (s[0] == '&') && (s[1] == '&') ) { s += 2; continue; }
+        if ( (s[0] == '=') && (s[1] == '>') ) { s += 2; break; }
+        strcpy( err, "expected \"&&\" or \"=>\"" );
+        return -1;
+    } while (1);
+
+    /* outputs */
+    do {
+        if ( (s = rule_read_name( s, name )) == NULL ) { strcpy( err, "expected output" ); return -1; }
+        if (strcmp(name, "P1")==0) r.bits |= 1;
+        else if (strcmp(name, "P2")==0) r.bits |= 2;
+        else if (strcmp(name, "V")==0) r.bits |= 4;
+        else if (strcmp(name, "H")==0) r.bits |= 8;
+        else { sprintf( err, "unknown output \"%.20s\"", name ); return -1; }
+        s = rule_skip_spaces( s );
+        if ( *s == '|' ) { s++; continue; }
+        if ( *s == 0 ) break;
+        strcpy( err, "expected \"|\" or end of line after output" );
+        return -1;
+    } while (1);
+
+    if ( t->n_rules >= MAX_RULES ) { strcpy( err, "too many rules" ); return -1; }
+    t->rules[t->n_rules++] = r;
+    return 0;
+}
+
+/* Evaluate rule table t on the operand values in ro[]; put HeatingMode bits asked for by "idle"
+rules in modes[RULES_IDLE], and by "heat" rules - in modes[RULES_HEAT]; returns which conditions hold */
+static unsigned long long
+EvaluateRuleTable( const struct rule_table *t, const double *ro, unsigned short *modes ) {
+    float ro32[RO_COUNT];
+    unsigned long long cond_bits = 0;
+    unsigned int m[2] = { 0, 0 };
+    unsigned int hit;
+    double rhs;
+    const struct rule_cond *c;
+    const struct rule *r;
+    int i;
+
+    for (i=0;i<RO_COUNT;i++) ro32[i] = (float)ro[i];
+    for (i=0;i<t->n_conds;i++) {
+        c = &t->conds[i];
+        rhs = c->fp32 ? (double)(ro32[c->b] + (float)c->k) : (ro[c->b] + c->k);
+        /* index of the op bit to test: 0 - less, 1 - equal, 2 - greater */
+        hit = ((ro[c->a] > rhs) << 1) | (ro[c->a] == rhs);
+        cond_bits |= (unsigned long long)((c->op >> hit) & 1) << i;
+    }
+    for (i=0;i<t->n_rules;i++) {
+        r = &t->rules[i];
+        hit = ((cond_bits & r->need) == r->need);
+        m[r->group] |= r->bits & -hit;
+    }
+    modes[RULES_IDLE] = m[RULES_IDLE];
+    modes[RULES_HEAT] = m[RULES_HEAT];
+    return cond_bits;
+}
+
+
+/* The weekly schedule: night tariff windows, holidays, away days and the solar pump exercise
+time are compiled into a table with one entry per minute, from local midnight today SCHED_DAYS
+days ahead. The table is indexed by real time - (now - start) / 60 - so a daylight saving change
+is already in it, and every time based decision is one array lookup. It is rebuilt when the
+config is read and when the time is not in it any more.
+Windows are days and a time range, several separated by ";":
+    Mon-Fri 22:00-06:00; Sat,Sun 00:00-24:00
+("*" - every day; a window that ends at or before its start goes on past midnight). Dates are
+YYYY-MM-DD, or MM-DD for every year, and ranges FROM..TO, separated by "," or ";". */
+
+#define SCHED_DAYS      7
+/* minutes built past the end of the table, so night_left is right up to its last minute */
+#define SCHED_AHEAD     (24*60)
+/* a week that gains a daylight saving hour, and the minutes ahead */
+#define SCHED_SIZE      ((SCHED_DAYS*24+1)*60 + SCHED_AHEAD)
+/* schedule config keys can be given on several lines - their values add up to this length */
+#define SCHED_CFG_MAX   400
+#define SCHED_WINDOWS   24
+#define SCHED_DATES     32
+
+/* what a minute of the schedule is */
+#define SCHED_NIGHT     1   /* night tariff */
+#define SCHED_AWAY      2   /* nobody home - no electric heating */
+#define SCHED_EXERCISE  4   /* solar pump daily run */
+#define SCHED_WINTER    8   /* not one of the summer months */
+
+struct sched_minute
+{
+    unsigned char   flags;      /* SCHED_* bits */
+    unsigned char   hour;       /* local time */
+    unsigned char   month;
+    unsigned char   nestart;    /* seasonal night tariff hours of the month */
+    unsigned char   nestop;
+    unsigned short  night_left; /* minutes until the night tariff ends; 0 - it is day tariff */
+};
+
+struct sched_window
+{
+    unsigned char   days;       /* bit 0 - Sunday ... bit 6 - Saturday */
+    unsigned short  from;       /* minutes since midnight */
+    unsigned short  to;
+};
+
+struct sched_date
+{
+    long            from;       /* YYYYMMDD, or MMDD for every year */
+    long            to;
+};
+
+struct schedule_cfg
+{
+    int                 nt_summer_start, nt_summer_stop, nt_winter_start, nt_winter_stop;
+    int                 summer_first_month, summer_last_month;
+    struct sched_window night[SCHED_WINDOWS];       /* none - the seasonal hours every day */
+    struct sched_window exercise[SCHED_WINDOWS];    /* none - pump_start_hour_for[] every day */
+    struct sched_date   holidays[SCHED_DATES];      /* night tariff all day */
+    struct sched_date   away[SCHED_DATES];
+    unsigned short      n_night, n_exercise, n_holidays, n_away;
+};
+
+struct schedule
+{
+    time_t              start;      /* local midnight the table starts at */
+    long                minutes;    /* entries that can be looked up */
+    struct sched_minute m[SCHED_SIZE];
+};
+
+static const char *sched_day_names[7] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+
+/* read a day name at s into day (0 - Sunday); return pointer after it, or NULL if there is none */
+static const char *
+sched_read_day( const char *s, short *day )
+{
+    short i;
+    for (i=0;i<7;i++) {
+        if ( (tolower( s[0] ) == tolower( sched_day_names[i][0] )) && (tolower( s[1] ) == sched_day_names[i][1])
+             && (tolower( s[2] ) == sched_day_names[i][2]) ) {
+            *day = i;
+            return s+3;
+        }
+    }
+    return NULL;
+}
+
+/* read time of day HH:MM (up to 24:00) at s into min; return pointer after it, or NULL if there is none */
+static const char *
+sched_read_time( const char *s, unsigned short *min )
+{
+    int h, m, n = 0;
+    if ( (sscanf( s, "%2d:%2d%n", &h, &m, &n ) < 2) || (n == 0) ) return NULL;
+    if ( (h < 0) || (h > 24) || (m < 0) || (m > 59) || ((h == 24) && (m != 0)) ) return NULL;
+    *min = h*60 + m;
+    return s+n;
+}
+
+/* read date YYYY-MM-DD or MM-DD at s into d as YYYYMMDD or MMDD; return pointer after it, or NULL */
+static const char *
+sched_read_date( const char *s, long *d )
+{
+    int y, m, day, n = 0;
+    if ( (sscanf( s, "%4d-%2d-%2d%n", &y, &m, &day, &n ) < 3) || (n == 0) || (y < 1970) ) {
+        y = 0;
+        n = 0;
+        if ( (sscanf( s, "%2d-%2d%n", &m, &day, &n ) < 2) || (n == 0) ) return NULL;
+    }
+    if ( (m < 1) || (m > 12) || (day < 1) || (day > 31) ) return NULL;
+    *d = (long)y*10000 + m*100 + day;
+    return s+n;
+}
+
+/* Compile windows at s into w. Returns how many there are, or -1 with the reason in err. */
+static short
+CompileScheduleWindows( const char *s, struct sched_window *w, char *err )
+{
+    short n = 0, d1, d2;
+    unsigned char days;
+
+    while (1) {
+        while ( isspace( *s ) || (*s == ';') ) s++;
+        if ( *s == 0 ) return n;
+        if ( n >= SCHED_WINDOWS ) { strcpy( err, "too many windows" ); return -1; }
+        days = 0;
+        if ( *s == '*' ) {
+            days = 0x7f;
+            s++;
+        }
+        else while (1) {
+            if ( (s = sched_read_day( s, &d1 )) == NULL ) { strcpy( err, "expected a day name or \"*\"" ); return -1; }
+            d2 = d1;
+            if ( (*s == '-') && ((s = sched_read_day( s+1, &d2 )) == NULL) ) {
+                strcpy( err, "expected a day name after \"-\"" );
+                return -1;
+            }
+            /* day ranges can go past Saturday, like Fri-Mon */
+            while (1) {
+                days |= 1 << d1;
+                if ( d1 == d2 ) break;
+                d1 = (d1+1) % 7;
+            }
+            if ( *s != ',' ) break;
+            s++;
+        }
+        if ( ((s = sched_read_time( s, &w[n].from )) == NULL) || (*s != '-') ||
+             ((s = sched_read_time( s+1, &w[n].to )) == NULL) ) {
+            strcpy( err, "expected time range HH:MM-HH:MM after the days" );
+            return -1;
+        }
+        if ( w[n].from == w[n].to ) { strcpy( err, "time range is empty" ); return -1; }
+        w[n++].days = days;
+        while ( isspace( *s ) ) s++;
+        if ( (*s != ';') && (*s != 0) ) { strcpy( err, "expected \";\" after a window" ); return -1; }
+    }
+}
+
+/* Compile dates and date ranges at s into d. Returns how many there are, or -1 with the reason in err. */
+static short
+CompileScheduleDates( const char *s, struct sched_date *d, char *err )
+{
+    short n = 0;
+
+    while (1) {
+        while ( isspace( *s ) || (*s == ',') || (*s == ';') ) s++;
+        if ( *s == 0 ) return n;
+        if ( n >= SCHED_DATES ) { strcpy( err, "too many dates" ); return -1; }
+        if ( (s = sched_read_date( s, &d[n].from )) == NULL ) { strcpy( err, "expected date YYYY-MM-DD or MM-DD" ); return -1; }
+        d[n].to = d[n].from;
+        if ( (s[0] == '.') && (s[1] == '.') ) {
+            if ( (s = sched_read_date( s+2, &d[n].to )) == NULL ) { strcpy( err, "expected a date after \"..\"" ); return -1; }
+            if ( (d[n].from < 10000) != (d[n].to < 10000) ) {
+                strcpy( err, "range must have the year on both dates or on none" );
+                return -1;
+            }
+            /* ranges without the year can go past the new year, like 12-24..01-06 */
+            if ( (d[n].from >= 10000) && (d[n].to < d[n].from) ) { strcpy( err, "range ends before it starts" ); return -1; }
+        }
+        n++;
+        if ( (*s != 0) && !isspace( *s ) && (*s != ',') && (*s != ';') ) { strcpy( err, "expected \",\" after a date" ); return -1; }
+    }
+}
+
+/* Compile the schedule config values into c. Returns 0, or -1 with the first error in err (a
+value with errors is left out of the schedule) */
+static short
+CompileScheduleCfg( struct schedule_cfg *c, const char *night, const char *holidays, const char *away,
+                    const char *exercise, char *err )
+{
+    char e[80];
+    short n, rc = 0;
+
+    err[0] = 0;
+    if ( (n = CompileScheduleWindows( night, c->night, e )) < 0 ) {
+        if ( !rc ) sprintf( err, "night_tariff: %s", e );
+        rc = -1;
+        n = 0;
+    }
+    c->n_night = n;
+    if ( (n = CompileScheduleDates( holidays, c->holidays, e )) < 0 ) {
+        if ( !rc ) sprintf( err, "holidays: %s", e );
+        rc = -1;
+        n = 0;
+    }
+    c->n_holidays = n;
+    if ( (n = CompileScheduleDates( away, c->away, e )) < 0 ) {
+        if ( !rc ) sprintf( err, "away: %s", e );
+        rc = -1;
+        n = 0;
+    }
+    c->n_away = n;
+    if ( (n = CompileScheduleWindows( exercise, c->exercise, e )) < 0 ) {
+        if ( !rc ) sprintf( err, "pump_exercise: %s", e );
+        rc = -1;
+        n = 0;
+    }
+    c->n_exercise = n;
+    return rc;
+}
+
+/* Return 1 if hour is in the seasonal night tariff hours START:00-STOP:59, which go past
+midnight only if STOP is before START */
+static short
+sched_in_hours( short hour, short start, short stop )
+{
+    if ( start <= stop ) return ( (hour >= start) && (hour <= stop) );
+    return ( (hour >= start) || (hour <= stop) );
+}
+
+static short
+sched_in_windows( const struct sched_window *w, unsigned short n, short wday, short min )
+{
+    for ( ; n > 0; n--, w++ ) {
+        if ( w->from < w->to ) {
+            if ( ((w->days >> wday) & 1) && (min >= w->from) && (min < w->to) ) return 1;
+        }
+        else {
+            /* past midnight: the evening of its own day, or the morning after the day before */
+            if ( ((w->days >> wday) & 1) && (min >= w->from) ) return 1;
+            if ( ((w->days >> ((wday+6) % 7)) & 1) && (min < w->to) ) return 1;
+        }
+    }
+    return 0;
+}
+
+static short
+sched_on_date( const struct sched_date *d, unsigned short n, long date )
+{
+    long md = date % 10000;
+    for ( ; n > 0; n--, d++ ) {
+        if ( d->from >= 10000 ) {
+            if ( (date >= d->from) && (date <= d->to) ) return 1;
+        }
+        else if ( (d->from <= d->to) ? ((md >= d->from) && (md <= d->to)) : ((md >= d->from) || (md <= d->to)) ) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Build schedule s from config c for SCHED_DAYS days from local midnight of the day now is in */
+static void
+BuildSchedule( struct schedule *s, const struct schedule_cfg *c, time_t now )
+{
+    struct sched_minute *e;
+    struct tm tm;
+    time_t t;
+    long i, n, date;
+    short min, winter;
+
+    localtime_r( &now, &tm );
+    tm.tm_hour = 0;
+    tm.tm_min = 0;
+    tm.tm_sec = 0;
+    tm.tm_isdst = -1;
+    s->start = mktime( &tm );
+    tm.tm_mday += SCHED_DAYS;
+    tm.tm_hour = 0;
+    tm.tm_isdst = -1;
+    s->minutes = (long)(mktime( &tm ) - s->start) / 60;
+    if ( (s->minutes <= 0) || (s->minutes > SCHED_SIZE - SCHED_AHEAD) ) s->minutes = SCHED_SIZE - SCHED_AHEAD;
+    n = s->minutes + SCHED_AHEAD;
+
+    for (i=0;i<n;i++) {
+        t = s->start + i*60;
+        localtime_r( &t, &tm );
+        e = &s->m[i];
+        min = tm.tm_hour*60 + tm.tm_min;
+        date = (long)(tm.tm_year+1900)*10000 + (tm.tm_mon+1)*100 + tm.tm_mday;
+        e->hour = tm.tm_hour;
+        e->month = tm.tm_mon+1;
+        winter = (c->summer_first_month <= c->summer_last_month) ?
+                 ((e->month < c->summer_first_month) || (e->month > c->summer_last_month)) :
+                 ((e->month < c->summer_first_month) && (e->month > c->summer_last_month));
+        e->nestart = winter ? c->nt_winter_start : c->nt_summer_start;
+        e->nestop = winter ? c->nt_winter_stop : c->nt_summer_stop;
+        e->flags = winter ? SCHED_WINTER : 0;
+        if ( c->n_night ? sched_in_windows( c->night, c->n_night, tm.tm_wday, min ) :
+             sched_in_hours( e->hour, e->nestart, e->nestop ) ) e->flags |= SCHED_NIGHT;
+        if ( sched_on_date( c->holidays, c->n_holidays, date ) ) e->flags |= SCHED_NIGHT;
+        if ( sched_on_date( c->away, c->n_away, date ) ) e->flags |= SCHED_AWAY;
+        if ( c->n_exercise ? sched_in_windows( c->exercise, c->n_exercise, tm.tm_wday, min ) :
+             (e->hour == pump_start_hour_for[e->month]) ) e->flags |= SCHED_EXERCISE;
+    }
+    /* count the minutes left of each night tariff backwards from its end */
+    for (i=n-1;i>=0;i--) {
+        e = &s->m[i];
+        if ( !(e->flags & SCHED_NIGHT) ) e->night_left = 0;
+        else if ( i == n-1 ) e->night_left = 1;
+        else e->night_left = (e[1].night_left < 0xffff) ? e[1].night_left + 1 : 0xffff;
+    }
+}
+
+/* Return the schedule entry for time now, or NULL if now is not in the table */
+static const struct sched_minute *
+ScheduleAt( const struct schedule *s, time_t now )
+{
+    if ( (now < s->start) || ((now - s->start) / 60 >= s->minutes) ) return NULL;
+    return &s->m[(now - s->start) / 60];
+}
+
+#endif
@@ -0,0 +1,72 @@
+/*
+* solard_events.h
+*
+* Record format of the solard event log, shared by solard and solard-events.
+*
+* Notable events (start, stop, battery switches, alarms, sensor faults...) are
+* appended to EVENTS_FILE as fixed size records, in the order they happened. Next
+* to it EVENTS_INDEX has one entry per (UTC) day with events: the number of the
+* day's first record and how many records of each severity the day has. A query
+* reads the small index, then only the records of the days it needs - no scanning
+* of the whole log.
+*/
+
+#ifndef SOLARD_EVENTS_H
+#define SOLARD_EVENTS_H
+
+#include <stdint.h>
+
+#define EVENTS_FILE         SOLARD_ROOT "/var/log/solard_events"
+#define EVENTS_INDEX        SOLARD_ROOT "/var/log/solard_events.idx"
+
+/* severities */
+#define EV_INFO             0
+#define EV_WARNING          1
+#define EV_ALARM            2
+#define EV_SEVERITIES       3
+
+/* event codes - id and values[] meaning in the comments */
+#define EV_START            1   /* id: 0 afresh, 1 state resumed, 2 taken over from previous executable */
+#define EV_STOP             2   /* terminate signal */
+#define EV_CONFIG           3   /* config re-read; values: mode, wanted temp */
+#define EV_HANDOVER         4   /* handing over to new executable */
+#define EV_BATTERY          5   /* switched to battery power */
+#define EV_GRID             6   /* back on grid power */
+#define EV_EMERGENCY        7   /* emergency cooling on; values: furnace, solar collector, boiler high temps */
+#define EV_EMERGENCY_OVER   8   /* critical condition resolved; values as above */
+#define EV_SENSOR_FAULT     9   /* id: sensor; values: read status, error counter */
+#define EV_SENSOR_OK        10  /* id: sensor back to normal; values: temp */
+#define EV_SENSOR_STOP      11  /* too many sensor errors - stopping; id: sensor */
+#define EV_GPIO_FAIL        12  /* GPIO set up failed - aborting */
+#define EV_RULES_ERROR      13  /* errors in the rules file */
+#define EV_COUNTERS_RESET   14  /* monthly power counters reset; values: nightly, total Wh */
+#define EV_ANOMALY          15  /* weak response to a pump or valve switching on; id: which response;
+                                   values: change, usual change, score */
+#define EV_CODES            16
+
+static const char * const event_severity_names[EV_SEVERITIES] = { "INFO", "WARNING", "ALARM" };
+
+static const char * const event_names[EV_CODES] = {
+    "none", "start", "stop", "config", "handover", "battery", "grid", "emergency", "emergency_over",
+    "sensor_fault", "sensor_ok", "sensor_stop", "gpio_fail", "rules_error", "counters_reset",
+    "anomaly"
+};
+
+struct event_record {
+    int64_t         time;           /* seconds since the epoch */
+    uint16_t        code;
+    uint8_t         severity;
+    uint8_t         reserved;
+    int16_t         id;
+    int16_t         reserved2;
+    float           values[3];
+    uint32_t        reserved3;
+};
+
+struct event_day {
+    int64_t         day;            /* time / 86400 */
+    uint32_t        first;          /* number of the day's first record */
+    uint32_t        count[EV_SEVERITIES];
+};
+
+#endif